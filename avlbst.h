@@ -3,13 +3,25 @@
 
 #include <iostream>
 #include <exception>
+#include <stdexcept>
 #include <cstdlib>
+#include <cstddef>
 #include <cstdint>
 #include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include "bst.h"
+#include "bst_tasks.h"
 
 struct KeyError { };
 
+// freeze()'s default index; include eytzinger.h to use it.
+template <class Key, class Value, class Compare>
+class EytzingerIndex;
+
 /**
 * A special kind of node for an AVL tree, which adds the balance as a data member, plus
 * other additional helper functions. You do NOT need to implement any functionality or
@@ -21,372 +33,1862 @@ class AVLNode : public Node<Key, Value>
 public:
     // Constructor/destructor.
     AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    template<typename... ItemArgs>
+    explicit AVLNode(AVLNode<Key, Value>* parent, ItemArgs&&... itemArgs);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
-    // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
-    // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    // Getters for parent, left, and right. These hide the Node versions since they
+    // return pointers to AVLNodes - not plain Nodes. They are resolved statically,
+    // see the Node class in bst.h for more information.
+    AVLNode<Key, Value>* getParent() const;
+    AVLNode<Key, Value>* getLeft() const;
+    AVLNode<Key, Value>* getRight() const;
 
 protected:
     int8_t balance_;    // effectively a signed char
 };
 
 /*
-  -------------------------------------------------
-  Begin implementations for the AVLNode class.
-  -------------------------------------------------
-*/
+  -------------------------------------------------
+  Begin implementations for the AVLNode class.
+  -------------------------------------------------
+*/
+
+/**
+* An explicit constructor to initialize the elements by calling the base class constructor
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
+    Node<Key, Value>(key, value, parent), balance_(0)
+{
+
+}
+
+/**
+* A constructor that builds the item in place, see Node.
+*/
+template<class Key, class Value>
+template<typename... ItemArgs>
+AVLNode<Key, Value>::AVLNode(AVLNode<Key, Value>* parent, ItemArgs&&... itemArgs) :
+    Node<Key, Value>(parent, std::forward<ItemArgs>(itemArgs)...), balance_(0)
+{
+
+}
+
+/**
+* A destructor which does nothing. It must stay that way: the trees destroy
+* nodes through Node, whose destructor is not virtual.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>::~AVLNode()
+{
+
+}
+
+/**
+* A getter for the balance of a AVLNode.
+*/
+template<class Key, class Value>
+int8_t AVLNode<Key, Value>::getBalance() const
+{
+    return balance_;
+}
+
+/**
+* A setter for the balance of a AVLNode.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::setBalance(int8_t balance)
+{
+    balance_ = balance;
+}
+
+/**
+* Adds diff to the balance of a AVLNode.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::updateBalance(int8_t diff)
+{
+    balance_ += diff;
+}
+
+/**
+* Hides Node::getParent since a static_cast is necessary to make sure
+* that our node is a AVLNode.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
+{
+    return static_cast<AVLNode<Key, Value>*>(this->parent_);
+}
+
+/**
+* Hidden for the same reasons as above.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
+{
+    return static_cast<AVLNode<Key, Value>*>(this->left_);
+}
+
+/**
+* Hidden for the same reasons as above.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
+{
+    return static_cast<AVLNode<Key, Value>*>(this->right_);
+}
+
+
+/*
+  -----------------------------------------------
+  End implementations for the AVLNode class.
+  -----------------------------------------------
+*/
+
+
+/**
+* The node of a counting AVLTree (see CountedAVLTree). It also stores the
+* number of nodes in its subtree, itself included, which is what lets the
+* tree answer select() and rank() in O(log n). Trees that do not count
+* use plain AVLNodes and pay nothing for it.
+*/
+template <typename Key, typename Value>
+class CountedAVLNode : public AVLNode<Key, Value>
+{
+public:
+    CountedAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+    template<typename... ItemArgs>
+    explicit CountedAVLNode(AVLNode<Key, Value>* parent, ItemArgs&&... itemArgs);
+
+    // Getter/setter for the number of nodes in this node's subtree.
+    std::size_t getSize() const;
+    void setSize(std::size_t size);
+
+protected:
+    std::size_t size_;
+};
+
+/*
+  ---------------------------------------------------
+  Begin implementations for the CountedAVLNode class.
+  ---------------------------------------------------
+*/
+
+template<class Key, class Value>
+CountedAVLNode<Key, Value>::CountedAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent) :
+    AVLNode<Key, Value>(key, value, parent), size_(1)
+{
+
+}
+
+template<class Key, class Value>
+template<typename... ItemArgs>
+CountedAVLNode<Key, Value>::CountedAVLNode(AVLNode<Key, Value>* parent, ItemArgs&&... itemArgs) :
+    AVLNode<Key, Value>(parent, std::forward<ItemArgs>(itemArgs)...), size_(1)
+{
+
+}
+
+/**
+* A getter for the subtree size of a CountedAVLNode.
+*/
+template<class Key, class Value>
+std::size_t CountedAVLNode<Key, Value>::getSize() const
+{
+    return size_;
+}
+
+/**
+* A setter for the subtree size of a CountedAVLNode.
+*/
+template<class Key, class Value>
+void CountedAVLNode<Key, Value>::setSize(std::size_t size)
+{
+    size_ = size;
+}
+
+/*
+  -------------------------------------------------
+  End implementations for the CountedAVLNode class.
+  -------------------------------------------------
+*/
+
+
+/**
+* An AVL tree. If Counted is set, every node also keeps its subtree size
+* (see CountedAVLNode), which makes size(), select(), rank() and
+* countRange() available; otherwise those do not compile. Counting costs
+* a word per node and a walk to the root on every insert and remove.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> >,
+          bool Counted = false>
+class AVLTree : public BinarySearchTree<Key, Value, Compare, Alloc>
+{
+public:
+    AVLTree();
+    explicit AVLTree(const Compare& comp, const Alloc& alloc = Alloc());
+    explicit AVLTree(const Alloc& alloc);
+    template<class InputIt>
+    AVLTree(InputIt first, InputIt last, const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+    AVLTree(AVLTree&& other);
+    AVLTree& operator=(AVLTree&& other);
+    typedef typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator iterator;
+    typedef typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator const_iterator;
+
+    virtual std::pair<iterator, bool> insert (const std::pair<const Key, Value> &new_item); // TODO
+    virtual std::pair<iterator, bool> insert (std::pair<const Key, Value>&& new_item);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    template<class InputIt>
+    void assign(InputIt first, InputIt last);
+    template<class InputIt>
+    void insertBatch(InputIt first, InputIt last);
+    template<class InputIt>
+    void parallelBuild(InputIt first, InputIt last, unsigned threads = 0);
+
+    // Order statistics, all O(log n); only for a Counted tree
+    std::size_t size() const;
+    iterator select(std::size_t k);
+    const_iterator select(std::size_t k) const;
+    std::size_t rank(const Key& key) const;
+    std::size_t countRange(const Key& lo, const Key& hi) const;
+
+    bool validate() const;
+
+    // An immutable copy laid out for fast lookups, O(n). Index may be
+    // any type built from a sorted range, such as VanEmdeBoasIndex; the
+    // default, EytzingerIndex, needs eytzinger.h.
+    template<class Index = EytzingerIndex<Key, Value, Compare> >
+    Index freeze() const;
+
+    // Moving whole key ranges between trees, O(log n)
+    std::pair<AVLTree, AVLTree> split(const Key& key);
+    static AVLTree join(AVLTree&& left, AVLTree&& right);
+
+    // Set operations taking other's nodes, O(m log(n/m + 1)) for sizes
+    // m <= n. merge(ours, theirs) gives the value for a key in both trees.
+    struct KeepOurs
+    {
+        const Value& operator()(const Value& ours, const Value&) const { return ours; }
+    };
+    template<class Merge = KeepOurs>
+    void unionWith(AVLTree&& other, Merge merge = Merge(), unsigned threads = 0);
+    template<class Merge = KeepOurs>
+    void intersectWith(AVLTree&& other, Merge merge = Merge(), unsigned threads = 0);
+    void differenceWith(AVLTree&& other, unsigned threads = 0);
+protected:
+    // The type of node the tree builds
+    typedef typename std::conditional<Counted, CountedAVLNode<Key, Value>, AVLNode<Key, Value> >::type NodeType;
+
+    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft);
+    virtual void removeNode(Node<Key, Value>* node);
+    void detachNode(AVLNode<Key,Value>* node);
+
+    // Add helper functions here
+    bool insertFix(AVLNode<Key,Value>* node);
+    void removeFix(AVLNode<Key,Value>* node, int8_t diff);
+    AVLNode<Key,Value>* rebalance(AVLNode<Key,Value>* node, int8_t side);
+    void rotateUp(AVLNode<Key,Value>* node, int8_t side);
+    static AVLNode<Key,Value>* childOn(AVLNode<Key,Value>* node, int8_t side);
+    AVLNode<Key,Value>* selectNode(std::size_t k) const;
+    static std::size_t sizeOf(AVLNode<Key,Value>* node);
+    static void setSizeOf(AVLNode<Key,Value>* node, std::size_t size);
+    static void resize(AVLNode<Key,Value>* node);
+    static void adjustSizes(AVLNode<Key,Value>* node, std::ptrdiff_t diff);
+    void rotateLeft(AVLNode<Key,Value>* Node);
+    void rotateRight(AVLNode<Key,Value>* Node);
+
+    // Split and join helpers. They work on detached subtrees and carry
+    // subtree heights along, since nodes only store balances.
+    struct Pieces
+    {
+        AVLNode<Key,Value>* below;
+        int belowHeight;
+        AVLNode<Key,Value>* match;
+        AVLNode<Key,Value>* above;
+        int aboveHeight;
+    };
+    Pieces splitAt(AVLNode<Key,Value>* node, int height, const Key& key);
+    std::pair<AVLNode<Key,Value>*, int> joinAt(AVLNode<Key,Value>* left, int leftHeight, AVLNode<Key,Value>* middle,
+                                               AVLNode<Key,Value>* right, int rightHeight);
+    std::pair<AVLNode<Key,Value>*, int> joinPieces(AVLNode<Key,Value>* left, int leftHeight,
+                                                   AVLNode<Key,Value>* right, int rightHeight);
+    std::pair<AVLNode<Key,Value>*, int> splitLast(AVLNode<Key,Value>* node, int height, AVLNode<Key,Value>*& last);
+    static void expose(AVLNode<Key,Value>* node, int height, AVLNode<Key,Value>*& left, int& leftHeight,
+                       AVLNode<Key,Value>*& right, int& rightHeight);
+    static int heightOf(AVLNode<Key,Value>* node);
+    static void attach(AVLNode<Key,Value>* parent, int8_t side, AVLNode<Key,Value>* child);
+    AVLNode<Key,Value>* detachRoot();
+    void shareNodes(AVLTree& other);
+
+    // Set operation helpers. Nodes that leave the result are collected in
+    // dropped and destroyed once all threads are done, so the pool is only
+    // touched from the calling thread.
+    static const std::size_t PARALLEL_GRAIN = 4096;
+    static const int PARALLEL_HEIGHT = 13;      // 609 to 8191 nodes
+    template<class Merge>
+    std::pair<AVLNode<Key,Value>*, int> unionAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                                int theirHeight, Merge& merge, unsigned threads,
+                                                std::vector<AVLNode<Key,Value>*>& dropped);
+    template<class Merge>
+    std::pair<AVLNode<Key,Value>*, int> intersectAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                                    int theirHeight, Merge& merge, unsigned threads,
+                                                    std::vector<AVLNode<Key,Value>*>& dropped);
+    std::pair<AVLNode<Key,Value>*, int> differenceAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                                     int theirHeight, unsigned threads,
+                                                     std::vector<AVLNode<Key,Value>*>& dropped);
+    template<class Lower, class Upper>
+    static void forkJoin(bool parallel, Lower lower, Upper upper);
+    static unsigned threadCount(unsigned threads);
+    void finishSetOperation(AVLNode<Key,Value>* root, std::vector<AVLNode<Key,Value>*>& dropped);
+
+    // Bulk construction helpers
+    template<class ForwardIt>
+    void assignRange(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    template<class InputIt>
+    void assignRange(InputIt first, InputIt last, std::input_iterator_tag);
+    template<class It>
+    void buildFromSorted(It first, std::size_t count);
+    template<class It>
+    AVLNode<Key,Value>* buildSubtree(It& next, std::size_t count, AVLNode<Key,Value>* parent);
+    static int8_t perfectHeight(std::size_t count);
+
+    // Parallel bulk construction helpers. They sort and build from arrays
+    // of pointers to the items, kept in input order until sorted.
+    template<class ForwardIt>
+    void parallelBuildRange(ForwardIt first, ForwardIt last, unsigned threads, std::forward_iterator_tag);
+    template<class InputIt>
+    void parallelBuildRange(InputIt first, InputIt last, unsigned threads, std::input_iterator_tag);
+    template<class Ptr>
+    void buildFromOrder(std::vector<Ptr>& order, unsigned threads);
+    template<class Ptr>
+    void sortByKey(Ptr* order, Ptr* buffer, std::size_t count, unsigned threads, bool intoBuffer) const;
+    template<class Ptr>
+    void mergeByKey(Ptr* lower, std::size_t lowerCount, Ptr* upper, std::size_t upperCount, Ptr* out,
+                    unsigned threads) const;
+    template<class Ptr>
+    std::size_t keepLast(Ptr* from, std::size_t count, Ptr* to, unsigned threads) const;
+    template<class Ptr>
+    AVLNode<Key,Value>* buildParallel(Ptr* order, void** slots, char* built, std::size_t count,
+                                      AVLNode<Key,Value>* parent, unsigned threads);
+    template<class Item>
+    static AVLNode<Key,Value>* makeNode(void* slot, AVLNode<Key,Value>* parent, const Item* item);
+    static AVLNode<Key,Value>* makeNode(void* slot, AVLNode<Key,Value>* parent, std::pair<Key, Value>* item);
+    template<class Body>
+    static void runChunks(unsigned chunks, Body body);
+    template<class Body>
+    static void runChunks(unsigned first, unsigned last, Body& body);
+};
+
+/**
+* An AVLTree that counts subtree sizes, for select(), rank() and the like.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> > >
+using CountedAVLTree = AVLTree<Key, Value, Compare, Alloc, true>;
+
+/**
+* Constructs an empty tree whose pool hands out AVLNode-sized slots.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>::AVLTree() :
+    BinarySearchTree<Key, Value, Compare, Alloc>(sizeof(NodeType), Compare(), Alloc())
+{
+
+}
+
+/**
+* Constructs an empty tree ordered by the given comparator, whose node
+* chunks come from the given allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>::AVLTree(const Compare& comp, const Alloc& alloc) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(sizeof(NodeType), comp, alloc)
+{
+
+}
+
+/**
+* Constructs an empty tree whose node chunks come from the given allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>::AVLTree(const Alloc& alloc) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(sizeof(NodeType), Compare(), alloc)
+{
+
+}
+
+/**
+* Constructs a perfectly balanced tree holding the given key/value pairs,
+* see assign().
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+AVLTree<Key, Value, Compare, Alloc, Counted>::AVLTree(InputIt first, InputIt last, const Compare& comp, const Alloc& alloc) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(sizeof(NodeType), comp, alloc)
+{
+    assign(first, last);
+}
+
+/**
+* Takes over other's nodes, see BinarySearchTree.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>::AVLTree(AVLTree&& other) :
+    BinarySearchTree<Key, Value, Compare, Alloc>(std::move(other))
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>& AVLTree<Key, Value, Compare, Alloc, Counted>::operator=(AVLTree&& other)
+{
+    BinarySearchTree<Key, Value, Compare, Alloc>::operator=(std::move(other));
+    return *this;
+}
+
+/**
+* Replaces the contents of the tree with the given key/value pairs in
+* O(n), building a perfectly balanced tree with no rotations. A range of
+* forward iterators that is already strictly sorted by key is read in
+* place; anything else is copied and sorted first. If a key appears more
+* than once, the last occurrence wins, as with repeated insert() calls.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::assign(InputIt first, InputIt last)
+{
+    this->clear();
+    assignRange(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+/**
+* Builds straight from the range when it is strictly sorted, which costs
+* one extra pass to check.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class ForwardIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::assignRange(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    std::size_t count = 0;
+    bool sorted = true;
+    for (ForwardIt prev = first, it = first; it != last; prev = it++, ++count)
+    {
+        if (count > 0 && !this->comp_((*prev).first, (*it).first))
+        {
+            sorted = false;
+            break;
+        }
+    }
+    if (sorted)
+    {
+        buildFromSorted(first, count);
+    }
+    else
+    {
+        assignRange(first, last, std::input_iterator_tag());
+    }
+}
+
+/**
+* Copies the range, sorts it by key and drops all but the last of each
+* run of equal keys before building.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::assignRange(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    typedef std::pair<Key, Value> Item;
+    std::vector<Item> items(first, last);
+    // Order by key alone so stable_sort keeps equal keys in input order
+    const Compare& comp = this->comp_;
+    std::stable_sort(items.begin(), items.end(),
+                     [&comp](const Item& lhs, const Item& rhs) { return comp(lhs.first, rhs.first); });
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < items.size(); ++i)
+    {
+        // a later equal key overwrites this one
+        if (i + 1 < items.size() && !comp(items[i].first, items[i + 1].first))
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            items[kept] = std::move(items[i]);
+        }
+        ++kept;
+    }
+    items.erase(items.begin() + kept, items.end());
+    buildFromSorted(items.begin(), items.size());
+}
+
+/**
+* Builds the tree from count strictly sorted pairs starting at first.
+* The tree must be empty. If building throws, the nodes built so far
+* have already been destroyed.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class It>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::buildFromSorted(It first, std::size_t count)
+{
+    this->root_ = buildSubtree(first, count, nullptr);
+    this->resetExtremes();
+}
+
+/**
+* Builds a perfectly balanced subtree from the next count pairs, in order:
+* the left half, then the middle node, then the right half. The right half
+* gets the extra node when count is even, so every balance is 0 or +1 and
+* can be set directly from the sizes of the two halves.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class It>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::buildSubtree(It& next, std::size_t count, AVLNode<Key,Value>* parent)
+{
+    if (count == 0)
+    {
+        return nullptr;
+    }
+    std::size_t leftCount = (count - 1) / 2;
+    std::size_t rightCount = count - 1 - leftCount;
+    AVLNode<Key,Value>* left = buildSubtree(next, leftCount, nullptr);
+    AVLNode<Key,Value>* node = nullptr;
+    try
+    {
+        node = this->template createNode<NodeType>(static_cast<NodeType*>(parent), (*next).first, (*next).second);
+    }
+    catch (...)
+    {
+        this->destroyAll(left);
+        throw;
+    }
+    ++next;
+    node->setLeft(left);
+    if (left != nullptr)
+    {
+        left->setParent(node);
+    }
+    try
+    {
+        node->setRight(buildSubtree(next, rightCount, node));
+    }
+    catch (...)
+    {
+        this->destroyAll(node);
+        throw;
+    }
+    node->setBalance(perfectHeight(rightCount) - perfectHeight(leftCount));
+    setSizeOf(node, count);
+    return node;
+}
+
+/**
+* The height of a perfectly balanced tree of count nodes, which is the
+* number of bits in count.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+int8_t AVLTree<Key, Value, Compare, Alloc, Counted>::perfectHeight(std::size_t count)
+{
+    int8_t height = 0;
+    while (count != 0)
+    {
+        ++height;
+        count >>= 1;
+    }
+    return height;
+}
+
+/**
+* Replaces the contents of the tree with the given key/value pairs, like
+* assign() and with the same result, using up to threads threads (0 means
+* one per hardware thread). The pairs are merge sorted by key in parallel,
+* the last of each run of equal keys is kept, and the two halves of every
+* subtree are built concurrently. Slots are taken from the pool up front
+* on the calling thread, so the pool is never shared. If copying or moving
+* a Key or Value throws, the exception is rethrown on the calling thread
+* once every task is done, and the tree is left empty.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::parallelBuild(InputIt first, InputIt last, unsigned threads)
+{
+    // pairs can only be pointed at where they are if *first is an lvalue
+    typedef typename std::iterator_traits<InputIt>::reference Reference;
+    typedef typename std::conditional<std::is_lvalue_reference<Reference>::value,
+                                      typename std::iterator_traits<InputIt>::iterator_category,
+                                      std::input_iterator_tag>::type Category;
+    this->clear();
+    parallelBuildRange(first, last, threadCount(threads), Category());
+}
+
+/**
+* Sorts pointers to the pairs where they are, and copies them into nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class ForwardIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::parallelBuildRange(ForwardIt first, ForwardIt last, unsigned threads,
+                                                             std::forward_iterator_tag)
+{
+    typedef typename std::iterator_traits<ForwardIt>::value_type Item;
+    std::vector<const Item*> order;
+    order.reserve(std::distance(first, last));
+    for (; first != last; ++first)
+    {
+        order.push_back(std::addressof(*first));
+    }
+    buildFromOrder(order, threads);
+}
+
+/**
+* Single pass ranges, and ranges that yield temporaries or rvalues, are
+* copied (or moved) out first and then moved into nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::parallelBuildRange(InputIt first, InputIt last, unsigned threads,
+                                                             std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items(first, last);
+    std::vector<std::pair<Key, Value>*> order(items.size());
+    for (std::size_t i = 0; i < items.size(); ++i)
+    {
+        order[i] = &items[i];
+    }
+    buildFromOrder(order, threads);
+}
+
+/**
+* Sorts order, drops duplicate keys and builds the tree from what is left.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Ptr>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::buildFromOrder(std::vector<Ptr>& order, unsigned threads)
+{
+    std::size_t count = order.size();
+    std::vector<Ptr> buffer(count);
+    sortByKey(order.data(), buffer.data(), count, threads, false);
+    std::size_t kept = keepLast(order.data(), count, buffer.data(), threads);
+    std::vector<Ptr>().swap(order);
+
+    this->settlePool();
+    std::vector<void*> slots(kept);
+    for (std::size_t i = 0; i < kept; ++i)
+    {
+        try
+        {
+            slots[i] = this->pool_->allocate();
+        }
+        catch (...)
+        {
+            while (i > 0)
+            {
+                this->pool_->deallocate(slots[--i]);
+            }
+            throw;
+        }
+    }
+    std::vector<char> built(kept, 0);
+    try
+    {
+        this->root_ = buildParallel(buffer.data(), slots.data(), built.data(), kept, nullptr, threads);
+    }
+    catch (...)
+    {
+        // the tasks that failed left their subtrees half linked, so
+        // go by slot: destroy what was built, hand back the rest
+        for (std::size_t i = 0; i < kept; ++i)
+        {
+            if (built[i])
+            {
+                this->destroyNode(static_cast<NodeType*>(slots[i]));
+            }
+            else
+            {
+                this->pool_->deallocate(slots[i]);
+            }
+        }
+        throw;
+    }
+    this->resetExtremes();
+}
+
+/**
+* Stable merge sort of count pointers by key. The sorted result ends up
+* in buffer if intoBuffer is set and in order otherwise; the halves are
+* sorted into the other array so that every merge moves pointers across.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Ptr>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::sortByKey(Ptr* order, Ptr* buffer, std::size_t count, unsigned threads,
+                                                    bool intoBuffer) const
+{
+    if (threads <= 1 || count < PARALLEL_GRAIN)
+    {
+        Ptr* target = order;
+        if (intoBuffer)
+        {
+            target = std::copy(order, order + count, buffer) - count;
+        }
+        const Compare& comp = this->comp_;
+        std::stable_sort(target, target + count, [&comp](Ptr lhs, Ptr rhs) { return comp(lhs->first, rhs->first); });
+        return;
+    }
+    std::size_t half = count / 2;
+    forkJoin(true,
+        [&]() { sortByKey(order, buffer, half, threads / 2, !intoBuffer); },
+        [&]() { sortByKey(order + half, buffer + half, count - half, threads - threads / 2, !intoBuffer); });
+    Ptr* from = intoBuffer ? order : buffer;
+    Ptr* to = intoBuffer ? buffer : order;
+    mergeByKey(from, half, from + half, count - half, to, threads);
+}
+
+/**
+* Merges two sorted runs into out, keeping lower's entries ahead of
+* upper's equal ones. A big merge splits the longer run in the middle,
+* finds the matching cut in the other run, and merges both sides
+* concurrently.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Ptr>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::mergeByKey(Ptr* lower, std::size_t lowerCount, Ptr* upper,
+                                                     std::size_t upperCount, Ptr* out, unsigned threads) const
+{
+    const Compare& comp = this->comp_;
+    auto before = [&comp](Ptr lhs, Ptr rhs) { return comp(lhs->first, rhs->first); };
+    if (threads <= 1 || lowerCount + upperCount < PARALLEL_GRAIN)
+    {
+        std::merge(lower, lower + lowerCount, upper, upper + upperCount, out, before);
+        return;
+    }
+    std::size_t lowerCut;
+    std::size_t upperCut;
+    if (lowerCount >= upperCount)
+    {
+        // upper's entries equal to the cut key go after it
+        lowerCut = lowerCount / 2;
+        upperCut = std::lower_bound(upper, upper + upperCount, lower[lowerCut], before) - upper;
+    }
+    else
+    {
+        // lower's entries equal to the cut key go before it
+        upperCut = upperCount / 2;
+        lowerCut = std::upper_bound(lower, lower + lowerCount, upper[upperCut], before) - lower;
+    }
+    forkJoin(true,
+        [&]() { mergeByKey(lower, lowerCut, upper, upperCut, out, threads / 2); },
+        [&]() { mergeByKey(lower + lowerCut, lowerCount - lowerCut, upper + upperCut, upperCount - upperCut,
+                           out + lowerCut + upperCut, threads - threads / 2); });
+}
+
+/**
+* Copies the last entry of each run of equal keys in the sorted array
+* from into to, and returns how many were kept. Each thread counts its
+* share first, so that all of them know where to start writing.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Ptr>
+std::size_t AVLTree<Key, Value, Compare, Alloc, Counted>::keepLast(Ptr* from, std::size_t count, Ptr* to,
+                                                          unsigned threads) const
+{
+    unsigned chunks = count < PARALLEL_GRAIN ? 1 : threads;
+    std::vector<std::size_t> offsets(chunks + 1, 0);
+    const Compare& comp = this->comp_;
+    auto kept = [&](std::size_t i) { return i + 1 == count || comp(from[i]->first, from[i + 1]->first); };
+    runChunks(chunks, [&](unsigned chunk)
+    {
+        for (std::size_t i = count * chunk / chunks; i < count * (chunk + 1) / chunks; ++i)
+        {
+            offsets[chunk + 1] += kept(i);
+        }
+    });
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    runChunks(chunks, [&](unsigned chunk)
+    {
+        Ptr* next = to + offsets[chunk];
+        for (std::size_t i = count * chunk / chunks; i < count * (chunk + 1) / chunks; ++i)
+        {
+            if (kept(i))
+            {
+                *next++ = from[i];
+            }
+        }
+    });
+    return offsets[chunks];
+}
+
+/**
+* Builds the same perfectly balanced subtree as buildSubtree() from count
+* sorted entries, with one preallocated slot per entry. The middle node
+* is built first and the two halves below it concurrently. built[i] is
+* set once the node in slots[i] is constructed, so that a failed build
+* can be undone.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Ptr>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::buildParallel(Ptr* order, void** slots, char* built,
+                                                                                std::size_t count,
+                                                                                AVLNode<Key,Value>* parent,
+                                                                                unsigned threads)
+{
+    if (count == 0)
+    {
+        return nullptr;
+    }
+    std::size_t leftCount = (count - 1) / 2;
+    std::size_t rightCount = count - 1 - leftCount;
+    AVLNode<Key,Value>* node = makeNode(slots[leftCount], parent, order[leftCount]);
+    built[leftCount] = 1;
+    AVLNode<Key,Value>* left;
+    AVLNode<Key,Value>* right;
+    forkJoin(threads > 1 && count >= PARALLEL_GRAIN,
+        [&]() { left = buildParallel(order, slots, built, leftCount, node, threads / 2); },
+        [&]() { right = buildParallel(order + leftCount + 1, slots + leftCount + 1, built + leftCount + 1, rightCount,
+                                      node, threads - threads / 2); });
+    node->setLeft(left);
+    node->setRight(right);
+    node->setBalance(perfectHeight(rightCount) - perfectHeight(leftCount));
+    setSizeOf(node, count);
+    return node;
+}
+
+/**
+* Builds a node in slot, copying a caller's pair or moving a pair that
+* parallelBuild copied out itself.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Item>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::makeNode(void* slot, AVLNode<Key,Value>* parent,
+                                                                  const Item* item)
+{
+    return new (slot) NodeType(parent, item->first, item->second);
+}
+
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::makeNode(void* slot, AVLNode<Key,Value>* parent,
+                                                                  std::pair<Key, Value>* item)
+{
+    return new (slot) NodeType(parent, std::move(item->first), std::move(item->second));
+}
+
+/**
+* Calls body(chunk) for every chunk below chunks, spread over the worker
+* pool.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Body>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::runChunks(unsigned chunks, Body body)
+{
+    runChunks(0, chunks, body);
+}
+
+/**
+* Calls body(chunk) for first <= chunk < last, handing the lower half of
+* the range to the pool and running the upper half on this thread.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Body>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::runChunks(unsigned first, unsigned last, Body& body)
+{
+    if (last - first <= 1)
+    {
+        if (first != last)
+        {
+            body(first);
+        }
+        return;
+    }
+    unsigned middle = first + (last - first) / 2;
+    forkJoin(true, [&]() { runChunks(first, middle, body); }, [&]() { runChunks(middle, last, body); });
+}
+
+/**
+* Splits the tree at key: the first tree gets the keys below key and the
+* second the keys from key up. This tree is left empty. Only O(log n)
+* nodes on the search path are touched; whole subtrees hanging off it
+* move over as they are. No node is copied, so the two halves share
+* this tree's node pool, which locks while they both hold it; this tree
+* gets a fresh pool. Once either half is gone, the other stops locking.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<AVLTree<Key, Value, Compare, Alloc, Counted>, AVLTree<Key, Value, Compare, Alloc, Counted> >
+AVLTree<Key, Value, Compare, Alloc, Counted>::split(const Key& key)
+{
+    AVLNode<Key,Value>* root = detachRoot();
+    Pieces pieces = splitAt(root, heightOf(root), key);
+    if (pieces.match != nullptr)
+    {
+        std::pair<AVLNode<Key,Value>*, int> above = joinAt(nullptr, 0, pieces.match, pieces.above, pieces.aboveHeight);
+        pieces.above = above.first;
+    }
+
+    AVLTree below(this->comp_, this->pool_->allocator());
+    AVLTree above(this->comp_, this->pool_->allocator());
+    if (pieces.below != nullptr && pieces.above != nullptr)
+    {
+        this->pool_->setSynchronized();
+    }
+    if (pieces.below != nullptr)
+    {
+        below.adoptNodes(pieces.below, this->pool_);
+    }
+    if (pieces.above != nullptr)
+    {
+        above.adoptNodes(pieces.above, this->pool_);
+    }
+    this->ownPool();
+    return std::make_pair(std::move(below), std::move(above));
+}
+
+/**
+* Joins two trees where every key in left is below every key in right,
+* and returns the result; both arguments are left empty. Costs O(log n)
+* when both trees share a pool (as the halves of a split do) or right
+* is the only owner of its pool, whose chunks then move to left's pool.
+* Otherwise right's items are copied into left's pool in O(m) first.
+* Throws std::invalid_argument if the key ranges overlap.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>
+AVLTree<Key, Value, Compare, Alloc, Counted>::join(AVLTree&& left, AVLTree&& right)
+{
+    if (right.empty())
+    {
+        return std::move(left);
+    }
+    if (left.empty())
+    {
+        return std::move(right);
+    }
+    if (!left.comp_(left.rightmost_->getKey(), right.leftmost_->getKey()))
+    {
+        throw std::invalid_argument("AVLTree::join: key ranges overlap");
+    }
+    left.shareNodes(right);
+    // right's smallest node becomes the join key
+    AVLNode<Key,Value>* middle = static_cast<AVLNode<Key,Value>*>(right.leftmost_);
+    right.detachNode(middle);
+    AVLNode<Key,Value>* rightRoot = right.detachRoot();
+    right.ownPool();
+
+    AVLTree result(std::move(left));
+    AVLNode<Key,Value>* leftRoot = result.detachRoot();
+    result.root_ = result.joinAt(leftRoot, heightOf(leftRoot), middle, rightRoot, heightOf(rightRoot)).first;
+    result.resetExtremes();
+    return result;
+}
+
+/**
+* Adds other's items to this tree. For a key in both trees the value
+* becomes merge(ours, theirs); by default ours is kept. other is left
+* empty. Both trees are cut along each other's keys and put back
+* together with joins, which costs O(m log(n/m + 1)) for sizes m <= n.
+* The two halves of every cut are combined independently on the shared
+* worker pool, up to threads at a time (0 means one per hardware
+* thread), so merge and the comparator must be safe to call concurrently
+* and must not throw.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Merge>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::unionWith(AVLTree&& other, Merge merge, unsigned threads)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    shareNodes(other);
+    AVLNode<Key,Value>* ours = detachRoot();
+    AVLNode<Key,Value>* theirs = other.detachRoot();
+    other.ownPool();
+    std::vector<AVLNode<Key,Value>*> dropped;
+    std::pair<AVLNode<Key,Value>*, int> result =
+        unionAt(ours, heightOf(ours), theirs, heightOf(theirs), merge, threadCount(threads), dropped);
+    finishSetOperation(result.first, dropped);
+}
+
+/**
+* Keeps only the keys that are also in other, with the value
+* merge(ours, theirs); by default ours is kept. other is left empty.
+* Costs and threading as for unionWith.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Merge>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::intersectWith(AVLTree&& other, Merge merge, unsigned threads)
+{
+    if (&other == this)
+    {
+        return;
+    }
+    shareNodes(other);
+    AVLNode<Key,Value>* ours = detachRoot();
+    AVLNode<Key,Value>* theirs = other.detachRoot();
+    other.ownPool();
+    std::vector<AVLNode<Key,Value>*> dropped;
+    std::pair<AVLNode<Key,Value>*, int> result =
+        intersectAt(ours, heightOf(ours), theirs, heightOf(theirs), merge, threadCount(threads), dropped);
+    finishSetOperation(result.first, dropped);
+}
+
+/**
+* Removes every key that is in other. other is left empty. Costs and
+* threading as for unionWith.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::differenceWith(AVLTree&& other, unsigned threads)
+{
+    if (&other == this)
+    {
+        this->clear();
+        return;
+    }
+    shareNodes(other);
+    AVLNode<Key,Value>* ours = detachRoot();
+    AVLNode<Key,Value>* theirs = other.detachRoot();
+    other.ownPool();
+    std::vector<AVLNode<Key,Value>*> dropped;
+    std::pair<AVLNode<Key,Value>*, int> result =
+        differenceAt(ours, heightOf(ours), theirs, heightOf(theirs), threadCount(threads), dropped);
+    finishSetOperation(result.first, dropped);
+}
+
+/**
+* Splits the detached subtree under node, of the given height, into the
+* keys below key, the node matching key (if any) and the keys above it.
+* Each level of the descent joins the subtree it did not enter back onto
+* the piece growing on that side. A join costs the height difference of
+* its inputs, and these telescope along the path, so the whole split is
+* O(height).
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+typename AVLTree<Key, Value, Compare, Alloc, Counted>::Pieces
+AVLTree<Key, Value, Compare, Alloc, Counted>::splitAt(AVLNode<Key,Value>* node, int height, const Key& key)
+{
+    Pieces pieces = { nullptr, 0, nullptr, nullptr, 0 };
+    if (node == nullptr)
+    {
+        return pieces;
+    }
+    AVLNode<Key,Value>* left;
+    AVLNode<Key,Value>* right;
+    int leftHeight;
+    int rightHeight;
+    expose(node, height, left, leftHeight, right, rightHeight);
+    int order = this->compareKeys(key, node->getKey());
+    if (order == 0)
+    {
+        Pieces found = { left, leftHeight, node, right, rightHeight };
+        return found;
+    }
+    if (order < 0)
+    {
+        pieces = splitAt(left, leftHeight, key);
+        std::pair<AVLNode<Key,Value>*, int> joined = joinAt(pieces.above, pieces.aboveHeight, node, right, rightHeight);
+        pieces.above = joined.first;
+        pieces.aboveHeight = joined.second;
+    }
+    else
+    {
+        pieces = splitAt(right, rightHeight, key);
+        std::pair<AVLNode<Key,Value>*, int> joined = joinAt(left, leftHeight, node, pieces.below, pieces.belowHeight);
+        pieces.below = joined.first;
+        pieces.belowHeight = joined.second;
+    }
+    return pieces;
+}
+
+/**
+* Joins the detached subtrees left and right, whose keys are below and
+* above middle's, with middle between them. Returns the new top and its
+* height. If the heights are within one, middle is the new top.
+* Otherwise middle replaces the first node on the taller tree's inner
+* spine that is at most one level taller than the shorter tree, takes
+* that node and the shorter tree as children, and the growth is fixed on
+* the way up as after an insert. Costs O(|leftHeight - rightHeight| + 1).
+* Rotations only move root_ when they turn the tree's actual root, so
+* callers working on pieces detach the root first and set it at the end.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::joinAt(AVLNode<Key,Value>* left, int leftHeight, AVLNode<Key,Value>* middle,
+                                            AVLNode<Key,Value>* right, int rightHeight)
+{
+    middle->setParent(nullptr);
+    if (leftHeight <= rightHeight + 1 && rightHeight <= leftHeight + 1)
+    {
+        attach(middle, -1, left);
+        attach(middle, 1, right);
+        middle->setBalance(rightHeight - leftHeight);
+        resize(middle);
+        return std::make_pair(middle, std::max(leftHeight, rightHeight) + 1);
+    }
+    // side is the side of the taller tree's spine that faces the shorter tree
+    int8_t side = leftHeight > rightHeight ? 1 : -1;
+    AVLNode<Key,Value>* tall = side > 0 ? left : right;
+    AVLNode<Key,Value>* low = side > 0 ? right : left;
+    int tallHeight = side > 0 ? leftHeight : rightHeight;
+    int lowHeight = side > 0 ? rightHeight : leftHeight;
+
+    AVLNode<Key,Value>* parent = nullptr;
+    AVLNode<Key,Value>* spot = tall;
+    int spotHeight = tallHeight;
+    while (spotHeight > lowHeight + 1)
+    {
+        spotHeight -= (spot->getBalance() == -side) ? 2 : 1;
+        parent = spot;
+        spot = childOn(spot, side);
+    }
+    attach(middle, -side, spot);
+    attach(middle, side, low);
+    attach(parent, side, middle);
+    middle->setBalance(side * (lowHeight - spotHeight));
+    resize(middle);
+    adjustSizes(parent, sizeOf(low) + 1);
+    bool grew = insertFix(middle);
+    while (tall->getParent() != nullptr)
+    {
+        tall = tall->getParent();
+    }
+    return std::make_pair(tall, grew ? tallHeight + 1 : tallHeight);
+}
+
+/**
+* Joins left and right, whose keys are all below right's, without a
+* middle node: left's largest node is split off to play that part.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::joinPieces(AVLNode<Key,Value>* left, int leftHeight,
+                                                AVLNode<Key,Value>* right, int rightHeight)
+{
+    if (left == nullptr)
+    {
+        return std::make_pair(right, rightHeight);
+    }
+    if (right == nullptr)
+    {
+        return std::make_pair(left, leftHeight);
+    }
+    AVLNode<Key,Value>* last;
+    std::pair<AVLNode<Key,Value>*, int> rest = splitLast(left, leftHeight, last);
+    return joinAt(rest.first, rest.second, last, right, rightHeight);
+}
+
+/**
+* Takes the largest node out of the detached, non-empty subtree under
+* node. Returns what is left and its height; last is the node taken.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::splitLast(AVLNode<Key,Value>* node, int height, AVLNode<Key,Value>*& last)
+{
+    AVLNode<Key,Value>* left;
+    AVLNode<Key,Value>* right;
+    int leftHeight;
+    int rightHeight;
+    expose(node, height, left, leftHeight, right, rightHeight);
+    if (right == nullptr)
+    {
+        last = node;
+        return std::make_pair(left, leftHeight);
+    }
+    std::pair<AVLNode<Key,Value>*, int> rest = splitLast(right, rightHeight, last);
+    return joinAt(left, leftHeight, node, rest.first, rest.second);
+}
+
+/**
+* Unlinks node from both its children, leaving three detached pieces,
+* and reports the children and their heights.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::expose(AVLNode<Key,Value>* node, int height, AVLNode<Key,Value>*& left,
+                                                 int& leftHeight, AVLNode<Key,Value>*& right, int& rightHeight)
+{
+    left = node->getLeft();
+    right = node->getRight();
+    leftHeight = height - (node->getBalance() > 0 ? 2 : 1);
+    rightHeight = height - (node->getBalance() < 0 ? 2 : 1);
+    if (left != nullptr)
+    {
+        left->setParent(nullptr);
+    }
+    if (right != nullptr)
+    {
+        right->setParent(nullptr);
+    }
+    node->setLeft(nullptr);
+    node->setRight(nullptr);
+}
+
+/**
+* The height of the subtree under node, found by following the taller
+* child down, O(height).
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+int AVLTree<Key, Value, Compare, Alloc, Counted>::heightOf(AVLNode<Key,Value>* node)
+{
+    int height = 0;
+    while (node != nullptr)
+    {
+        ++height;
+        node = node->getBalance() < 0 ? node->getLeft() : node->getRight();
+    }
+    return height;
+}
+
+/**
+* Makes child (possibly nullptr) parent's child on the given side.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::attach(AVLNode<Key,Value>* parent, int8_t side, AVLNode<Key,Value>* child)
+{
+    if (side < 0)
+    {
+        parent->setLeft(child);
+    }
+    else
+    {
+        parent->setRight(child);
+    }
+    if (child != nullptr)
+    {
+        child->setParent(parent);
+    }
+}
+
+/**
+* Empties the tree without destroying anything and returns its old root.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::detachRoot()
+{
+    AVLNode<Key,Value>* root = static_cast<AVLNode<Key,Value>*>(this->root_);
+    this->root_ = nullptr;
+    this->leftmost_ = nullptr;
+    this->rightmost_ = nullptr;
+    return root;
+}
+
+/**
+* Makes sure other's nodes live in this tree's pool, so they can be
+* linked into this tree and freed by it. Nothing needs to happen if the
+* pool is already shared. If other is the only owner of its pool, this
+* pool takes over its chunks. Otherwise other's items are copied into
+* this pool, O(m).
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::shareNodes(AVLTree& other)
+{
+    if (this->pool_ == other.pool_ || (other.pool_.use_count() == 1 && this->pool_->adopt(*other.pool_)))
+    {
+        return;
+    }
+    AVLTree copy(this->comp_, this->pool_->allocator());
+    copy.adoptNodes(nullptr, this->pool_);
+    copy.buildFromSorted(other.cbegin(), std::distance(other.cbegin(), other.cend()));
+    other = std::move(copy);
+}
+
+/**
+* Cuts ours along the root of theirs and unions the halves on each side.
+* A key in both trees keeps our node, with the merged value.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Merge>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::unionAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                             int theirHeight, Merge& merge, unsigned threads,
+                                             std::vector<AVLNode<Key,Value>*>& dropped)
+{
+    if (theirs == nullptr)
+    {
+        return std::make_pair(ours, ourHeight);
+    }
+    if (ours == nullptr)
+    {
+        return std::make_pair(theirs, theirHeight);
+    }
+    bool parallel = threads > 1 && std::max(ourHeight, theirHeight) >= PARALLEL_HEIGHT;
+    AVLNode<Key,Value>* theirLeft;
+    AVLNode<Key,Value>* theirRight;
+    int theirLeftHeight;
+    int theirRightHeight;
+    expose(theirs, theirHeight, theirLeft, theirLeftHeight, theirRight, theirRightHeight);
+    Pieces pieces = splitAt(ours, ourHeight, theirs->getKey());
+    AVLNode<Key,Value>* middle = theirs;
+    if (pieces.match != nullptr)
+    {
+        pieces.match->getValue() = merge(pieces.match->getValue(), theirs->getValue());
+        middle = pieces.match;
+        dropped.push_back(theirs);
+    }
+
+    std::pair<AVLNode<Key,Value>*, int> lower;
+    std::pair<AVLNode<Key,Value>*, int> upper;
+    std::vector<AVLNode<Key,Value>*> lowerDropped;
+    forkJoin(parallel,
+        [&]() { lower = unionAt(pieces.below, pieces.belowHeight, theirLeft, theirLeftHeight, merge,
+                                threads / 2, parallel ? lowerDropped : dropped); },
+        [&]() { upper = unionAt(pieces.above, pieces.aboveHeight, theirRight, theirRightHeight, merge,
+                                threads - threads / 2, dropped); });
+    dropped.insert(dropped.end(), lowerDropped.begin(), lowerDropped.end());
+    return joinAt(lower.first, lower.second, middle, upper.first, upper.second);
+}
+
+/**
+* Cuts ours along the root of theirs and intersects the halves on each
+* side. Only nodes of ours end up in the result.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Merge>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::intersectAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                                 int theirHeight, Merge& merge, unsigned threads,
+                                                 std::vector<AVLNode<Key,Value>*>& dropped)
+{
+    if (ours == nullptr || theirs == nullptr)
+    {
+        // whole subtrees go; destroyAll takes them apart later
+        if (ours != nullptr)
+        {
+            dropped.push_back(ours);
+        }
+        if (theirs != nullptr)
+        {
+            dropped.push_back(theirs);
+        }
+        return std::make_pair(static_cast<AVLNode<Key,Value>*>(nullptr), 0);
+    }
+    bool parallel = threads > 1 && std::max(ourHeight, theirHeight) >= PARALLEL_HEIGHT;
+    AVLNode<Key,Value>* theirLeft;
+    AVLNode<Key,Value>* theirRight;
+    int theirLeftHeight;
+    int theirRightHeight;
+    expose(theirs, theirHeight, theirLeft, theirLeftHeight, theirRight, theirRightHeight);
+    Pieces pieces = splitAt(ours, ourHeight, theirs->getKey());
+    if (pieces.match != nullptr)
+    {
+        pieces.match->getValue() = merge(pieces.match->getValue(), theirs->getValue());
+    }
+    dropped.push_back(theirs);
+
+    std::pair<AVLNode<Key,Value>*, int> lower;
+    std::pair<AVLNode<Key,Value>*, int> upper;
+    std::vector<AVLNode<Key,Value>*> lowerDropped;
+    forkJoin(parallel,
+        [&]() { lower = intersectAt(pieces.below, pieces.belowHeight, theirLeft, theirLeftHeight, merge,
+                                    threads / 2, parallel ? lowerDropped : dropped); },
+        [&]() { upper = intersectAt(pieces.above, pieces.aboveHeight, theirRight, theirRightHeight, merge,
+                                    threads - threads / 2, dropped); });
+    dropped.insert(dropped.end(), lowerDropped.begin(), lowerDropped.end());
+    if (pieces.match != nullptr)
+    {
+        return joinAt(lower.first, lower.second, pieces.match, upper.first, upper.second);
+    }
+    return joinPieces(lower.first, lower.second, upper.first, upper.second);
+}
+
+/**
+* Cuts ours along the root of theirs and subtracts the halves on each
+* side, dropping our node for that key if there is one.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<AVLNode<Key,Value>*, int>
+AVLTree<Key, Value, Compare, Alloc, Counted>::differenceAt(AVLNode<Key,Value>* ours, int ourHeight, AVLNode<Key,Value>* theirs,
+                                                  int theirHeight, unsigned threads,
+                                                  std::vector<AVLNode<Key,Value>*>& dropped)
+{
+    if (ours == nullptr || theirs == nullptr)
+    {
+        if (theirs != nullptr)
+        {
+            dropped.push_back(theirs);
+        }
+        return std::make_pair(ours, ourHeight);
+    }
+    bool parallel = threads > 1 && std::max(ourHeight, theirHeight) >= PARALLEL_HEIGHT;
+    AVLNode<Key,Value>* theirLeft;
+    AVLNode<Key,Value>* theirRight;
+    int theirLeftHeight;
+    int theirRightHeight;
+    expose(theirs, theirHeight, theirLeft, theirLeftHeight, theirRight, theirRightHeight);
+    Pieces pieces = splitAt(ours, ourHeight, theirs->getKey());
+    if (pieces.match != nullptr)
+    {
+        dropped.push_back(pieces.match);
+    }
+    dropped.push_back(theirs);
+
+    std::pair<AVLNode<Key,Value>*, int> lower;
+    std::pair<AVLNode<Key,Value>*, int> upper;
+    std::vector<AVLNode<Key,Value>*> lowerDropped;
+    forkJoin(parallel,
+        [&]() { lower = differenceAt(pieces.below, pieces.belowHeight, theirLeft, theirLeftHeight,
+                                     threads / 2, parallel ? lowerDropped : dropped); },
+        [&]() { upper = differenceAt(pieces.above, pieces.aboveHeight, theirRight, theirRightHeight,
+                                     threads - threads / 2, dropped); });
+    dropped.insert(dropped.end(), lowerDropped.begin(), lowerDropped.end());
+    return joinPieces(lower.first, lower.second, upper.first, upper.second);
+}
+
+/**
+* Hands lower to the shared worker pool (see bst_tasks.h) and runs upper
+* on this thread if parallel, otherwise runs both in turn. The recursion
+* hands each side half of its thread budget, so at most that many tasks
+* are in flight at once.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Lower, class Upper>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::forkJoin(bool parallel, Lower lower, Upper upper)
+{
+    if (!parallel)
+    {
+        lower();
+        upper();
+        return;
+    }
+    bst_tasks::forkJoin(lower, upper);
+}
+
+/**
+* The thread budget for a set operation: 0 means one per hardware thread.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+unsigned AVLTree<Key, Value, Compare, Alloc, Counted>::threadCount(unsigned threads)
+{
+    if (threads == 0)
+    {
+        threads = std::thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
+
+/**
+* Installs the result of a set operation and destroys the nodes it left
+* out. Dropped entries are single nodes or whole detached subtrees.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::finishSetOperation(AVLNode<Key,Value>* root,
+                                                             std::vector<AVLNode<Key,Value>*>& dropped)
+{
+    this->root_ = root;
+    this->resetExtremes();
+    for (typename std::vector<AVLNode<Key,Value>*>::iterator it = dropped.begin(); it != dropped.end(); ++it)
+    {
+        this->destroyAll(*it);
+    }
+}
+
+/**
+* Checks every invariant the tree relies on, in O(n) time and without
+* recursion: keys strictly increase in order, every child points back
+* at its parent, every stored balance equals the real height difference
+* and is within [-1, 1], every subtree size is right (if counted), and the cached
+* smallest and largest nodes are the real ones. Meant for health checks
+* and tests; returns false at the first violation.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+bool AVLTree<Key, Value, Compare, Alloc, Counted>::validate() const
+{
+    Node<Key,Value>* root = this->root_;
+    if (root == nullptr)
+    {
+        return this->leftmost_ == nullptr && this->rightmost_ == nullptr;
+    }
+    if (root->getParent() != nullptr)
+    {
+        return false;
+    }
+    // Shape: parent links, balances and sizes, bottom up
+    int height = this->checkedHeight(root, [](Node<Key,Value>* plain, int leftHeight, int rightHeight)
+    {
+        AVLNode<Key,Value>* node = static_cast<AVLNode<Key,Value>*>(plain);
+        AVLNode<Key,Value>* left = node->getLeft();
+        AVLNode<Key,Value>* right = node->getRight();
+        return (left == nullptr || left->getParent() == node)
+            && (right == nullptr || right->getParent() == node)
+            && node->getBalance() == rightHeight - leftHeight
+            && node->getBalance() >= -1 && node->getBalance() <= 1
+            && (!Counted || sizeOf(node) == 1 + sizeOf(left) + sizeOf(right));
+    });
+    if (height < 0)
+    {
+        return false;
+    }
+    // Order: the parent links are sound now, so successor() can walk it
+    Node<Key,Value>* first = root;
+    while (first->getLeft() != nullptr)
+    {
+        first = first->getLeft();
+    }
+    if (first != this->leftmost_)
+    {
+        return false;
+    }
+    std::size_t count = 1;
+    Node<Key,Value>* last = first;
+    for (Node<Key,Value>* next = this->successor(last); next != nullptr; next = this->successor(last))
+    {
+        if (!this->comp_(last->getKey(), next->getKey()))
+        {
+            return false;
+        }
+        last = next;
+        ++count;
+    }
+    return last == this->rightmost_ && (!Counted || count == sizeOf(static_cast<AVLNode<Key,Value>*>(root)));
+}
+
+/*
+ * Recall: If key is already in the tree, you should 
+ * overwrite the current value with the updated value.
+ * A single descent from the root either finds the key or the leaf
+ * to hang the new node from. Returns an iterator to the key's node
+ * and whether a new node was inserted, like std::map::insert.
+ */
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::insert (const std::pair<const Key, Value> &new_item)
+{
+    // TODO
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template assignAt<NodeType>(this->root_, new_item.first, new_item.second);
+    return std::make_pair(this->makeIterator(result.first), result.second);
+}
 
 /**
-* An explicit constructor to initialize the elements by calling the base class constructor
+* Same as above, but moves the value into the tree. The key is const in
+* the pair, so it is copied; try_emplace and insert_or_assign take the
+* key by rvalue reference to move it as well.
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-    Node<Key, Value>(key, value, parent), balance_(0)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::insert (std::pair<const Key, Value>&& new_item)
 {
-
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template assignAt<NodeType>(this->root_, new_item.first, std::move(new_item.second));
+    return std::make_pair(this->makeIterator(result.first), result.second);
 }
 
 /**
-* A destructor which does nothing.
+* The in-place insertion family, see BinarySearchTree. These hide the
+* base versions so that the nodes they build are AVLNodes.
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::~AVLNode()
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::emplace(Args&&... args)
 {
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template emplaceNode<NodeType>(std::forward<Args>(args)...);
+    return std::make_pair(this->makeIterator(result.first), result.second);
+}
 
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::try_emplace(const Key& key, Args&&... args)
+{
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template tryEmplaceAt<NodeType>(this->root_, key, std::forward<Args>(args)...);
+    return std::make_pair(this->makeIterator(result.first), result.second);
 }
 
-/**
-* A getter for the balance of a AVLNode.
-*/
-template<class Key, class Value>
-int8_t AVLNode<Key, Value>::getBalance() const
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<typename... Args>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::try_emplace(Key&& key, Args&&... args)
 {
-    return balance_;
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template tryEmplaceAt<NodeType>(this->root_, std::move(key), std::forward<Args>(args)...);
+    return std::make_pair(this->makeIterator(result.first), result.second);
 }
 
-/**
-* A setter for the balance of a AVLNode.
-*/
-template<class Key, class Value>
-void AVLNode<Key, Value>::setBalance(int8_t balance)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<typename M>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::insert_or_assign(const Key& key, M&& value)
 {
-    balance_ = balance;
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template assignAt<NodeType>(this->root_, key, std::forward<M>(value));
+    return std::make_pair(this->makeIterator(result.first), result.second);
 }
 
-/**
-* Adds diff to the balance of a AVLNode.
-*/
-template<class Key, class Value>
-void AVLNode<Key, Value>::updateBalance(int8_t diff)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<typename M>
+std::pair<typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator, bool>
+AVLTree<Key, Value, Compare, Alloc, Counted>::insert_or_assign(Key&& key, M&& value)
 {
-    balance_ += diff;
+    std::pair<Node<Key,Value>*, bool> result =
+        this->template assignAt<NodeType>(this->root_, std::move(key), std::forward<M>(value));
+    return std::make_pair(this->makeIterator(result.first), result.second);
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
-* that our node is a AVLNode.
+* Inserts a run of key/value pairs sorted by key. Each descent starts
+* from the node the previous key landed on, climbing only as far as
+* needed to reach a subtree whose key range covers the next key, so
+* neighbouring keys share their search paths and a batch of m keys
+* costs O(m log(n/m + 1)) comparisons instead of O(m log n). A key that
+* is out of order just starts again from the root. Duplicate keys
+* overwrite, as with insert().
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class InputIt>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::insertBatch(InputIt first, InputIt last)
 {
-    return static_cast<AVLNode<Key, Value>*>(this->parent_);
+    Node<Key,Value>* finger = nullptr;
+    for (; first != last; ++first)
+    {
+        const Key& key = (*first).first;
+        Node<Key,Value>* start = this->root_;
+        if (finger != nullptr && this->comp_(finger->getKey(), key))
+        {
+            // Everything in the finger's ancestors' subtrees is above the
+            // previous key, so only an upper bound is needed: climb until
+            // we leave a left subtree whose parent's key is above key.
+            start = finger;
+            Node<Key,Value>* parent = start->getParent();
+            while (parent != nullptr && !(start == parent->getLeft() && this->comp_(key, parent->getKey())))
+            {
+                start = parent;
+                parent = start->getParent();
+            }
+        }
+        finger = this->template assignAt<NodeType>(start, key, (*first).second).first;
+    }
 }
 
 /**
-* Overridden for the same reasons as above.
+* The number of keys in the tree, read off the root's subtree size.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::size_t AVLTree<Key, Value, Compare, Alloc, Counted>::size() const
 {
-    return static_cast<AVLNode<Key, Value>*>(this->left_);
+    static_assert(Counted, "size() needs a tree that counts subtree sizes, see CountedAVLTree");
+    return sizeOf(static_cast<AVLNode<Key,Value>*>(this->root_));
 }
 
 /**
-* Overridden for the same reasons as above.
+* Returns an iterator to the k-th smallest key, counting from 0, or end()
+* if the tree holds k keys or fewer.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+typename AVLTree<Key, Value, Compare, Alloc, Counted>::iterator
+AVLTree<Key, Value, Compare, Alloc, Counted>::select(std::size_t k)
 {
-    return static_cast<AVLNode<Key, Value>*>(this->right_);
+    static_assert(Counted, "select() needs a tree that counts subtree sizes, see CountedAVLTree");
+    return this->makeIterator(selectNode(k));
 }
 
-
-/*
-  -----------------------------------------------
-  End implementations for the AVLNode class.
-  -----------------------------------------------
-*/
-
-
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+typename AVLTree<Key, Value, Compare, Alloc, Counted>::const_iterator
+AVLTree<Key, Value, Compare, Alloc, Counted>::select(std::size_t k) const
 {
-public:
-    virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
-    virtual void remove(const Key& key);  // TODO
-protected:
-    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
-
-    // Add helper functions here
-    void insertFix(AVLNode<Key,Value>* parent, AVLNode<Key,Value>* node);
-    void removeFix(AVLNode<Key,Value>* node, int8_t diff);
-    void rotateLeft(AVLNode<Key,Value>* Node);
-    void rotateRight(AVLNode<Key,Value>* Node);
-};
+    static_assert(Counted, "select() needs a tree that counts subtree sizes, see CountedAVLTree");
+    return this->makeConstIterator(selectNode(k));
+}
 
-/*
- * Recall: If key is already in the tree, you should 
- * overwrite the current value with the updated value.
- */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+/**
+* Finds the k-th smallest node by steering on the left subtree sizes.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLNode<Key,Value>* AVLTree<Key, Value, Compare, Alloc, Counted>::selectNode(std::size_t k) const
 {
-    // TODO
-    // if the key is already in the tree, overwrite the current value
-    AVLNode<Key,Value>* searchNode = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::internalFind(new_item.first));
-    if (searchNode != nullptr)
-    {
-        searchNode->setValue(new_item.second);
-        return;
-    }
-    AVLNode<Key,Value>* newNode = new AVLNode<Key,Value>(new_item.first, new_item.second, nullptr);
-    // If empty tree => set n as root, b(n) = 0, done!
-    if (this->root_ == nullptr)
-    {
-        newNode->setBalance(0);
-        this->root_ = newNode;
-        return; 
-    }
-    // Else insert n (by walking the tree to a leaf, p, and inserting the 
-    // new node as its child), set balance to 0, and look at its parent, p
-    else
+    AVLNode<Key,Value>* node = static_cast<AVLNode<Key,Value>*>(this->root_);
+    while (node != nullptr)
     {
-        AVLNode<Key,Value>* currentNode = static_cast<AVLNode<Key,Value>*>(this->root_);
-        AVLNode<Key,Value>* parentNode = nullptr;
-        while (currentNode != nullptr)
+        std::size_t leftSize = sizeOf(node->getLeft());
+        if (k < leftSize)
         {
-            parentNode = currentNode;
-            if (new_item.first < currentNode->getKey())
-            {
-                currentNode = currentNode->getLeft();
-            }
-            // will never equal because it would have been returned already
-            else
-            {
-                currentNode = currentNode->getRight();
-            }
-        }
-        if (parentNode == nullptr)
-        {
-            this->root_ = newNode;
-            newNode->setBalance(0);
-            return;
+            node = node->getLeft();
         }
-        else if (newNode->getKey() < parentNode->getKey())
+        else if (k == leftSize)
         {
-            parentNode->setLeft(newNode);
+            break;
         }
-        else if (newNode->getKey() > parentNode->getKey())
+        else
         {
-            parentNode->setRight(newNode);
+            k -= leftSize + 1;
+            node = node->getRight();
         }
-        // also need to update the parent
-        newNode->setParent(parentNode);
-        newNode->setBalance(0);
-        // – If b(p) was -1, then b(p) = 0. Done!
-        if (parentNode->getBalance() == -1)
+    }
+    return node;
+}
+
+/**
+* Returns the number of keys less than key, whether or not key itself is
+* in the tree. If it is, select(rank(key)) finds it.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::size_t AVLTree<Key, Value, Compare, Alloc, Counted>::rank(const Key& key) const
+{
+    static_assert(Counted, "rank() needs a tree that counts subtree sizes, see CountedAVLTree");
+    std::size_t below = 0;
+    AVLNode<Key,Value>* node = static_cast<AVLNode<Key,Value>*>(this->root_);
+    while (node != nullptr)
+    {
+        int order = this->compareKeys(key, node->getKey());
+        if (order < 0)
         {
-            parentNode->setBalance(0);
-            return;
+            node = node->getLeft();
         }
-        // – If b(p) was +1, then b(p) = 0. Done!
-        else if (parentNode->getBalance() == +1)
+        else if (order == 0)
         {
-            parentNode->setBalance(0);
-            return;
+            return below + sizeOf(node->getLeft());
         }
-        // – If b(p) was 0, then update b(p) and call insert-fix(p, n)
-        else if (parentNode->getBalance() == 0)
+        else
         {
-            // if new node is at right of parent, update b(p) plus 1
-            if (newNode == parentNode->getRight())
-            {
-                parentNode->setBalance(1);
-            }
-            else
-            {
-                parentNode->setBalance(-1);
-            }
-            insertFix(parentNode, newNode);
+            below += sizeOf(node->getLeft()) + 1;
+            node = node->getRight();
         }
     }
+    return below;
 }
 
+/**
+* Returns the number of keys k with lo <= k < hi.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::size_t AVLTree<Key, Value, Compare, Alloc, Counted>::countRange(const Key& lo, const Key& hi) const
+{
+    if (!this->comp_(lo, hi))
+    {
+        return 0;
+    }
+    return rank(hi) - rank(lo);
+}
 
-template<class Key, class Value>
-void AVLTree<Key,Value>::insertFix(AVLNode<Key,Value>* parent, AVLNode<Key,Value>* node)
+/**
+* Copies the items, in order, into a read-only Index (an EytzingerIndex
+* unless asked otherwise), which answers find() and lower_bound() without
+* chasing pointers. The tree is left as it is; the index does not see
+* later changes to it.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+template<class Index>
+Index AVLTree<Key, Value, Compare, Alloc, Counted>::freeze() const
+{
+    return Index(this->begin(), this->end(), this->comp_);
+}
+
+/**
+* Hangs the new node n from p like BinarySearchTree does, then fixes the
+* balances on the way up.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft)
 {
-    //If parent or grandparent are NULL, return
-    if (parent == nullptr || parent->getParent() == nullptr)
+    BinarySearchTree<Key, Value, Compare, Alloc>::linkNode(node, parent, goLeft);
+    // If empty tree => n is the root, b(n) = 0, done!
+    AVLNode<Key,Value>* parentNode = static_cast<AVLNode<Key,Value>*>(parent);
+    if (parentNode == nullptr)
     {
         return;
     }
-    // Update grandparent’s balance (depends on whether parent is left/right child)
-    AVLNode<Key,Value>* grandparent = parent->getParent();
-    int8_t currentBalance = grandparent->getBalance();
-    // if parent is right child of grandparent, and parent added 1 more
-    if (parent == grandparent->getRight())
+    // Every ancestor gained a node; rotations below recompute their own sizes
+    adjustSizes(parentNode, 1);
+    // – If b(p) was -1 or +1, then b(p) = 0. Done!
+    if (parentNode->getBalance() != 0)
     {
-        grandparent->setBalance(currentBalance + 1);
+        parentNode->setBalance(0);
     }
-    // parent is left child of grandparent
+    // – If b(p) was 0, then update b(p) and call insert-fix(p, n)
     else
     {
-        grandparent->setBalance(currentBalance - 1);
-    }
-    // new balance is 0 -> DONE
-    if (grandparent->getBalance() == 0)
-    {
-        return;
-    }
-    // new balance is +/- 1 -> call insertFix(grandparent, parent)
-    else if (grandparent->getBalance() == 1 ||grandparent->getBalance() == -1)
-    {
-        insertFix(grandparent, parent);
+        parentNode->setBalance(goLeft ? -1 : 1);
+        insertFix(parentNode);
     }
-    // new balance is +/- 2
-    else
+}
+
+
+/**
+* Walks up from a node whose subtree just grew one level taller until
+* the growth is absorbed or fixed by a rotation. After an insert one
+* (single or double) rotation always restores the old height. A join
+* can hang a subtree with balance 0 under the rotated node, and then the
+* rotation leaves the new top leaning and one level taller, so the walk
+* goes on. Returns true if the growth reached the top of the tree.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+bool AVLTree<Key,Value, Compare, Alloc, Counted>::insertFix(AVLNode<Key,Value>* node)
+{
+    AVLNode<Key,Value>* parent = node->getParent();
+    while (parent != nullptr)
     {
-        // Case 3: b(g) == -2
-        // Check for zig-zig or zig-zag and perform corresponding rotations
-        if (grandparent->getBalance() == -2)
+        // The side of the parent that grew: -1 for left, +1 for right
+        int8_t side = (node == parent->getLeft()) ? -1 : 1;
+        parent->updateBalance(side);
+        // new balance is 0 -> the shorter side caught up, DONE
+        if (parent->getBalance() == 0)
         {
-            //        g
-            //       /
-            //      p
-            //     /
-            //    n
-            if (parent->getLeft() == node)
-            {
-                // If zig-zig then rotateRight(g); b(p) = b(g) = 0
-                rotateRight(grandparent);
-                parent->setBalance(0);
-                grandparent->setBalance(0);
-            }
-            //        g
-            //       /
-            //      p
-            //       \
-            //        n
-            else
-            {   // If zig-zag then rotateLeft(p); rotateRight(g); 
-                rotateLeft(parent);
-                rotateRight(grandparent);
-                // Case 3a: b(n) == -1 then b(p) = 0; b(g) = +1; b(n) = 0;
-                if (node->getBalance() == -1)
-                {
-                    parent->setBalance(0);
-                    grandparent->setBalance(1);
-                    node->setBalance(0);
-                }
-                // Case 3b: b(n) == 0 then b(p) = 0; b(g) = 0; b(n) = 0;
-                else if (node->getBalance() == 0)
-                {
-                    parent->setBalance(0);
-                    grandparent->setBalance(0);
-                    node->setBalance(0);
-                }
-                // Case 3c: b(n) == +1 then b(p)= -1; b(g) = 0; b(n) = 0;
-                else if (node->getBalance() == 1)
-                {
-                    parent->setBalance(-1);
-                    grandparent->setBalance(0);
-                    node->setBalance(0);
-                }
-            }
+            return false;
         }
-        else
+        // new balance is +/- 1 -> parent grew too, keep walking up
+        if (parent->getBalance() == side)
         {
-            //        g
-            //         \
-            //          p
-            //           \
-            //            n
-            if (parent->getRight() == node)
-            {
-                rotateLeft(grandparent);
-                parent->setBalance(0);
-                grandparent->setBalance(0);
-            }
-            //        g
-            //         \
-            //          p
-            //         /
-            //        n
-            else
-            {
-                rotateRight(parent);
-                rotateLeft(grandparent);
-                // Case 3a: b(n) == -1 then b(p) = 0; b(g) = +1; b(n) = 0;
-                if (node->getBalance() == 1)
-                {
-                    parent->setBalance(0);
-                    grandparent->setBalance(-1);
-                    node->setBalance(0);
-                }
-                // Case 3b: b(n) == 0 then b(p) = 0; b(g) = 0; b(n) = 0;
-                else if (node->getBalance() == 0)
-                {
-                    parent->setBalance(0);
-                    grandparent->setBalance(0);
-                    node->setBalance(0);
-                }
-                // Case 3c: b(n) == +1 then b(p)= -1; b(g) = 0; b(n) = 0;
-                else if (node->getBalance() == -1)
-                {
-                    parent->setBalance(1);
-                    grandparent->setBalance(0);
-                    node->setBalance(0);
-                }
-            }
+            node = parent;
+            parent = parent->getParent();
+            continue;
+        }
+        // new balance is +/- 2 -> rotate; a balanced top means the old
+        // height is restored, DONE
+        AVLNode<Key,Value>* top = rebalance(parent, side);
+        if (top->getBalance() == 0)
+        {
+            return false;
         }
-        // // Update balance of node, parent, and grandparent depending on original balance
-        // // **************************
-        // grandparent->setBalance(0);
-        // parent->setBalance(0);
-        // node->setBalance(0);
+        node = top;
+        parent = top->getParent();
     }
+    return true;
 }
 
 
 /*
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
+ * BinarySearchTree::remove finds the node and hands it to this.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>:: remove(const Key& key)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::removeNode(Node<Key, Value>* target)
 {
     // TODO
-    // Find the node to remove by walking the tree
-    AVLNode<Key,Value>* node = static_cast<AVLNode<Key,Value>*>(BinarySearchTree<Key,Value>::internalFind(key));
-    
-    if(node == nullptr)
-    {
-        return;
-    }
+    AVLNode<Key,Value>* node = static_cast<AVLNode<Key,Value>*>(target);
+    detachNode(node);
+    this->destroyNode(node);
+}
+
+/**
+* Unlinks node from the tree and rebalances, leaving node itself intact
+* (its links are stale afterwards) so it can be destroyed or reused.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::detachNode(AVLNode<Key,Value>* node)
+{
+    this->updateExtremes(node);
     // if a node has 2 children, swap with the predecessor
     if (node -> getLeft() != nullptr && node -> getRight() != nullptr)
     {
-        AVLNode<Key,Value>* predecessor = static_cast<AVLNode<Key,Value>*>(BinarySearchTree<Key,Value>::predecessor(node));
+        AVLNode<Key,Value>* predecessor = static_cast<AVLNode<Key,Value>*>(BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(node));
+        BST_TRACE_EVENT(BST_TRACE_SWAP, node, predecessor);
         nodeSwap(node,predecessor);
     }
     // If the parent of the removed node exists
@@ -415,7 +1917,8 @@ void AVLTree<Key, Value>:: remove(const Key& key)
     {
         newNode = node->getRight();
     }
-    // parent is not null, then connect node with parent and delete
+    BST_TRACE_EVENT(BST_TRACE_SPLICE, node, newNode);
+    // parent is not null, then connect node with parent
     if (parent != nullptr)
     {
         if (parent->getLeft() == node)
@@ -430,7 +1933,7 @@ void AVLTree<Key, Value>:: remove(const Key& key)
         {
             newNode->setParent(parent);
         }
-        delete node;
+        adjustSizes(parent, -1);
         removeFix(parent, diff);
     }
     // parent is null
@@ -440,21 +1943,18 @@ void AVLTree<Key, Value>:: remove(const Key& key)
         if (node->getLeft() == nullptr && node -> getRight() == nullptr)
         {
             this->root_ = nullptr;
-            delete node;
         }
         // 2nd case: node has a left child
         else if(node->getLeft() != nullptr)
         {
             node->getLeft()->setParent(nullptr);
             this->root_ = node->getLeft();
-            delete node;
         }
         // 3rd case: node has a right child
         else
         {
             node->getRight()->setParent(nullptr);
             this->root_ = node->getRight();
-            delete node;
         }
         // since the tree will always be balanced in this case, just return
         return;
@@ -463,176 +1963,175 @@ void AVLTree<Key, Value>:: remove(const Key& key)
 
 
 
-template<class Key, class Value>
-void AVLTree<Key,Value>::removeFix(AVLNode<Key,Value>* node, int8_t diff)
+/**
+* Walks up from a node one of whose subtrees just lost a level. diff is
+* +1 if the left subtree shrank and -1 if the right one did. Stops as
+* soon as the subtree rooted at the current node keeps its height.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::removeFix(AVLNode<Key,Value>* node, int8_t diff)
 {
-    // If node is null, return
-    if (node == nullptr)
-    {
-        return;
-    }
-    // Compute parent(node) and ndiff (for next recursive call)
-    AVLNode<Key, Value>* parent = node->getParent();
-    int8_t ndiff = 0;
-    // if p is not NULL let ndiff (nextdiff) = +1 if n is a left child and -1 otherwise
-    if (parent != nullptr)
+    while (node != nullptr)
     {
-        if (parent->getLeft() == node)
+        // Compute parent(node) and ndiff before any rotation moves node:
+        // ndiff = +1 if n is a left child and -1 otherwise
+        AVLNode<Key, Value>* parent = node->getParent();
+        int8_t ndiff = 0;
+        if (parent != nullptr)
         {
-            ndiff = 1;
+            ndiff = (parent->getLeft() == node) ? 1 : -1;
         }
-        else
+        node->updateBalance(diff);
+        // b(n) was 0 and is now +/- 1: height unchanged, DONE
+        if (node->getBalance() == diff)
         {
-            ndiff = -1;
+            return;
         }
-    }
-    // diff = -1: 
-    if (diff == -1)
-    {
-        // Case 1: balance(node) + diff == -2
-        if (node->getBalance() + diff == -2)
+        // b(n) is now 0: the taller side shrank, so n's height did too
+        if (node->getBalance() != 0)
         {
-            // Let c = left(n), the taller of the children
-            AVLNode<Key, Value>* child = node->getLeft();
-            //Case 1a: b(c) == -1 // zig-zig case
-            if (child->getBalance() == -1)
-            {
-                //rotateRight(n), b(n) = b(c) = 0, removeFix(p, ndiff)
-                rotateRight(node);
-                node->setBalance(0);
-                child->setBalance(0);
-                removeFix(parent,ndiff);
-            }
-            // Case 1b: b(c) == 0 // zig-zig case
-            else if (child->getBalance() == 0)
-            {
-                // rotateRight(n), b(n) = -1, b(c) = +1 // Done!
-                rotateRight(node);
-                node->setBalance(-1);
-                child->setBalance(1);
-            }
-            // Case 1c: b(c) == +1 // zig-zag case
-            else if (child->getBalance() == 1)
+            // b(n) is now +/- 2: rotate. If the new subtree root is left
+            // with a non-zero balance, the height is unchanged, DONE
+            AVLNode<Key, Value>* top = rebalance(node, diff);
+            if (top->getBalance() != 0)
             {
-                // Let g = right(c)
-                AVLNode<Key, Value>* grandchild = child->getRight();
-                // rotateLeft(c) then rotateRight(n)
-                rotateLeft(child);
-                rotateRight(node);
-                // If b(g) was +1 then b(n) = 0, b(c) = -1, b(g) = 0
-                if (grandchild->getBalance() == 1)
-                {
-                    node->setBalance(0);
-                    child->setBalance(-1);
-                    grandchild->setBalance(0);
-                }
-                // If b(g) was 0 then b(n) = 0, b(c) = 0, b(g) = 0
-                else if (grandchild->getBalance() == 0)
-                {
-                    node->setBalance(0);
-                    child->setBalance(0);
-                    grandchild->setBalance(0);
-                }
-                // If b(g) was -1 then b(n) = +1, b(c) = 0, b(g) = 0
-                else if (grandchild->getBalance() == -1)
-                {
-                    node->setBalance(1);
-                    child->setBalance(0);
-                    grandchild->setBalance(0);
-                }
-                // removeFix(p, ndiff);
-                removeFix(parent, ndiff);
+                return;
             }
         }
-        // Case 2: b(n) + diff == -1: then b(n) = -1; // Done!
-        else if (node->getBalance() + diff == -1)
-        {
-            node->setBalance(-1);
-        }
-        // Case 3: b(n) + diff == 0: then b(n) = 0, removeFix(p, ndiff)
-        else if (node->getBalance() + diff == 0)
-        {
-            node->setBalance(0);
-            removeFix(parent, ndiff);
-        }
+        node = parent;
+        diff = ndiff;
     }
-    if (diff == 1)
+}
+
+
+/**
+* Restores balance at a node whose balance is 2 * side, that is, whose
+* subtree on the given side (-1 left, +1 right) is two levels taller.
+* This is the one copy of the AVL case table; the left-heavy and
+* right-heavy cases are mirror images and differ only in side.
+* Let c = childOn(n, side), the taller child:
+*   b(c) ==  side (zig-zig): rotate c up;  b(n) = 0,    b(c) = 0
+*   b(c) ==  0    (zig-zig): rotate c up;  b(n) = side, b(c) = -side
+*                 (only after a remove; the height does not change)
+*   b(c) == -side (zig-zag): g = childOn(c, -side), rotate g up twice;
+*       b(g) ==  side: b(n) = -side, b(c) = 0
+*       b(g) ==  0   : b(n) = 0,     b(c) = 0
+*       b(g) == -side: b(n) = 0,     b(c) = side
+*     and b(g) = 0
+* Returns the new root of the subtree. Its balance is 0 exactly when
+* the subtree got one level shorter.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLNode<Key,Value>* AVLTree<Key,Value, Compare, Alloc, Counted>::rebalance(AVLNode<Key,Value>* node, int8_t side)
+{
+    AVLNode<Key, Value>* child = childOn(node, side);
+    int8_t childBalance = child->getBalance();
+    if (childBalance != -side)
     {
-        // Case 2: balance(node) + diff == 2
-        if (node->getBalance() + diff == 2)
-        {
-            AVLNode<Key, Value>* child = node->getRight();
-            //Case 2a: b(c) == 1 // zig-zig case
-            if (child->getBalance() == 1)
-            {
-                //rotateLeft(n), b(n) = b(c) = 0, removeFix(p, ndiff)
-                rotateLeft(node);
-                node->setBalance(0);
-                child->setBalance(0);
-                removeFix(parent,ndiff);
-            }
-            // Case 1b: b(c) == 0 // zig-zig case
-            else if (child->getBalance() == 0)
-            {
-                // rotateLeft(n), b(n) = 1, b(c) = -1 // Done!
-                rotateLeft(node);
-                node->setBalance(1);
-                child->setBalance(-1);
-            }
-            // Case 1c: b(c) == -1 // zig-zag case
-            else if (child->getBalance() == -1)
-            {
-                // std::cout << "Now we enter the zig-zag case for right: " << std::endl;
-                // Let g = left(c)
-                AVLNode<Key, Value>* grandchild = child->getLeft();
-                // rotateRight(c) then rotateLeft(n)
-                rotateRight(child);
-                rotateLeft(node);
-                // If b(g) was -1 then b(n) = 0, b(c) = 1, b(g) = 0
-                if (grandchild->getBalance() == -1)
-                {
-                    node->setBalance(0);
-                    child->setBalance(1);
-                    grandchild->setBalance(0);
-                }
-                // If b(g) was 0 then b(n) = 0, b(c) = 0, b(g) = 0
-                else if (grandchild->getBalance() == 0)
-                {
-                    node->setBalance(0);
-                    child->setBalance(0);
-                    grandchild->setBalance(0);
-                }
-                // If b(g) was 1 then b(n) = -1, b(c) = 0, b(g) = 0
-                else if (grandchild->getBalance() == 1)
-                {
-                    node->setBalance(-1);
-                    child->setBalance(0);
-                    grandchild->setBalance(0);
-                }
-                // removeFix(p, ndiff);
-                removeFix(parent, ndiff);
-            }
-        }
-        // Case 2: b(n) + diff == 1: then b(n) = 1; // Done!
-        else if (node->getBalance() + diff == 1)
-        {
-            node->setBalance(1);
-        }
-        // Case 3: b(n) + diff == 0: then b(n) = 0, removeFix(p, ndiff)
-        else if (node->getBalance() + diff == 0)
-        {
-            node->setBalance(0);
-            removeFix(parent, ndiff);
-        }
+        rotateUp(node, side);
+        node->setBalance(childBalance == side ? 0 : side);
+        child->setBalance(childBalance == side ? 0 : -side);
+        return child;
+    }
+    AVLNode<Key, Value>* grandchild = childOn(child, -side);
+    int8_t grandchildBalance = grandchild->getBalance();
+    rotateUp(child, -side);
+    rotateUp(node, side);
+    node->setBalance(grandchildBalance == side ? -side : 0);
+    child->setBalance(grandchildBalance == -side ? side : 0);
+    grandchild->setBalance(0);
+    return grandchild;
+}
+
+
+/**
+* Rotates node's child on the given side (-1 left, +1 right) up into
+* node's place.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::rotateUp(AVLNode<Key,Value>* node, int8_t side)
+{
+    if (side < 0)
+    {
+        rotateRight(node);
+    }
+    else
+    {
+        rotateLeft(node);
     }
+}
 
-    
 
+/**
+* Returns node's child on the given side (-1 left, +1 right).
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+AVLNode<Key,Value>* AVLTree<Key,Value, Compare, Alloc, Counted>::childOn(AVLNode<Key,Value>* node, int8_t side)
+{
+    return side < 0 ? node->getLeft() : node->getRight();
 }
 
 
-template<class Key, class Value>
-void AVLTree<Key,Value>::rotateLeft(AVLNode<Key,Value>* node)
+/**
+* The subtree size of node, 0 for an empty subtree. Always 0 unless the
+* tree is Counted.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+std::size_t AVLTree<Key,Value, Compare, Alloc, Counted>::sizeOf(AVLNode<Key,Value>* node)
+{
+    if (!Counted || node == nullptr)
+    {
+        return 0;
+    }
+    return static_cast<CountedAVLNode<Key,Value>*>(node)->getSize();
+}
+
+
+/**
+* Sets the subtree size of node; does nothing unless the tree is Counted.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::setSizeOf(AVLNode<Key,Value>* node, std::size_t size)
+{
+    if (Counted)
+    {
+        static_cast<CountedAVLNode<Key,Value>*>(node)->setSize(size);
+    }
+}
+
+
+/**
+* Recomputes node's subtree size from its children's.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::resize(AVLNode<Key,Value>* node)
+{
+    if (Counted)
+    {
+        setSizeOf(node, 1 + sizeOf(node->getLeft()) + sizeOf(node->getRight()));
+    }
+}
+
+
+/**
+* Adds diff to the subtree size of node and of each of its ancestors.
+*/
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::adjustSizes(AVLNode<Key,Value>* node, std::ptrdiff_t diff)
+{
+    if (!Counted)
+    {
+        return;
+    }
+    for (; node != nullptr; node = node->getParent())
+    {
+        setSizeOf(node, sizeOf(node) + diff);
+    }
+}
+
+
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::rotateLeft(AVLNode<Key,Value>* node)
 {
     // the node will be a left child of its right child
     // if (node == nullptr)
@@ -646,8 +2145,11 @@ void AVLTree<Key,Value>::rotateLeft(AVLNode<Key,Value>* node)
     if (parent == nullptr)
     {
         rightChild->setParent(nullptr);
-        // no parent means this is the root
-        this->root_ = rightChild;
+        // no parent means this is the root, or the top of a detached piece
+        if (this->root_ == node)
+        {
+            this->root_ = rightChild;
+        }
     }
     else
     {
@@ -669,12 +2171,14 @@ void AVLTree<Key,Value>::rotateLeft(AVLNode<Key,Value>* node)
     {
         rightleftGrandchild->setParent(node);
     }
-    // update the balance
+    // update the sizes, bottom first; the balance is up to the caller
+    resize(node);
+    resize(rightChild);
 }
 
 
-template<class Key, class Value>
-void AVLTree<Key,Value>::rotateRight(AVLNode<Key,Value>* node)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key,Value, Compare, Alloc, Counted>::rotateRight(AVLNode<Key,Value>* node)
 {
     AVLNode<Key,Value>* parent = node->getParent();
     AVLNode<Key,Value>* leftChild = node->getLeft();
@@ -683,8 +2187,11 @@ void AVLTree<Key,Value>::rotateRight(AVLNode<Key,Value>* node)
     if (parent == nullptr)
     {
         leftChild->setParent(nullptr);
-        // no parent means this is the root
-        this->root_ = leftChild;
+        // no parent means this is the root, or the top of a detached piece
+        if (this->root_ == node)
+        {
+            this->root_ = leftChild;
+        }
     }
     else
     {
@@ -706,16 +2213,22 @@ void AVLTree<Key,Value>::rotateRight(AVLNode<Key,Value>* node)
     {
         leftrightGrandchild->setParent(node);
     }
+    resize(node);
+    resize(leftChild);
 }
 
 
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
+template<class Key, class Value, class Compare, class Alloc, bool Counted>
+void AVLTree<Key, Value, Compare, Alloc, Counted>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
 {
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap(n1, n2);
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
+    // sizes belong to positions in the tree, not to keys
+    std::size_t tempS = sizeOf(n1);
+    setSizeOf(n1, sizeOf(n2));
+    setSizeOf(n2, tempS);
 }
 
 
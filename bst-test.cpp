@@ -1,10 +1,92 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 #include "bst.h"
 #include "avlbst.h"
+#include "persistent_avl.h"
+#include "concurrent_avl.h"
+#include "sharded_avl.h"
+#include "btree.h"
+#include "eytzinger.h"
+#include "van_emde_boas.h"
 
 using namespace std;
 
+static int failures = 0;
+
+/**
+* Reports a failed check; main() returns nonzero if any check failed.
+*/
+void check(bool ok, const char* what)
+{
+    if(!ok) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+/**
+* Whether tree holds exactly the items of expected, in the same order.
+*/
+template<class Tree>
+bool sameItems(const Tree& tree, const std::map<int,int>& expected)
+{
+    std::map<int,int>::const_iterator want = expected.begin();
+    for(typename Tree::const_iterator it = tree.begin(); it != tree.end(); ++it, ++want) {
+        if(want == expected.end() || it->first != want->first || it->second != want->second) {
+            return false;
+        }
+    }
+    return want == expected.end();
+}
+
+/**
+* The in-place insertion calls and equal_range, written once against any
+* of the trees; true if each behaved as std::map's would.
+*/
+template<class Tree>
+bool namesWork(Tree& names)
+{
+    bool built = names.try_emplace("ada", "lovelace").second;
+    bool rebuilt = names.try_emplace(std::string("ada"), "byron").second;
+    bool assigned = !names.insert_or_assign("ada", std::string("king")).second;
+    bool added = names.insert_or_assign(std::string("alan"), std::string("turing")).second;
+    bool kept = !names.emplace("alan", "kay").second && names.emplace(std::string("grace"), "hopper").second;
+    typename Tree::iterator it = names.equal_range("alan").first;
+    bool present = it != names.end() && it->second == "turing" && ++it == names.equal_range("alan").second;
+    bool absent = names.equal_range("bob").first == names.equal_range("bob").second
+        && names.equal_range("bob").first->first == "grace";
+    return built && !rebuilt && assigned && added && kept && present && absent && names["ada"] == "king";
+}
+
+/**
+* A value whose copy constructor throws once a shared budget of copies
+* runs out, for checking that failed builds clean up after themselves.
+*/
+struct Fragile
+{
+    static std::atomic<int> copiesLeft;
+    int value;
+
+    explicit Fragile(int v) : value(v) { }
+    Fragile(const Fragile& other) : value(other.value)
+    {
+        if(--copiesLeft == 0) {
+            throw std::runtime_error("copy failed");
+        }
+    }
+};
+std::atomic<int> Fragile::copiesLeft(-1);
+
+std::ostream& operator<<(std::ostream& out, const Fragile& fragile)
+{
+    return out << fragile.value;
+}
 
 int main(int argc, char *argv[])
 {
@@ -26,6 +108,25 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     bt.remove('b');
 
+    // isBalanced() on plain trees: sorted keys make a path, and an
+    // unbalanced subtree counts even under a balanced root
+    BinarySearchTree<int,int> path;
+    for(int i = 0; i < 3000; ++i) {
+        path.insert(std::make_pair(i, i));
+    }
+    check(!path.isBalanced(), "BST with sorted keys is not balanced");
+    BinarySearchTree<int,int> bushy;
+    int bushyKeys[7] = {8, 4, 12, 2, 6, 10, 14};
+    for(int i = 0; i < 7; ++i) {
+        bushy.insert(std::make_pair(bushyKeys[i], i));
+    }
+    check(bushy.isBalanced(), "full BST is balanced");
+    int deepKeys[4] = {1, 0, 15, 16};
+    for(int i = 0; i < 4; ++i) {
+        bushy.insert(std::make_pair(deepKeys[i], i));
+    }
+    check(!bushy.isBalanced(), "BST unbalanced below a balanced root");
+
     // AVL Tree Tests
     AVLTree<char,int> at;
     at.insert(std::make_pair('a',1));
@@ -44,5 +145,430 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
-    return 0;
+    // Pooled nodes: clear() hands whole chunks back, and the tree
+    // can be refilled afterwards.
+    std::allocator<std::pair<const int,int> > alloc;
+    AVLTree<int,int> pt(alloc);
+    for(int i = 0; i < 1000; ++i) {
+        pt.insert(std::make_pair(i, i));
+    }
+    pt.clear();
+    pt.insert(std::make_pair(7, 49));
+    cout << "\nAfter clear and refill: " << pt[7] << endl;
+    check(std::distance(pt.begin(), pt.end()) == 1 && pt[7] == 49 && pt.validate(), "pooled tree refilled after clear()");
+
+    // insert() reports where the key landed and whether it was new
+    std::pair<AVLTree<int,int>::iterator, bool> res = pt.insert(std::make_pair(7, 50));
+    cout << "Re-inserted 7: new=" << res.second << " value=" << res.first->second << endl;
+    check(!res.second && res.first->first == 7 && res.first->second == 50 && pt[7] == 50, "insert() overwrites and reports");
+
+    // Inserts, removes and sorted batches against std::map, checking the
+    // AVL invariants along the way
+    AVLTree<int,int> mixed;
+    std::map<int,int> mixedExpected;
+    bool mixedValid = true;
+    for(int i = 0; i < 5000; ++i) {
+        int key = (i * 7919) % 1700;
+        if(i % 4 == 3) {
+            mixed.remove(key);
+            mixedExpected.erase(key);
+        }
+        else {
+            mixed.insert(std::make_pair(key, i));
+            mixedExpected[key] = i;
+        }
+        if(i % 250 == 0) {
+            mixedValid = mixedValid && mixed.validate() && mixed.isBalanced();
+        }
+    }
+    std::vector<std::pair<int,int> > run;
+    for(int key = 1000; key < 2500; key += 3) {
+        run.push_back(std::make_pair(key, -key));
+        mixedExpected[key] = -key;
+    }
+    mixed.insertBatch(run.begin(), run.end());
+    check(mixedValid && mixed.validate() && sameItems(mixed, mixedExpected), "AVLTree matches std::map");
+
+    // Bulk construction from a sorted snapshot
+    std::vector<std::pair<int,int> > snapshot;
+    for(int i = 0; i < 100; ++i) {
+        snapshot.push_back(std::make_pair(i, i * i));
+    }
+    CountedAVLTree<int,int> bulk(snapshot.begin(), snapshot.end());
+    cout << "Bulk-built tree balanced: " << bulk.isBalanced() << ", bulk[9] = " << bulk[9] << endl;
+    std::map<int,int> bulkExpected(snapshot.begin(), snapshot.end());
+    check(bulk.validate() && bulk.size() == 100 && sameItems(bulk, bulkExpected), "bulk-built tree");
+
+    // The same from unsorted data, sorted and built on several threads
+    std::vector<std::pair<int,int> > shuffled(snapshot.rbegin(), snapshot.rend());
+    AVLTree<int,int> parallel;
+    parallel.parallelBuild(shuffled.begin(), shuffled.end(), 4);
+    cout << "Parallel-built tree valid: " << parallel.validate() << ", parallel[9] = " << parallel[9] << endl;
+    check(parallel.validate() && sameItems(parallel, bulkExpected), "parallel-built tree");
+
+    // A copy that throws on a helper thread comes back out of parallelBuild
+    std::vector<std::pair<int,Fragile> > fragile;
+    for(int i = 0; i < 20000; ++i) {
+        fragile.push_back(std::make_pair((i * 7919) % 20000, Fragile(i)));
+    }
+    AVLTree<int,Fragile> brittle;
+    bool thrown = false;
+    Fragile::copiesLeft = 15000;
+    try {
+        brittle.parallelBuild(fragile.begin(), fragile.end(), 4);
+    }
+    catch(const std::runtime_error&) {
+        thrown = true;
+    }
+    Fragile::copiesLeft = -1;
+    check(thrown && brittle.empty() && brittle.validate(), "parallelBuild rethrows a failed copy and stays empty");
+    brittle.parallelBuild(fragile.begin(), fragile.end(), 4);
+    check(brittle.validate() && brittle[7919 % 20000].value == 1, "parallelBuild after a failed one");
+
+    // A frozen copy answers lookups from one flat array, no pointers
+    EytzingerIndex<int,int> frozen = bulk.freeze();
+    cout << "Frozen: " << frozen.size() << " keys, frozen[12] = " << frozen[12] << ", keys from 95:";
+    for(EytzingerIndex<int,int>::const_iterator it = frozen.lower_bound(95); it != frozen.end(); ++it) {
+        cout << " " << it->first;
+    }
+    cout << endl;
+    check(frozen.size() == 100 && frozen[12] == 144 && frozen.lower_bound(95)->first == 95 && frozen.find(100) == frozen.end(),
+          "Eytzinger index lookups");
+    int frozenKeys = 0;
+    for(EytzingerIndex<int,int>::const_iterator it = frozen.begin(); it != frozen.end(); ++it, ++frozenKeys) {
+        check(it->first == frozenKeys && it->second == frozenKeys * frozenKeys, "Eytzinger index in key order");
+    }
+
+    // A value copy that throws leaves no key behind
+    std::vector<std::pair<std::string,Fragile> > named;
+    for(int i = 0; i < 40; ++i) {
+        named.push_back(std::make_pair(std::string(32, 'a' + i % 26) + std::to_string(i), Fragile(i)));
+    }
+    std::sort(named.begin(), named.end(),
+              [](const std::pair<std::string,Fragile>& a, const std::pair<std::string,Fragile>& b) { return a.first < b.first; });
+    thrown = false;
+    Fragile::copiesLeft = 25;
+    try {
+        EytzingerIndex<std::string,Fragile> partial(named.begin(), named.end());
+    }
+    catch(const std::runtime_error&) {
+        thrown = true;
+    }
+    Fragile::copiesLeft = -1;
+    check(thrown, "EytzingerIndex rethrows a failed value copy");
+
+    // The same copy in van Emde Boas order, for data that spills out of cache
+    VanEmdeBoasIndex<int,int> veb = bulk.freeze<VanEmdeBoasIndex<int,int> >();
+    cout << "van Emde Boas: veb[12] = " << veb[12] << ", first key above 41: " << veb.upper_bound(41)->first << endl;
+    bool vebOk = true;
+    for(int key = 0; key < 100; ++key) {
+        vebOk = vebOk && veb.find(key) != veb.end() && veb.find(key)->second == key * key;
+    }
+    check(vebOk && veb[12] == 144 && veb.upper_bound(41)->first == 42 && veb.upper_bound(99) == veb.end(),
+          "van Emde Boas index lookups");
+
+    // Order statistics on the subtree sizes
+    cout << "10th smallest key: " << bulk.select(10)->first << ", keys below 42: " << bulk.rank(42)
+         << ", keys in [20, 30): " << bulk.countRange(20, 30) << endl;
+    bool ranksOk = true;
+    for(int k = 0; k < 100; ++k) {
+        ranksOk = ranksOk && bulk.select(k)->first == k && bulk.rank(k) == static_cast<std::size_t>(k);
+    }
+    check(ranksOk && bulk.countRange(20, 30) == 10 && bulk.countRange(90, 200) == 10, "select, rank and countRange");
+
+    // Range scans start with one descent and stop at the upper bound
+    cout << "Keys in [20, 25):";
+    CountedAVLTree<int,int>::RangeView window = bulk.range(20, 25);
+    for(CountedAVLTree<int,int>::iterator it = window.begin(); it != window.end(); ++it) {
+        cout << " " << it->first;
+    }
+    cout << ", first key above 97: " << bulk.upper_bound(97)->first << endl;
+    int inWindow = 0;
+    for(CountedAVLTree<int,int>::iterator it = window.begin(); it != window.end(); ++it, ++inWindow) {
+        check(it->first == 20 + inWindow, "range view in key order");
+    }
+    check(inWindow == 5 && bulk.upper_bound(97)->first == 98 && bulk.lower_bound(100) == bulk.end()
+          && bulk.equal_range(42).first->first == 42 && bulk.equal_range(42).second->first == 43, "range bounds");
+
+    // Newest-first: walk the tree backwards without copying it
+    cout << "Largest three keys:";
+    CountedAVLTree<int,int>::reverse_iterator rit = bulk.rbegin();
+    for(int i = 0; i < 3 && rit != bulk.rend(); ++i, ++rit) {
+        cout << " " << rit->first;
+    }
+    cout << endl;
+    std::map<int,int>::reverse_iterator expectedRit = bulkExpected.rbegin();
+    bool reverseOk = true;
+    for(CountedAVLTree<int,int>::reverse_iterator it = bulk.rbegin(); it != bulk.rend(); ++it, ++expectedRit) {
+        reverseOk = reverseOk && it->first == expectedRit->first;
+    }
+    check(reverseOk && expectedRit == bulkExpected.rend(), "reverse iteration");
+
+    // Scheduler-style use: always take the earliest item
+    std::pair<int,int> first = bulk.popMin();
+    cout << "Popped " << first.first << ", next up: " << bulk.front().first << ", last: " << bulk.back().first << endl;
+    check(first.first == 0 && bulk.front().first == 1 && bulk.back().first == 99 && bulk.size() == 99 && bulk.validate(),
+          "popMin, front and back");
+
+    // Split moves whole subtrees into two trees; join puts them back together
+    std::pair<CountedAVLTree<int,int>, CountedAVLTree<int,int> > halves = bulk.split(50);
+    cout << "Split at 50: " << halves.first.size() << " below, " << halves.second.size() << " from 50 up";
+    bulk = CountedAVLTree<int,int>::join(std::move(halves.first), std::move(halves.second));
+    cout << ", joined again: " << bulk.size() << ", valid: " << bulk.validate() << endl;
+    bulkExpected.erase(0);
+    check(bulk.validate() && sameItems(bulk, bulkExpected), "split and join");
+
+    // The halves of a split share one pool; joining more nodes into one
+    // half must not race with the other half allocating on its own thread
+    CountedAVLTree<int,int> spread;
+    for(int i = 0; i < 500; ++i) {
+        spread.insert(std::make_pair(i, i));
+        spread.insert(std::make_pair(1000 + i, i));
+    }
+    std::pair<CountedAVLTree<int,int>, CountedAVLTree<int,int> > sides = spread.split(1000);
+    std::thread grower([&sides]() {
+        for(int i = 1500; i < 20000; ++i) {
+            sides.second.insert(std::make_pair(i, i));
+        }
+    });
+    for(int round = 0; round < 10; ++round) {
+        CountedAVLTree<int,int> extra;
+        for(int i = 500 + round * 50; i < 550 + round * 50; ++i) {
+            extra.insert(std::make_pair(i, i));
+        }
+        sides.first = CountedAVLTree<int,int>::join(std::move(sides.first), std::move(extra));
+    }
+    grower.join();
+    check(sides.first.validate() && sides.first.size() == 1000 && sides.first.back().first == 999,
+          "join into a split half while its sibling grows");
+    check(sides.second.validate() && sides.second.size() == 19000, "split sibling grown on another thread");
+
+    // Set operations reuse both trees' nodes; shared keys get merged values
+    CountedAVLTree<int,int> evens;
+    for(int i = 0; i < 200; i += 2) {
+        evens.insert(std::make_pair(i, 1));
+    }
+    bulk.unionWith(std::move(evens), [](const int& ours, const int& theirs) { return ours + theirs; });
+    cout << "Union with evens: " << bulk.size() << " keys, bulk[4] = " << bulk[4] << ", bulk[150] = " << bulk[150] << endl;
+    check(bulk.size() == 150 && bulk[4] == 17 && bulk[5] == 25 && bulk[150] == 1 && bulk.validate(), "union with evens");
+
+    // Set operations big enough to run their halves on the worker pool
+    std::map<int,int> ours, theirs;
+    CountedAVLTree<int,int> left, right;
+    for(int i = 0; i < 30000; ++i) {
+        int key = (i * 7919) % 40000;
+        left.insert(std::make_pair(key, 1));
+        ours[key] = 1;
+        right.insert(std::make_pair(key + 5000, 2));
+        theirs[key + 5000] = 2;
+    }
+    std::map<int,int> unionExpected(ours), intersectExpected, differenceExpected;
+    for(std::map<int,int>::iterator it = theirs.begin(); it != theirs.end(); ++it) {
+        unionExpected[it->first] += it->second;
+    }
+    for(std::map<int,int>::iterator it = ours.begin(); it != ours.end(); ++it) {
+        if(theirs.count(it->first) != 0) {
+            intersectExpected[it->first] = it->second;
+        }
+        else {
+            differenceExpected[it->first] = it->second;
+        }
+    }
+    CountedAVLTree<int,int> unioned(ours.begin(), ours.end()), intersected(ours.begin(), ours.end());
+    unioned.unionWith(CountedAVLTree<int,int>(theirs.begin(), theirs.end()), [](const int& a, const int& b) { return a + b; });
+    intersected.intersectWith(CountedAVLTree<int,int>(theirs.begin(), theirs.end()));
+    left.differenceWith(std::move(right));
+    check(unioned.validate() && sameItems(unioned, unionExpected), "unionWith matches std::map");
+    check(intersected.validate() && sameItems(intersected, intersectExpected), "intersectWith matches std::map");
+    check(left.validate() && sameItems(left, differenceExpected) && right.empty(), "differenceWith matches std::map");
+
+    // Many lookups in one call overlap their cache misses
+    int wanted[4] = {4, 5, 150, 999};
+    CountedAVLTree<int,int>::iterator hits[4];
+    bulk.findBatch(wanted, wanted + 4, hits);
+    cout << "Batch lookup:";
+    for(int i = 0; i < 4; ++i) {
+        cout << " " << wanted[i] << (hits[i] != bulk.end() ? "=found" : "=missing");
+    }
+    cout << endl;
+    check(hits[0]->second == 17 && hits[1]->second == 25 && hits[2]->second == 1 && hits[3] == bulk.end(), "findBatch");
+
+    // In-place insertion: try_emplace only builds the value for a new key
+    AVLTree<std::string,std::string> names;
+    names.try_emplace("ada", "lovelace");
+    names.try_emplace("ada", "byron");
+    names.insert_or_assign("alan", std::string("turing"));
+    cout << "ada -> " << names["ada"] << ", alan -> " << names["alan"] << endl;
+    check(std::distance(names.begin(), names.end()) == 2 && names["ada"] == "lovelace" && names["alan"] == "turing", "try_emplace and insert_or_assign");
+
+    // A transparent comparator looks up string keys without building a std::string
+    AVLTree<std::string,int,StringCompare> lengths;
+    lengths.insert(std::make_pair(std::string("hopper"), 6));
+    cout << "hopper has " << lengths["hopper"] << " letters, found=" << (lengths.find("hopper") != lengths.end()) << endl;
+    check(lengths.find("hopper") != lengths.end() && lengths.find("lovelace") == lengths.end(), "heterogeneous lookup");
+
+    // A snapshot keeps its version while the tree moves on
+    PersistentAVLTree<int,int> versioned;
+    for(int i = 0; i < 10; ++i) {
+        versioned.insert(std::make_pair(i, i));
+    }
+    PersistentAVLTree<int,int>::Snapshot before = versioned.snapshot();
+    versioned.remove(3);
+    versioned.insert(std::make_pair(4, 40));
+    cout << "Snapshot: " << before.size() << " keys, [4] = " << before[4]
+         << "; tree now: " << versioned.size() << " keys, [4] = " << versioned[4] << endl;
+    check(before.size() == 10 && before[4] == 4 && before.find(3) != before.end() && versioned.size() == 9
+          && versioned[4] == 40 && versioned.find(3) == versioned.end(), "snapshot keeps its version");
+
+    // insert() hands back an iterator on the path it took, rotations included
+    PersistentAVLTree<int,int> paths;
+    std::map<int,int> pathsExpected;
+    PersistentAVLTree<int,int>::Snapshot held;
+    bool pathsOk = true;
+    for(int i = 0; i < 2000; ++i) {
+        int key = (i * 7919) % 1000;
+        if(i % 300 == 0) {
+            held = paths.snapshot();
+        }
+        std::pair<PersistentAVLTree<int,int>::iterator, bool> landed = paths.insert(std::make_pair(key, i));
+        pathsExpected[key] = i;
+        std::map<int,int>::iterator next = pathsExpected.upper_bound(key);
+        PersistentAVLTree<int,int>::iterator after = landed.first;
+        ++after;
+        pathsOk = pathsOk && landed.second == (i < 1000) && landed.first->first == key && landed.first->second == i
+            && (next == pathsExpected.end() ? after == paths.end() : after->first == next->first);
+    }
+    int heldCount = 0;
+    for(PersistentAVLTree<int,int>::Snapshot::const_iterator it = held.begin(); it != held.end(); ++it) {
+        ++heldCount;
+    }
+    check(pathsOk && heldCount == static_cast<int>(held.size()), "persistent insert returns a walkable iterator");
+
+    // Readers never wait for the writer and always see a whole version
+    ConcurrentAVLTree<int,int> shared;
+    shared.insert(std::make_pair(1, 10));
+    shared.insert(std::make_pair(2, 20));
+    int twenty = 0;
+    bool found = shared.find(2, twenty);
+    ConcurrentAVLTree<int,int>::ReadView view = shared.read();
+    shared.remove(1);
+    cout << "Concurrent: found 2 = " << found << " -> " << twenty << ", view still has " << view.size()
+         << " keys, tree has " << shared.size() << endl;
+    check(found && twenty == 20 && view.size() == 2 && shared.size() == 1 && !shared.find(1, twenty), "concurrent tree views");
+
+    // Writers to different key ranges lock different shards; iteration
+    // still runs in one key order across all of them
+    ShardedAVLTree<int,int> sharded(8);
+    for(int i = 0; i < 50; ++i) {
+        sharded.insert(std::make_pair(i, i));
+    }
+    int total = 0;
+    sharded.scan(10, 20, [&](const std::pair<const int,int>& item) { total += item.second; });
+    cout << "Sharded: " << sharded.shardCount() << " shards, first key " << sharded.begin()->first
+         << ", sum of [10, 20) = " << total << endl;
+    check(total == 145 && sharded.size() == 50 && sharded.shardCount() > 1 && sharded[49] == 49, "sharded scan");
+
+    // Shards split and merge as they grow and shrink; iteration crosses
+    // batches and shards in key order and matches a std::map throughout
+    ShardedAVLTree<int,int> resharded(16);
+    std::map<int,int> reshardedExpected;
+    check(resharded.empty(), "new sharded map is empty");
+    for(int i = 0; i < 3000; ++i) {
+        int key = (i * 7919) % 1500;
+        if(i % 3 == 2) {
+            resharded.remove(key);
+            reshardedExpected.erase(key);
+        }
+        else {
+            resharded.insert(std::make_pair(key, i));
+            reshardedExpected[key] = i;
+        }
+    }
+    std::map<int,int> walked(resharded.begin(), resharded.end());
+    check(walked == reshardedExpected && resharded.size() == reshardedExpected.size() && resharded.shardCount() > 1,
+          "sharded map matches std::map after splits and merges");
+    for(std::map<int,int>::iterator it = reshardedExpected.begin(); it != reshardedExpected.end(); ++it) {
+        resharded.remove(it->first);
+    }
+    check(resharded.empty() && resharded.begin() == resharded.end(), "sharded map empty after removing everything");
+
+    // The B-tree takes the same calls; many keys per node keep it shallow
+    BTree<int,int> wide;
+    for(int i = 0; i < 1000; ++i) {
+        wide.insert(std::make_pair(i, i * 2));
+    }
+    wide.remove(500);
+    cout << "BTree: " << wide.size() << " keys in " << wide.height() << " levels, wide[21] = " << wide[21]
+         << ", after 499 comes " << wide.upper_bound(499)->first << ", valid: " << wide.validate() << endl;
+    check(wide.size() == 999 && wide[21] == 42 && wide.upper_bound(499)->first == 501 && wide.find(500) == wide.end()
+          && wide.validate(), "BTree lookups");
+
+    // Four entries a node makes many leaves and levels to cross
+    typedef BTree<int,int,std::less<int>,std::allocator<std::pair<const int,int> >,4> NarrowTree;
+    NarrowTree narrow;
+    std::map<int,int> narrowExpected;
+    bool narrowValid = true;
+    for(int i = 0; i < 4000; ++i) {
+        int key = (i * 7919) % 1200;
+        if(i % 5 == 3) {
+            narrow.remove(key);
+            narrowExpected.erase(key);
+        }
+        else {
+            narrow.insert(std::make_pair(key, i));
+            narrowExpected[key] = i;
+        }
+        if(i % 97 == 0) {
+            narrowValid = narrowValid && narrow.validate();
+        }
+    }
+    check(narrowValid && narrow.validate() && narrow.size() == narrowExpected.size() && narrow.height() > 3,
+          "BTree valid after mixed inserts and removes");
+
+    std::map<int,int>::reverse_iterator expectedBack = narrowExpected.rbegin();
+    NarrowTree::iterator back = narrow.end();
+    bool backwardsOk = true;
+    while(back != narrow.begin()) {
+        --back;
+        backwardsOk = backwardsOk && expectedBack != narrowExpected.rend() && back->first == expectedBack->first
+            && back->second == expectedBack->second;
+        ++expectedBack;
+    }
+    check(backwardsOk && expectedBack == narrowExpected.rend(), "BTree iterates backwards from end()");
+
+    bool boundsOk = true;
+    for(int key = -1; key <= 1200; ++key) {
+        std::map<int,int>::iterator expectedNext = narrowExpected.upper_bound(key);
+        NarrowTree::iterator next = narrow.upper_bound(key);
+        boundsOk = boundsOk && (expectedNext == narrowExpected.end() ? next == narrow.end() : next->first == expectedNext->first);
+    }
+    check(boundsOk, "BTree upper_bound across leaf boundaries");
+
+    for(std::map<int,int>::iterator it = narrowExpected.begin(); it != narrowExpected.end(); ++it) {
+        narrow.remove(it->first);
+        if(it->first % 50 == 0) {
+            narrowValid = narrowValid && narrow.validate();
+        }
+    }
+    check(narrowValid && narrow.empty() && narrow.height() == 0 && narrow.begin() == narrow.end() && narrow.validate(),
+          "BTree root collapses to empty");
+    narrow.insert(std::make_pair(1, 1));
+    check(narrow.size() == 1 && narrow.height() == 1 && narrow[1] == 1, "BTree usable after collapsing");
+
+    // The same call sites work with either engine
+    AVLTree<std::string,std::string> avlNames;
+    BTree<std::string,std::string> btreeNames;
+    check(namesWork(avlNames), "emplace, try_emplace, insert_or_assign and equal_range on AVLTree");
+    check(namesWork(btreeNames) && btreeNames.size() == 3 && btreeNames.validate(),
+          "emplace, try_emplace, insert_or_assign and equal_range on BTree");
+    BTree<int,int,std::less<int>,std::allocator<std::pair<const int,int> >,4> splitting;
+    bool splittingOk = true;
+    for(int i = 0; i < 500; ++i) {
+        int key = (i * 7919) % 500;
+        splittingOk = splittingOk && splitting.try_emplace(key, i).second && splitting.find(key)->second == i
+            && splitting.insert_or_assign(key, -i).first->second == -i;
+    }
+    check(splittingOk && splitting.validate() && splitting.size() == 500, "BTree try_emplace across node splits");
+
+    return failures == 0 ? 0 : 1;
 }
@@ -6,20 +6,37 @@
 #include <cstdlib>
 #include <utility>
 #include <cmath>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "node_pool.h"
+#include "bst_trace.h"
+#include "bst_compare.h"
+#include "bst_prefetch.h"
 
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * The getters for parent/left/right are not virtual:
+ * derived nodes for other kinds of search trees, such as
+ * Red Black trees, Splay trees, and AVL trees, hide them
+ * with versions returning their own type, so every hop of
+ * a traversal is resolved at compile time and can be inlined.
+ * Nodes carry no vptr. Trees destroy nodes through Node, so a
+ * derived node must not add members that need destructing.
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    template<typename... ItemArgs>
+    explicit Node(Node<Key, Value>* parent, ItemArgs&&... itemArgs);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -27,14 +44,15 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
 
 protected:
     std::pair<const Key, Value> item_;
@@ -62,6 +80,23 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
 
 }
 
+/**
+* Constructor that builds the item in place from the given arguments,
+* exactly as std::pair<const Key, Value> would take them. Passing
+* std::piecewise_construct lets the key and the value each be built
+* from their own argument lists without any copies.
+*/
+template<typename Key, typename Value>
+template<typename... ItemArgs>
+Node<Key, Value>::Node(Node<Key, Value>* parent, ItemArgs&&... itemArgs) :
+    item_(std::forward<ItemArgs>(itemArgs)...),
+    parent_(parent),
+    left_(nullptr),
+    right_(nullptr)
+{
+
+}
+
 /**
 * Destructor, which does not need to do anything since the pointers inside of a node
 * are only used as references to existing nodes. The nodes pointed to by parent/left/right
@@ -119,7 +154,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -128,7 +163,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -137,7 +172,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -181,6 +216,15 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* A setter that moves the new value into the node.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
@@ -189,32 +233,76 @@ void Node<Key, Value>::setValue(const Value& value)
 
 /**
 * A templated unbalanced binary search tree.
+* Keys are ordered by Compare, which may be three-way and transparent,
+* see bst_compare.h.
+* Nodes are carved out of a NodePool whose chunks come from Alloc, so
+* inserts and removes reuse slots instead of calling new/delete each time.
+* Trees that hand nodes to each other (AVLTree::split and join) share one
+* pool; a tree only releases the pool's chunks wholesale while it is the
+* sole owner.
+* Trees can be moved but not copied.
 */
-template <typename Key, typename Value>
+template <typename Key, typename Value,
+          typename Compare = std::less<Key>,
+          typename Alloc = std::allocator<std::pair<const Key, Value> > >
 class BinarySearchTree
 {
 public:
     BinarySearchTree(); //TODO
+    explicit BinarySearchTree(const Compare& comp, const Alloc& alloc = Alloc());
+    explicit BinarySearchTree(const Alloc& alloc);
+    BinarySearchTree(BinarySearchTree&& other);
+    BinarySearchTree& operator=(BinarySearchTree&& other);
     virtual ~BinarySearchTree(); //TODO
-    virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    class iterator;
+    class const_iterator;
+    virtual std::pair<iterator, bool> insert(const std::pair<const Key, Value>& keyValuePair); //TODO
+    virtual std::pair<iterator, bool> insert(std::pair<const Key, Value>&& keyValuePair);
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
-    void clearAll(Node<Key,Value>* current); // helper for clear()
+    void clearAll(Node<Key,Value>* current); // helper for clear(), runs node destructors
     bool isBalanced() const; //TODO
-    bool isBalanced(Node<Key,Value>* Node) const; // recursive function
+    bool isBalanced(Node<Key,Value>* Node) const; // single post-order pass
     int rootDepth(Node<Key,Value>* Node) const; // check the length
     void print() const;
     bool empty() const;
+    Compare key_comp() const;
+
+    // Smallest and largest items in O(1), for priority-queue use
+    std::pair<const Key, Value>& front();
+    const std::pair<const Key, Value>& front() const;
+    std::pair<const Key, Value>& back();
+    const std::pair<const Key, Value>& back() const;
+    std::pair<Key, Value> popMin();
+    std::pair<Key, Value> popMax();
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
 public:
     /**
     * An internal iterator class for traversing the contents of the BST.
+    * It is bidirectional. Decrementing end() lands on the largest item,
+    * which is why the iterator also remembers its tree.
     */
     class iterator  // TODO
     {
     public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
         iterator();
 
         std::pair<const Key,Value>& operator*() const;
@@ -224,24 +312,146 @@ public:
         bool operator!=(const iterator& rhs) const;
 
         iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BinarySearchTree<Key, Value, Compare, Alloc>;
+        friend class const_iterator;
+        iterator(Node<Key,Value>* ptr, const BinarySearchTree* tree);
+        Node<Key, Value> *current_;
+        const BinarySearchTree* tree_;
+    };
+
+    /**
+    * The read-only counterpart of iterator, handed out by const trees.
+    * An iterator converts to a const_iterator but not the other way.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Compare, Alloc>;
+        const_iterator(Node<Key,Value>* ptr, const BinarySearchTree* tree);
         Node<Key, Value> *current_;
+        const BinarySearchTree* tree_;
     };
 
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    /**
+    * A half-open run of the tree's items, [begin(), end()), for use with
+    * range-based for loops. See range().
+    */
+    template<typename It>
+    class BasicRangeView
+    {
+    public:
+        BasicRangeView(const It& first, const It& last);
+
+        It begin() const;
+        It end() const;
+        bool empty() const;
+
+    private:
+        It first_;
+        It last_;
+    };
+
+    typedef BasicRangeView<iterator> RangeView;
+    typedef BasicRangeView<const_iterator> ConstRangeView;
+
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    RangeView range(const Key& lo, const Key& hi);
+    ConstRangeView range(const Key& lo, const Key& hi) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // Heterogeneous lookups, only available when Compare is transparent
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Value& operator[](const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Value const & operator[](const K& key) const;
+
+    // Many lookups at once, their cache misses overlapped: writes find(k)
+    // for each key k in [first, last) to out, in order
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt findBatch(ForwardIt first, ForwardIt last, OutputIt out);
+    template<typename ForwardIt, typename OutputIt>
+    OutputIt findBatch(ForwardIt first, ForwardIt last, OutputIt out) const;
+
 protected:
+    BinarySearchTree(std::size_t nodeSize, const Compare& comp, const Alloc& alloc);
+    iterator makeIterator(Node<Key, Value>* node);
+    const_iterator makeConstIterator(Node<Key, Value>* node) const;
+    template<typename A, typename B>
+    int compareKeys(const A& a, const B& b) const;
+
     // Mandatory helper functions
-    Node<Key, Value>* internalFind(const Key& k) const; // TODO
+    template<typename K>
+    Node<Key, Value>* internalFind(const K& k) const; // TODO
+    template<typename ForwardIt, typename Emit>
+    void findGroups(ForwardIt first, ForwardIt last, Emit emit) const;
+    template<typename K>
+    Node<Key, Value>* lowerBoundNode(const K& key) const;
+    template<typename K>
+    Node<Key, Value>* upperBoundNode(const K& key) const;
     Node<Key, Value> *getSmallestNode() const;  // TODO
+    Node<Key, Value> *getLargestNode() const;
+    void resetExtremes();
+    template<typename Check>
+    int checkedHeight(Node<Key, Value>* subtree, Check check) const;
+    void destroyAll(Node<Key, Value>* subtree);
+    void teardown(Node<Key, Value>* current, bool freeSlots);
+    void adoptNodes(Node<Key, Value>* root, const std::shared_ptr<NodePool<Alloc> >& pool);
+    void ownPool();
+    void settlePool();
+    void updateExtremes(Node<Key, Value>* leaving);
+    virtual void removeNode(Node<Key, Value>* node);
     static Node<Key, Value>* predecessor(Node<Key, Value>* current); // TODO
     // Note:  static means these functions don't have a "this" pointer
     //        and instead just use the input argument.
@@ -251,11 +461,31 @@ protected:
     virtual void nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2) ;
 
     // Add helper functions here
+    template<typename NodeType, typename... ItemArgs>
+    NodeType* createNode(NodeType* parent, ItemArgs&&... itemArgs);
+    void destroyNode(Node<Key, Value>* node);
+
+    // Insertion steps shared by every insert flavour. The node type is a
+    // template parameter so derived trees can reuse them for their nodes.
+    Node<Key, Value>* findSlot(Node<Key, Value>* start, const Key& key,
+                               Node<Key, Value>*& parent, bool& goLeft) const;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft);
+    template<typename NodeType, typename KeyArg, typename M>
+    std::pair<Node<Key, Value>*, bool> assignAt(Node<Key, Value>* start, KeyArg&& key, M&& value);
+    template<typename NodeType, typename KeyArg, typename... Args>
+    std::pair<Node<Key, Value>*, bool> tryEmplaceAt(Node<Key, Value>* start, KeyArg&& key, Args&&... args);
+    template<typename NodeType, typename... Args>
+    std::pair<Node<Key, Value>*, bool> emplaceNode(Args&&... args);
 
 
 protected:
     Node<Key, Value>* root_;
-    // You should not need other data members
+    Node<Key, Value>* leftmost_;    // smallest key, nullptr when empty
+    Node<Key, Value>* rightmost_;   // largest key, nullptr when empty
+    std::shared_ptr<NodePool<Alloc> > pool_;
+    Compare comp_;
+
+    static const std::size_t BATCH_WIDTH = 16;     // descents findBatch keeps in flight
 };
 
 /*
@@ -265,31 +495,34 @@ Begin implementations for the BinarySearchTree::iterator class.
 */
 
 /**
-* Explicit constructor that initializes an iterator with a given node pointer.
+* Explicit constructor that initializes an iterator with a given node pointer
+* in the given tree.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::iterator(Node<Key,Value> *ptr, const BinarySearchTree* tree)
 {
     // TODO
     current_ = ptr;
+    tree_ = tree;
 }
 
 /**
 * A default constructor that initializes the iterator to nullptr.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator() 
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::iterator() 
 {
     // TODO
     current_ = nullptr;
+    tree_ = nullptr;
 }
 
 /**
 * Provides access to the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator*() const
 {
     return current_->getItem();
 }
@@ -297,9 +530,9 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
 * Provides access to the address of the item.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator->() const
 {
     return &(current_->getItem());
 }
@@ -308,10 +541,10 @@ BinarySearchTree<Key, Value>::iterator::operator->() const
 * Checks if 'this' iterator's internals have the same value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator==(
+    const BinarySearchTree<Key, Value, Compare, Alloc>::iterator& rhs) const
 {
     // TODO
     return this->current_ == rhs.current_;
@@ -321,10 +554,10 @@ BinarySearchTree<Key, Value>::iterator::operator==(
 * Checks if 'this' iterator's internals have a different value
 * as 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator!=(
+    const BinarySearchTree<Key, Value, Compare, Alloc>::iterator& rhs) const
 {
     // TODO
     return this->current_ != rhs.current_;
@@ -334,15 +567,51 @@ BinarySearchTree<Key, Value>::iterator::operator!=(
 /**
 * Advances the iterator's location using an in-order sequencing
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator&
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator++()
 {
     // TODO
     current_ = successor(current_);
     return *this; // why
 }
 
+/**
+* Advances the iterator and returns where it was.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator++(int)
+{
+    iterator old(*this);
+    current_ = successor(current_);
+    return old;
+}
+
+/**
+* Steps back to the previous item in order. Stepping back from end()
+* reaches the largest item.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator&
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator--()
+{
+    current_ = current_ == nullptr ? tree_->getLargestNode() : predecessor(current_);
+    return *this;
+}
+
+/**
+* Steps back and returns where the iterator was.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
 
 /*
 -------------------------------------------------------------
@@ -350,6 +619,148 @@ End implementations for the BinarySearchTree::iterator class.
 -------------------------------------------------------------
 */
 
+/*
+---------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::const_iterator class.
+---------------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::const_iterator(Node<Key,Value> *ptr, const BinarySearchTree* tree) :
+    current_(ptr), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::const_iterator() :
+    current_(nullptr), tree_(nullptr)
+{
+
+}
+
+/**
+* Read-only view of an iterator's position.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::const_iterator(const iterator& it) :
+    current_(it.current_), tree_(it.tree_)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value> &
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator*() const
+{
+    return current_->getItem();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value> *
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator->() const
+{
+    return &(current_->getItem());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+/**
+* Same stepping as iterator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator&
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator++()
+{
+    current_ = successor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    current_ = successor(current_);
+    return old;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator&
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator--()
+{
+    current_ = current_ == nullptr ? tree_->getLargestNode() : predecessor(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+-------------------------------------------------------------------
+End implementations for the BinarySearchTree::const_iterator class.
+-------------------------------------------------------------------
+*/
+
+/*
+---------------------------------------------------------------------
+Begin implementations for the BinarySearchTree::BasicRangeView class.
+---------------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename It>
+BinarySearchTree<Key, Value, Compare, Alloc>::BasicRangeView<It>::BasicRangeView(const It& first, const It& last) :
+    first_(first), last_(last)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename It>
+It BinarySearchTree<Key, Value, Compare, Alloc>::BasicRangeView<It>::begin() const
+{
+    return first_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename It>
+It BinarySearchTree<Key, Value, Compare, Alloc>::BasicRangeView<It>::end() const
+{
+    return last_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename It>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::BasicRangeView<It>::empty() const
+{
+    return first_ == last_;
+}
+
+/*
+-------------------------------------------------------------------
+End implementations for the BinarySearchTree::BasicRangeView class.
+-------------------------------------------------------------------
+*/
+
 /*
 -----------------------------------------------------
 Begin implementations for the BinarySearchTree class.
@@ -359,15 +770,100 @@ Begin implementations for the BinarySearchTree class.
 /**
 * Default constructor for a BinarySearchTree, which sets the root to nullptr.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() 
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree() :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    pool_(std::make_shared<NodePool<Alloc> >(sizeof(Node<Key, Value>))),
+    comp_()
 {
     // TODO
-    root_ = nullptr;
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+/**
+* Constructs an empty tree ordered by the given comparator, whose node
+* chunks come from the given allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(const Compare& comp, const Alloc& alloc) :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    pool_(std::make_shared<NodePool<Alloc> >(sizeof(Node<Key, Value>), alloc)),
+    comp_(comp)
+{
+
+}
+
+/**
+* Constructs an empty tree whose node chunks come from the given allocator.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(const Alloc& alloc) :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    pool_(std::make_shared<NodePool<Alloc> >(sizeof(Node<Key, Value>), alloc)),
+    comp_()
+{
+
+}
+
+/**
+* Constructor for derived trees, whose nodes are bigger than a plain Node,
+* so the pool's slots must be sized for them.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(std::size_t nodeSize, const Compare& comp, const Alloc& alloc) :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    pool_(std::make_shared<NodePool<Alloc> >(nodeSize, alloc)),
+    comp_(comp)
+{
+
+}
+
+/**
+* Takes over other's nodes without touching them. other is left empty,
+* with a fresh pool of its own.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::BinarySearchTree(BinarySearchTree&& other) :
+    root_(nullptr),
+    leftmost_(nullptr),
+    rightmost_(nullptr),
+    pool_(std::make_shared<NodePool<Alloc> >(other.pool_->slotSize(), other.pool_->allocator())),
+    comp_(other.comp_)
+{
+    std::swap(root_, other.root_);
+    std::swap(leftmost_, other.leftmost_);
+    std::swap(rightmost_, other.rightmost_);
+    std::swap(pool_, other.pool_);
+}
+
+/**
+* Drops this tree's contents and takes over other's. other is left empty.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>&
+BinarySearchTree<Key, Value, Compare, Alloc>::operator=(BinarySearchTree&& other)
+{
+    if(this != &other)
+    {
+        clear();
+        std::swap(root_, other.root_);
+        std::swap(leftmost_, other.leftmost_);
+        std::swap(rightmost_, other.rightmost_);
+        std::swap(pool_, other.pool_);
+        comp_ = other.comp_;
+    }
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+BinarySearchTree<Key, Value, Compare, Alloc>::~BinarySearchTree()
 {
     // TODO
     clear();
@@ -376,14 +872,14 @@ BinarySearchTree<Key, Value>::~BinarySearchTree()
 /**
  * Returns true if tree is empty
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Compare, class Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::empty() const
 {
     return root_ == nullptr;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::print() const
 {
     printRoot(root_);
     std::cout << "\n";
@@ -392,218 +888,523 @@ void BinarySearchTree<Key, Value>::print() const
 /**
 * Returns an iterator to the "smallest" item in the tree
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::begin()
 {
-    BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
+    BinarySearchTree<Key, Value, Compare, Alloc>::iterator begin(getSmallestNode(), this);
     return begin;
 }
 
 /**
 * Returns an iterator whose value means INVALID
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::end()
 {
-    BinarySearchTree<Key, Value>::iterator end(nullptr);
+    BinarySearchTree<Key, Value, Compare, Alloc>::iterator end(nullptr, this);
     return end;
 }
 
+/**
+* Read-only versions of begin() and end() for const trees.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::begin() const
+{
+    return makeConstIterator(getSmallestNode());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::end() const
+{
+    return makeConstIterator(nullptr);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::cbegin() const
+{
+    return begin();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::cend() const
+{
+    return end();
+}
+
+/**
+* Reverse iteration runs from the largest item down to the smallest.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
 /**
 * Returns an iterator to the item with the given key, k
 * or the end iterator if k does not exist in the tree
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k)
 {
     Node<Key, Value> *curr = internalFind(k);
-    BinarySearchTree<Key, Value>::iterator it(curr);
+    BinarySearchTree<Key, Value, Compare, Alloc>::iterator it(curr, this);
     return it;
 }
 
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const Key & k) const
+{
+    return makeConstIterator(internalFind(k));
+}
+
 /**
- * @precondition The key exists in the map
- * Returns the value associated with the key
- */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key)
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    return makeIterator(lowerBoundNode(key));
 }
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key) const
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    return makeConstIterator(lowerBoundNode(key));
 }
 
 /**
-* An insert method to insert into a Binary Search Tree.
-* The tree will not remain balanced when inserting.
-* Recall: If key is already in the tree, you should 
-* overwrite the current value with the updated value.
+* Returns an iterator to the first item whose key is greater than key,
+* or end() if there is none.
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key)
 {
-    // std::cout << "\n New Insert Pay Attension :)\n";
-    // std::cout << "Inserted Value is - " << keyValuePair.first << std::endl;
-    // TODO
-    // if the tree is empty
-    Node<Key, Value> * parentNode = nullptr;
-    if(root_ == nullptr)
-    {
-        // Node(const Key& key, const Value& value, Node<Key, Value>* parent)
-        root_ = new Node<Key,Value>(keyValuePair.first, keyValuePair.second, nullptr);
-        return;
-    }
-    // Begin traversal at the root and keep traversing until you reach nullptr
-    else
-    {
-        Node<Key, Value> * currentNode = root_;
-        // create a parent node since we will need it
-        parentNode = nullptr;
-        while (currentNode != nullptr)
-        {
-
-            // std::cout << "currentNode key is: " << currentNode->getKey() << std::endl;
-            // std::cout << "Left test\n";
-            // std::cout << "The value of currentNode is - " << (currentNode->getLeft() == nullptr) << std::endl;
-            // if (currentNode->getLeft() != nullptr) {
-            //  std::cout << "Left child key is - " << currentNode->getLeft()->getKey() << std::endl;
-            // }
-            // else std::cout << "Left child is nullptr\n";
-            // std::cout << "Right Test\n";
-            // if (currentNode->getRight() != nullptr) {
-            //   std::cout << "Right child key is - " << currentNode->getRight()->getKey() << std::endl;
-            // }
-            // else std::cout << "Right child is nullptr\n";
-
-            parentNode = currentNode;
-            // Go into left subtree if new node’s key is < parent
-            if (keyValuePair.first < currentNode->getKey())
-            {
-                currentNode = currentNode->getLeft();
-            }
-            // Go into right subtree if new node’s key is > parent
-            else if (keyValuePair.first > currentNode->getKey())
-            {
-                currentNode = currentNode->getRight();
-                // std::cout << currentNode->getValue() << std::endl;
-            }
-            // If keys are the same, update the value
-            else
-            {
-                currentNode->setValue(keyValuePair.second);
-                // just return because we are done 
-                return;
-            }
-        }
-        // found the location to insert your new node
-        // Dynamically create a new node and correctly set the node’s parent pointer
-        Node<Key,Value>* newNode = new Node<Key,Value>(keyValuePair.first, keyValuePair.second, parentNode);
-        // update the parent node’s left/right child pointers
-        if (parentNode->getKey() > keyValuePair.first)
-        {
-            parentNode->setLeft(newNode);
-        }
-        else
-        {
-            parentNode->setRight(newNode);
-        }
-        return;
-    }
+    return makeIterator(upperBoundNode(key));
 }
 
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key) const
+{
+    return makeConstIterator(upperBoundNode(key));
+}
 
 /**
-* A remove method to remove a specific key from a Binary Search Tree.
-* Recall: The writeup specifies that if a node has 2 children you
-* should swap with the predecessor and then remove.
+* Returns the run of items whose key is equivalent to key: one item if
+* the key is present and an empty run at lower_bound(key) otherwise.
+* Keys are unique, so a single descent is enough.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key)
 {
-    // TODO
-    // Find the node with the given key
-    Node<Key, Value>* targetNode = internalFind(key);
-    if (targetNode != nullptr)
+    std::pair<const_iterator, const_iterator> run = static_cast<const BinarySearchTree*>(this)->equal_range(key);
+    return std::make_pair(makeIterator(run.first.current_), makeIterator(run.second.current_));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator,
+          typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator>
+BinarySearchTree<Key, Value, Compare, Alloc>::equal_range(const Key& key) const
+{
+    Node<Key, Value>* first = lowerBoundNode(key);
+    Node<Key, Value>* last = first;
+    if(first != nullptr && !comp_(key, first->getKey()))
     {
-        std::cout << "(1)targetNode key is: " << targetNode->getKey() << std::endl;
+        last = successor(first);
     }
-    else
+    return std::make_pair(makeConstIterator(first), makeConstIterator(last));
+}
+
+/**
+* Returns the items with lo <= key < hi, in order. Both ends are found
+* up front, so iterating the view never compares keys.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::RangeView
+BinarySearchTree<Key, Value, Compare, Alloc>::range(const Key& lo, const Key& hi)
+{
+    if(!comp_(lo, hi))
     {
-        std::cout << "(1)targetNode is NULL: " << std::endl;
+        return RangeView(end(), end());
     }
-    if (targetNode == nullptr)
+    return RangeView(lower_bound(lo), lower_bound(hi));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::ConstRangeView
+BinarySearchTree<Key, Value, Compare, Alloc>::range(const Key& lo, const Key& hi) const
+{
+    if(!comp_(lo, hi))
+    {
+        return ConstRangeView(end(), end());
+    }
+    return ConstRangeView(lower_bound(lo), lower_bound(hi));
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value& BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value, class Compare, class Alloc>
+Value const & BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* Same as find above, but the key can be of any type that Compare can
+* order against Key, such as a const char* for std::string keys.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const K& k)
+{
+    return makeIterator(internalFind(k));
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::find(const K& k) const
+{
+    return makeConstIterator(internalFind(k));
+}
+
+/**
+* Looks up every key in [first, last) and writes an iterator to its item,
+* or end(), to out for each, in the order of the keys. Returns out past
+* the last one written. Faster than calling find() in a loop once the
+* tree no longer fits in cache; see findGroups().
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename ForwardIt, typename OutputIt>
+OutputIt BinarySearchTree<Key, Value, Compare, Alloc>::findBatch(ForwardIt first, ForwardIt last, OutputIt out)
+{
+    findGroups(first, last, [&](Node<Key, Value>* node) { *out++ = makeIterator(node); });
+    return out;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename ForwardIt, typename OutputIt>
+OutputIt BinarySearchTree<Key, Value, Compare, Alloc>::findBatch(ForwardIt first, ForwardIt last,
+                                                                 OutputIt out) const
+{
+    findGroups(first, last, [&](Node<Key, Value>* node) { *out++ = makeConstIterator(node); });
+    return out;
+}
+
+/**
+* Same as operator[] above, for any key type Compare can order against Key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+Value& BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const K& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename K, typename C, typename>
+Value const & BinarySearchTree<Key, Value, Compare, Alloc>::operator[](const K& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* Returns the item with the smallest key.
+* Throws std::out_of_range if the tree is empty.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<const Key, Value>& BinarySearchTree<Key, Value, Compare, Alloc>::front()
+{
+    if(leftmost_ == nullptr) throw std::out_of_range("Empty tree");
+    return leftmost_->getItem();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key, Value>& BinarySearchTree<Key, Value, Compare, Alloc>::front() const
+{
+    if(leftmost_ == nullptr) throw std::out_of_range("Empty tree");
+    return leftmost_->getItem();
+}
+
+/**
+* Returns the item with the largest key.
+* Throws std::out_of_range if the tree is empty.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<const Key, Value>& BinarySearchTree<Key, Value, Compare, Alloc>::back()
+{
+    if(rightmost_ == nullptr) throw std::out_of_range("Empty tree");
+    return rightmost_->getItem();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key, Value>& BinarySearchTree<Key, Value, Compare, Alloc>::back() const
+{
+    if(rightmost_ == nullptr) throw std::out_of_range("Empty tree");
+    return rightmost_->getItem();
+}
+
+/**
+* Removes the item with the smallest key and returns it, with the value
+* moved out. The node is at hand, so no search is needed; it has no left
+* child, so removing it never swaps.
+* Throws std::out_of_range if the tree is empty.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<Key, Value> BinarySearchTree<Key, Value, Compare, Alloc>::popMin()
+{
+    if(leftmost_ == nullptr) throw std::out_of_range("Empty tree");
+    Node<Key, Value>* node = leftmost_;
+    std::pair<Key, Value> item(node->getKey(), std::move(node->getValue()));
+    removeNode(node);
+    return item;
+}
+
+/**
+* Same as popMin, from the other end.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<Key, Value> BinarySearchTree<Key, Value, Compare, Alloc>::popMax()
+{
+    if(rightmost_ == nullptr) throw std::out_of_range("Empty tree");
+    Node<Key, Value>* node = rightmost_;
+    std::pair<Key, Value> item(node->getKey(), std::move(node->getValue()));
+    removeNode(node);
+    return item;
+}
+
+/**
+* Returns the comparator the tree is ordered by.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+Compare BinarySearchTree<Key, Value, Compare, Alloc>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* An insert method to insert into a Binary Search Tree.
+* The tree will not remain balanced when inserting.
+* Recall: If key is already in the tree, you should 
+* overwrite the current value with the updated value.
+* Returns an iterator to the key's node and whether a new node
+* was inserted, like std::map::insert.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    // TODO
+    std::pair<Node<Key, Value>*, bool> result =
+        assignAt<Node<Key, Value> >(root_, keyValuePair.first, keyValuePair.second);
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+/**
+* Same as above, but moves the value into the tree. The key is const in
+* the pair, so it is copied; try_emplace and insert_or_assign take the
+* key by rvalue reference to move it as well.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        assignAt<Node<Key, Value> >(root_, keyValuePair.first, std::move(keyValuePair.second));
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+/**
+* Builds a key/value pair in a new node from args, as std::map::emplace
+* does. Like std::map, and unlike insert(), an existing value is left
+* alone, and the new node is thrown away. Use try_emplace to avoid
+* building anything when the key is already present.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::emplace(Args&&... args)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        emplaceNode<Node<Key, Value> >(std::forward<Args>(args)...);
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+/**
+* If key is absent, inserts it with a value built in place from args.
+* If key is present, nothing is built and nothing changes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(const Key& key, Args&&... args)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        tryEmplaceAt<Node<Key, Value> >(root_, key, std::forward<Args>(args)...);
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::try_emplace(Key&& key, Args&&... args)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        tryEmplaceAt<Node<Key, Value> >(root_, std::move(key), std::forward<Args>(args)...);
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+/**
+* Inserts key with the given value, or assigns the value to the key's
+* node if key is already present.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert_or_assign(const Key& key, M&& value)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        assignAt<Node<Key, Value> >(root_, key, std::forward<M>(value));
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::insert_or_assign(Key&& key, M&& value)
+{
+    std::pair<Node<Key, Value>*, bool> result =
+        assignAt<Node<Key, Value> >(root_, std::move(key), std::forward<M>(value));
+    return std::make_pair(makeIterator(result.first), result.second);
+}
+
+
+/**
+* A remove method to remove a specific key from a Binary Search Tree.
+* Recall: The writeup specifies that if a node has 2 children you
+* should swap with the predecessor and then remove.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    // TODO
+    // Find the node with the given key
+    Node<Key, Value>* targetNode = internalFind(key);
+    BST_TRACE_EVENT(BST_TRACE_FIND, targetNode, root_);
+    if (targetNode == nullptr)
     {
        return;
     }
+    removeNode(targetNode);
+}
+
+/**
+* Unlinks and destroys a node of this tree. remove() and the pops share
+* this step; derived trees override it to rebalance afterwards.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::removeNode(Node<Key, Value>* targetNode)
+{
+    updateExtremes(targetNode);
     // Once you find the node, it can fall under 3 cases:
     // 2 children: swap the node with its predecessor
     if (targetNode->getLeft() != nullptr && targetNode->getRight() != nullptr)
     {   
         Node<Key, Value>* predNode = predecessor(targetNode);
+        BST_TRACE_EVENT(BST_TRACE_SWAP, targetNode, predNode);
         nodeSwap(targetNode, predNode);
 
     }
     // 0 or 1 child: promote the child into the node’s location, then delete node 
     Node<Key, Value>* childNode = nullptr;
-    std::cout << "rootNode key is: " << root_->getKey() << std::endl;
-    std::cout << "left child of rootNode is: " << root_->getLeft() << std::endl;
-    std::cout << "right child of rootNode is: " << root_->getRight() << std::endl;
     if (targetNode->getLeft() != nullptr)
     {
         childNode = targetNode->getLeft();
     }
     else if (targetNode->getRight() != nullptr)
     {
-        std::cout << "(2)targetNode key is: " << targetNode->getKey() << std::endl;
-        // std::cout << "right child of rootNode is: " << root_->getRight()->getKey() << std::endl;
         childNode = targetNode->getRight();
-        std::cout << "childNode is: " << childNode->getKey() << std::endl;
     }
+    BST_TRACE_EVENT(BST_TRACE_SPLICE, targetNode, childNode);
     // 0 child case: both left and right is nullptr
-    else 
-    {   std::cout << "rootNode key is: " << root_->getKey() << std::endl;
+    if (childNode == nullptr)
+    {
         if (targetNode == root_)
         {
-            if (targetNode != nullptr)
-            {
-                std::cout << "(3)targetNode key is: " << targetNode->getKey() << std::endl;
-            }
-            else
-            {
-                std::cout << "targetNode is NULL: " << std::endl;
-            }
             root_ = nullptr;
-            delete targetNode;
+            destroyNode(targetNode);
             return;
         }
-        std::cout << "(4)targetNode key is: " << targetNode->getKey() << std::endl;
         if (targetNode->getParent()->getLeft() == targetNode)
         {
-            // this->printRoot(targetNode); 
             targetNode->getParent()->setLeft(nullptr);
         }
         else
         {
             targetNode->getParent()->setRight(nullptr);
         }
-        delete targetNode;
+        destroyNode(targetNode);
         return;
     }
     if (targetNode == root_)
     {
         childNode->setParent(nullptr);
         root_ = childNode;
-        delete targetNode;
+        destroyNode(targetNode);
         return;
     }
     else
@@ -611,7 +1412,6 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
         // if target is the left child of the parent
         if (targetNode->getParent()->getLeft() == targetNode)
         {
-            // this->printRoot(targetNode); 
             targetNode->getParent()->setLeft(childNode);
         }
         else if (targetNode->getParent()->getRight() == targetNode)
@@ -623,15 +1423,15 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
         {
             childNode->setParent(targetNode->getParent());
         }
-        delete targetNode;
+        destroyNode(targetNode);
     }
 }
 
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare, Alloc>::predecessor(Node<Key, Value>* current)
 {
     // TODO
     // Case 1: if we have left child, go all the way right
@@ -657,9 +1457,9 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 }
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare, class Alloc>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare, Alloc>::successor(Node<Key, Value>* current)
 {
     if(current->getRight() != nullptr)
     {
@@ -683,52 +1483,387 @@ BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
 * A method to remove all contents of the tree and
 * reset the values in the tree for use again.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::clear()
 {
     // TODO
     if(root_ == nullptr)
     {
         return;
     }
-    else
+    settlePool();
+    if(pool_.use_count() == 1)
     {
         clearAll(root_);
         root_ = nullptr; // inportant
+        leftmost_ = nullptr;
+        rightmost_ = nullptr;
+        // every node is destroyed, so the chunks can go back in one go
+        pool_->release();
+    }
+    else
+    {
+        // other trees still have nodes in the pool, so give slots back one by one
+        destroyAll(root_);
+        root_ = nullptr;
+        leftmost_ = nullptr;
+        rightmost_ = nullptr;
     }
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clearAll(Node<Key, Value>* current)
+/**
+* Runs the destructor of every node under current, leaving the memory to
+* the pool. Uses O(1) extra memory whatever the tree's shape: while the
+* current node has a left child, that child is rotated up; once it has
+* none, it is destroyed and the walk moves on to its right child. Each
+* rotation puts one more node on the right spine, so there are fewer
+* than n of them. If the items are trivially destructible there is
+* nothing to run at all (Node's own destructor is empty), and the pool
+* takes the memory back without the nodes ever being visited.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::clearAll(Node<Key, Value>* current)
+{
+    teardown(current, false);
+}
+
+/**
+* Like clearAll, but also hands every slot back to the pool, for when the
+* pool outlives the nodes.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::destroyAll(Node<Key, Value>* subtree)
+{
+    teardown(subtree, true);
+}
+
+/**
+* The walk behind clearAll and destroyAll.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::teardown(Node<Key, Value>* current, bool freeSlots)
 {
-    if(current == nullptr)
+    if(!freeSlots && std::is_trivially_destructible<std::pair<const Key, Value> >::value)
     {
         return;
     }
-    clearAll(current->getLeft());
-    clearAll(current->getRight());
-    delete current;
+    while(current != nullptr)
+    {
+        Node<Key, Value>* left = current->getLeft();
+        if(left != nullptr)
+        {
+            current->setLeft(left->getRight());
+            left->setRight(current);
+            current = left;
+        }
+        else
+        {
+            Node<Key, Value>* right = current->getRight();
+            if(freeSlots)
+            {
+                destroyNode(current);
+            }
+            else
+            {
+                current->~Node();
+            }
+            current = right;
+        }
+    }
 }
 
+/**
+* Makes this tree the owner of the detached subtree under root, whose
+* nodes live in pool. The tree must be empty. Used by derived trees that
+* move whole subtrees between trees.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::adoptNodes(Node<Key, Value>* root, const std::shared_ptr<NodePool<Alloc> >& pool)
+{
+    pool_ = pool;
+    root_ = root;
+    if(root_ != nullptr)
+    {
+        root_->setParent(nullptr);
+    }
+    resetExtremes();
+}
 
 /**
-* A helper function to find the smallest node in the tree.
+* Gives this tree, which must be empty, a fresh pool of its own, letting
+* go of one it may have shared with other trees.
 */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::ownPool()
+{
+    pool_ = std::make_shared<NodePool<Alloc> >(pool_->slotSize(), pool_->allocator());
+}
+
+/**
+* Turns the pool's locking off once the trees it was shared with are gone
+* and this tree holds it alone. No other tree can take a share of it
+* without going through this one, so the count cannot grow back behind
+* this tree's back.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::settlePool()
+{
+    if(pool_->synchronized() && pool_.use_count() == 1)
+    {
+        pool_->setSynchronized(false);
+    }
+}
+
+/**
+* Wraps a node of this tree in an iterator. The iterator's node constructor
+* is only open to BinarySearchTree, so derived trees go through this.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::makeIterator(Node<Key, Value>* node)
+{
+    return iterator(node, this);
+}
+
+template<typename Key, typename Value, typename Compare, typename Alloc>
+typename BinarySearchTree<Key, Value, Compare, Alloc>::const_iterator
+BinarySearchTree<Key, Value, Compare, Alloc>::makeConstIterator(Node<Key, Value>* node) const
+{
+    return const_iterator(node, this);
+}
+
+/**
+* Builds a node in a slot taken from the pool.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType, typename... ItemArgs>
+NodeType* BinarySearchTree<Key, Value, Compare, Alloc>::createNode(NodeType* parent, ItemArgs&&... itemArgs)
+{
+    settlePool();
+    void* slot = pool_->allocate();
+    try
+    {
+        return new (slot) NodeType(parent, std::forward<ItemArgs>(itemArgs)...);
+    }
+    catch(...)
+    {
+        pool_->deallocate(slot);
+        throw;
+    }
+}
+
+/**
+* Destroys a node and puts its slot back on the pool's free list.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::destroyNode(Node<Key, Value>* node)
+{
+    BST_TRACE_EVENT(BST_TRACE_DELETE, node, nullptr);
+    node->~Node();
+    settlePool();
+    pool_->deallocate(node);
+}
+
+/**
+* Walks down from start, which must be the root or a node whose subtree
+* covers key. Returns the node holding key, or nullptr after setting
+* parent to the leaf a new node for key would hang from (nullptr for an
+* empty tree) and goLeft to the side it goes on.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::findSlot(Node<Key, Value>* start, const Key& key,
+                                                                Node<Key, Value>*& parent, bool& goLeft) const
+{
+    Node<Key, Value>* currentNode = start;
+    parent = nullptr;
+    goLeft = false;
+    while (currentNode != nullptr)
+    {
+        parent = currentNode;
+        int order = compareKeys(key, currentNode->getKey());
+        // Go into left subtree if new node’s key is < parent
+        if (order < 0)
+        {
+            goLeft = true;
+            currentNode = currentNode->getLeft();
+        }
+        // Go into right subtree if new node’s key is > parent
+        else if (order > 0)
+        {
+            goLeft = false;
+            currentNode = currentNode->getRight();
+        }
+        else
+        {
+            return currentNode;
+        }
+    }
+    return nullptr;
+}
+
+/**
+* Hangs a new node from parent on the given side, or makes it the root
+* if parent is nullptr. Derived trees override this to rebalance.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft)
+{
+    node->setParent(parent);
+    if (parent == nullptr)
+    {
+        root_ = node;
+        leftmost_ = node;
+        rightmost_ = node;
+    }
+    else if (goLeft)
+    {
+        parent->setLeft(node);
+        if (parent == leftmost_)
+        {
+            leftmost_ = node;
+        }
+    }
+    else
+    {
+        parent->setRight(node);
+        if (parent == rightmost_)
+        {
+            rightmost_ = node;
+        }
+    }
+}
+
+/**
+* insert_or_assign below start: overwrites the value of an existing key,
+* otherwise links in a new NodeType built from key and value. Returns the
+* node holding key and whether it is new.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType, typename KeyArg, typename M>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::assignAt(Node<Key, Value>* start, KeyArg&& key, M&& value)
+{
+    Node<Key, Value>* parent;
+    bool goLeft;
+    Node<Key, Value>* found = findSlot(start, key, parent, goLeft);
+    if (found != nullptr)
+    {
+        found->getValue() = std::forward<M>(value);
+        return std::make_pair(found, false);
+    }
+    NodeType* newNode = createNode<NodeType>(nullptr, std::forward<KeyArg>(key), std::forward<M>(value));
+    linkNode(newNode, parent, goLeft);
+    return std::make_pair(newNode, true);
+}
+
+/**
+* try_emplace below start: if key is absent, links in a new NodeType
+* whose value is built in place from args. Returns the node holding key
+* and whether it is new.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType, typename KeyArg, typename... Args>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::tryEmplaceAt(Node<Key, Value>* start, KeyArg&& key, Args&&... args)
+{
+    Node<Key, Value>* parent;
+    bool goLeft;
+    Node<Key, Value>* found = findSlot(start, key, parent, goLeft);
+    if (found != nullptr)
+    {
+        return std::make_pair(found, false);
+    }
+    NodeType* newNode = createNode<NodeType>(nullptr, std::piecewise_construct,
+                                             std::forward_as_tuple(std::forward<KeyArg>(key)),
+                                             std::forward_as_tuple(std::forward<Args>(args)...));
+    linkNode(newNode, parent, goLeft);
+    return std::make_pair(newNode, true);
+}
+
+/**
+* emplace: builds a NodeType from args first, since the key is only known
+* once the pair exists, then links it in or destroys it if the key is
+* already present. Returns the node holding key and whether it is new.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename NodeType, typename... Args>
+std::pair<Node<Key, Value>*, bool>
+BinarySearchTree<Key, Value, Compare, Alloc>::emplaceNode(Args&&... args)
+{
+    NodeType* newNode = createNode<NodeType>(nullptr, std::forward<Args>(args)...);
+    Node<Key, Value>* parent;
+    bool goLeft;
+    Node<Key, Value>* found = findSlot(root_, newNode->getKey(), parent, goLeft);
+    if (found != nullptr)
+    {
+        destroyNode(newNode);
+        return std::make_pair(found, false);
+    }
+    linkNode(newNode, parent, goLeft);
+    return std::make_pair(newNode, true);
+}
+
+
+/**
+* A helper function to find the smallest node in the tree. The tree keeps
+* it cached, so this is O(1).
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Compare, Alloc>::getSmallestNode() const
 {
     // TODO
-    Node<Key, Value>* currentNode = root_;
-    if (currentNode == nullptr)
+    return leftmost_;
+}
+
+/**
+* Returns the node with the largest key, or nullptr if the tree is empty.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+Node<Key, Value>*
+BinarySearchTree<Key, Value, Compare, Alloc>::getLargestNode() const
+{
+    return rightmost_;
+}
+
+/**
+* Recomputes the cached smallest and largest nodes by walking the left
+* and right spines, for code that rebuilds the tree wholesale.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::resetExtremes()
+{
+    leftmost_ = root_;
+    rightmost_ = root_;
+    if (root_ == nullptr)
+    {
+        return;
+    }
+    while (leftmost_->getLeft() != nullptr)
     {
-        return currentNode;
+        leftmost_ = leftmost_->getLeft();
     }
-    while (currentNode->getLeft() != nullptr)
+    while (rightmost_->getRight() != nullptr)
     {
-        currentNode = currentNode->getLeft();
+        rightmost_ = rightmost_->getRight();
+    }
+}
+
+/**
+* Moves the cached smallest or largest node off a node that is about to be
+* removed. Must run while leaving is still linked into the tree.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::updateExtremes(Node<Key, Value>* leaving)
+{
+    if (leaving == leftmost_)
+    {
+        leftmost_ = successor(leaving);
+    }
+    if (leaving == rightmost_)
+    {
+        rightmost_ = predecessor(leaving);
     }
-    return currentNode;
 }
 
 /**
@@ -736,18 +1871,20 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 * return a pointer to it or nullptr if no item with that key
 * exists
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::internalFind(const K& key) const
 {
     // TODO
     Node<Key, Value>* targetNode = root_;
     while (targetNode != nullptr)
     {
-        if (targetNode->getKey() > key)
+        int order = compareKeys(key, targetNode->getKey());
+        if (order < 0)
         {
             targetNode = targetNode->getLeft();
         }
-        else if (targetNode->getKey() < key)
+        else if (order > 0)
         {
             targetNode = targetNode->getRight();
         }
@@ -759,36 +1896,208 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) con
     return nullptr;
 }
 
+/**
+* Runs the descents for up to BATCH_WIDTH keys at a time in lockstep and
+* calls emit with each key's node (nullptr if missing) in key order. A
+* lone descent waits for one cache miss per level; here each round moves
+* every unfinished descent down one level and prefetches the node it goes
+* to, so by the time the round comes back to a descent its node has
+* usually arrived, and a round costs about one miss instead of one per
+* descent. Finished descents are swapped out of the active list so the
+* rounds only visit the ones still going.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename ForwardIt, typename Emit>
+void BinarySearchTree<Key, Value, Compare, Alloc>::findGroups(ForwardIt first, ForwardIt last, Emit emit) const
+{
+    ForwardIt keys[BATCH_WIDTH];
+    Node<Key, Value>* nodes[BATCH_WIDTH];
+    Node<Key, Value>* found[BATCH_WIDTH];
+    std::size_t active[BATCH_WIDTH];
+    while (first != last)
+    {
+        std::size_t width = 0;
+        for (; width < BATCH_WIDTH && first != last; ++width, ++first)
+        {
+            keys[width] = first;
+            nodes[width] = root_;
+            found[width] = nullptr;
+            active[width] = width;
+        }
+        std::size_t live = root_ == nullptr ? 0 : width;
+        while (live > 0)
+        {
+            for (std::size_t a = 0; a < live; )
+            {
+                std::size_t i = active[a];
+                Node<Key, Value>* node = nodes[i];
+                int order = compareKeys(*keys[i], node->getKey());
+                if (order == 0)
+                {
+                    found[i] = node;
+                    node = nullptr;
+                }
+                else
+                {
+                    node = order < 0 ? node->getLeft() : node->getRight();
+                }
+                if (node == nullptr)
+                {
+                    active[a] = active[--live];
+                    continue;
+                }
+                bst_prefetch::prefetch(node);
+                nodes[i] = node;
+                ++a;
+            }
+        }
+        for (std::size_t i = 0; i < width; ++i)
+        {
+            emit(found[i]);
+        }
+    }
+}
+
+/**
+* Returns the node with the smallest key not less than key, or nullptr.
+* One comparator call per level.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::lowerBoundNode(const K& key) const
+{
+    Node<Key, Value>* bound = nullptr;
+    Node<Key, Value>* current = root_;
+    while (current != nullptr)
+    {
+        if (comp_(current->getKey(), key))
+        {
+            current = current->getRight();
+        }
+        else
+        {
+            bound = current;
+            current = current->getLeft();
+        }
+    }
+    return bound;
+}
+
+/**
+* Returns the node with the smallest key greater than key, or nullptr.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare, Alloc>::upperBoundNode(const K& key) const
+{
+    Node<Key, Value>* bound = nullptr;
+    Node<Key, Value>* current = root_;
+    while (current != nullptr)
+    {
+        if (comp_(key, current->getKey()))
+        {
+            bound = current;
+            current = current->getLeft();
+        }
+        else
+        {
+            current = current->getRight();
+        }
+    }
+    return bound;
+}
+
+/**
+* Three-way comparison of two keys under the tree's comparator: negative
+* if a comes first, zero if equivalent, positive if b comes first. Costs
+* one comparator call if Compare has compare(a, b), two at most otherwise.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename A, typename B>
+int BinarySearchTree<Key, Value, Compare, Alloc>::compareKeys(const A& a, const B& b) const
+{
+    return bst_compare::threeWay(comp_, a, b);
+}
+
 /**
  * Return true iff the BST is balanced.
  */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::isBalanced() const
 {
     // TODO
     return isBalanced(root_);
 }
 
 
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced(Node<Key, Value>* Node) const
+/**
+* Checks the height balance of every node under Node in one post-order
+* pass, stopping at the first node whose subtrees differ by more than 1.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+bool BinarySearchTree<Key, Value, Compare, Alloc>::isBalanced(Node<Key, Value>* Node) const
 {
-    if (Node == nullptr)
+    return checkedHeight(Node, [](::Node<Key, Value>*, int leftHeight, int rightHeight)
     {
-        return true;
-    }
+        return std::abs(leftHeight - rightHeight) <= 1;
+    }) >= 0;
+}
 
-    int diff = abs(rootDepth(Node->getLeft()) - rootDepth(Node->getRight()));
-    if (diff > 1)
+/**
+* Computes the height of subtree in O(n) by a post-order walk, calling
+* check(node, leftHeight, rightHeight) once both subtrees of a node are
+* done. Returns -1 as soon as check returns false. The walk keeps its own
+* stack on the heap, so a degenerate tree cannot overflow the call stack.
+*/
+template<typename Key, typename Value, typename Compare, typename Alloc>
+template<typename Check>
+int BinarySearchTree<Key, Value, Compare, Alloc>::checkedHeight(Node<Key, Value>* subtree, Check check) const
+{
+    struct Frame
     {
-        return false;
+        Node<Key, Value>* node;
+        int leftHeight;
+        bool leftDone;
+    };
+    std::vector<Frame> stack;
+    Node<Key, Value>* node = subtree;
+    while (true)
+    {
+        while (node != nullptr)
+        {
+            Frame frame = { node, 0, false };
+            stack.push_back(frame);
+            node = node->getLeft();
+        }
+        // height of the subtree that was just finished (or found empty)
+        int height = 0;
+        while (!stack.empty())
+        {
+            Frame& top = stack.back();
+            if (!top.leftDone)
+            {
+                top.leftDone = true;
+                top.leftHeight = height;
+                node = top.node->getRight();
+                break;
+            }
+            if (!check(top.node, top.leftHeight, height))
+            {
+                return -1;
+            }
+            height = std::max(top.leftHeight, height) + 1;
+            stack.pop_back();
+        }
+        if (stack.empty())
+        {
+            return height;
+        }
     }
-    return isBalanced(Node->getLeft()) && isBalanced(Node->getRight());
 }
 
 
-template<typename Key, typename Value>
-int BinarySearchTree<Key, Value>::rootDepth(Node<Key,Value>* Node) const
+template<typename Key, typename Value, typename Compare, typename Alloc>
+int BinarySearchTree<Key, Value, Compare, Alloc>::rootDepth(Node<Key,Value>* Node) const
 {
   if(Node == nullptr)
   {
@@ -802,8 +2111,8 @@ int BinarySearchTree<Key, Value>::rootDepth(Node<Key,Value>* Node) const
 }
 
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+template<typename Key, typename Value, typename Compare, typename Alloc>
+void BinarySearchTree<Key, Value, Compare, Alloc>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
     if((n1 == n2) || (n1 == nullptr) || (n2 == nullptr) ) {
         return;
@@ -0,0 +1,116 @@
+#ifndef BST_COMPARE_H
+#define BST_COMPARE_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <utility>
+
+/**
+* Key comparison support for the search trees.
+*
+* The trees are ordered by a Compare function object, std::less<Key> by
+* default. A descent needs to know whether the key it looks for is less
+* than, equal to or greater than a node's key. With a plain less-than
+* that takes up to two calls per node. A comparator that also provides
+*
+*     int compare(const A& a, const B& b) const;
+*
+* returning a negative number, zero or a positive number like strcmp is
+* called once per node instead. A comparator that defines is_transparent
+* additionally lets find() and operator[] take any key-like type it can
+* compare against Key, so no temporary Key is built per lookup.
+*/
+
+namespace bst_compare
+{
+
+/**
+* Detects a three-way compare(a, b) member on Compare for argument types
+* A and B.
+*/
+template<typename Compare, typename A, typename B>
+class HasThreeWay
+{
+    template<typename C>
+    static char test(decltype(std::declval<const C&>().compare(std::declval<const A&>(),
+                                                               std::declval<const B&>()))*);
+    template<typename C>
+    static long test(...);
+public:
+    static const bool value = sizeof(test<Compare>(nullptr)) == sizeof(char);
+};
+
+template<bool>
+struct ThreeWayTag { };
+
+template<typename Compare, typename A, typename B>
+int threeWay(const Compare& comp, const A& a, const B& b, ThreeWayTag<true>)
+{
+    return comp.compare(a, b);
+}
+
+template<typename Compare, typename A, typename B>
+int threeWay(const Compare& comp, const A& a, const B& b, ThreeWayTag<false>)
+{
+    return comp(a, b) ? -1 : (comp(b, a) ? 1 : 0);
+}
+
+/**
+* Compares a with b using comp: negative if a comes first, zero if they
+* are equivalent, positive if b comes first.
+*/
+template<typename Compare, typename A, typename B>
+int threeWay(const Compare& comp, const A& a, const B& b)
+{
+    return threeWay(comp, a, b, ThreeWayTag<HasThreeWay<Compare, A, B>::value>());
+}
+
+/**
+* Views the characters of a string-like argument: a C string, or anything
+* with data() and size() such as std::string or std::string_view.
+*/
+inline std::pair<const char*, std::size_t> chars(const char* s)
+{
+    return std::make_pair(s, std::strlen(s));
+}
+
+template<typename S>
+std::pair<const char*, std::size_t> chars(const S& s)
+{
+    return std::make_pair(s.data(), s.size());
+}
+
+}
+
+/**
+* A transparent, three-way comparator for std::string keys. Lookups can
+* pass a std::string, a const char* or a std::string_view, and each node
+* on a descent costs a single memcmp.
+*/
+struct StringCompare
+{
+    typedef void is_transparent;
+
+    template<typename A, typename B>
+    int compare(const A& a, const B& b) const
+    {
+        std::pair<const char*, std::size_t> lhs = bst_compare::chars(a);
+        std::pair<const char*, std::size_t> rhs = bst_compare::chars(b);
+        std::size_t common = lhs.second < rhs.second ? lhs.second : rhs.second;
+        int result = common == 0 ? 0 : std::memcmp(lhs.first, rhs.first, common);
+        if (result != 0)
+        {
+            return result;
+        }
+        return lhs.second < rhs.second ? -1 : (lhs.second > rhs.second ? 1 : 0);
+    }
+
+    template<typename A, typename B>
+    bool operator()(const A& a, const B& b) const
+    {
+        return compare(a, b) < 0;
+    }
+};
+
+#endif
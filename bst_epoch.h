@@ -0,0 +1,174 @@
+#ifndef BST_EPOCH_H
+#define BST_EPOCH_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+* Epoch-based memory reclamation for trees that are read without locks.
+*
+* A reader pins the current epoch for as long as it may hold pointers
+* into a shared structure (see Guard). A writer that unlinks memory
+* retires it together with the epoch returned by retireEpoch(), and may
+* free it once minPinned() has moved past that epoch: every reader that
+* could still have seen the memory has unpinned by then.
+*
+* Pinning and unpinning are a couple of atomic operations on a record
+* owned by the calling thread, so readers never wait for each other or
+* for writers. The records live in a global list. A thread takes a free
+* record (or adds one) the first time it pins and hands it back when it
+* exits, so the list is as long as the most threads ever pinned at once.
+*/
+
+namespace bst_epoch
+{
+
+/**
+* One thread's announcement: the epoch it pinned, or 0 when idle.
+*/
+struct Record
+{
+    std::atomic<uint64_t> pinned;
+    std::atomic<bool> inUse;
+    Record* next;
+};
+
+inline std::atomic<uint64_t>& globalEpoch()
+{
+    static std::atomic<uint64_t> epoch(1);
+    return epoch;
+}
+
+inline std::atomic<Record*>& records()
+{
+    static std::atomic<Record*> head(nullptr);
+    return head;
+}
+
+/**
+* Claims an unused record, or adds a new one to the front of the list.
+*/
+inline Record* acquireRecord()
+{
+    for (Record* record = records().load(std::memory_order_acquire); record != nullptr; record = record->next)
+    {
+        bool expected = false;
+        if (!record->inUse.load(std::memory_order_relaxed) &&
+            record->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+        {
+            return record;
+        }
+    }
+    Record* record = new Record;
+    record->pinned.store(0, std::memory_order_relaxed);
+    record->inUse.store(true, std::memory_order_relaxed);
+    record->next = records().load(std::memory_order_relaxed);
+    while (!records().compare_exchange_weak(record->next, record, std::memory_order_release,
+                                            std::memory_order_relaxed))
+    {
+    }
+    return record;
+}
+
+/**
+* The calling thread's record and how deeply it is pinned. The record is
+* handed back when the thread exits.
+*/
+class ThreadState
+{
+public:
+    ThreadState() : record_(nullptr), depth_(0) { }
+    ~ThreadState()
+    {
+        if (record_ != nullptr)
+        {
+            record_->inUse.store(false, std::memory_order_release);
+        }
+    }
+
+    Record* record_;
+    unsigned depth_;
+};
+
+inline ThreadState& threadState()
+{
+    static thread_local ThreadState state;
+    return state;
+}
+
+/**
+* Announces the current epoch before the caller reads any shared
+* pointer. Nested pins on one thread keep the outermost epoch.
+*/
+inline void pin()
+{
+    ThreadState& state = threadState();
+    if (state.depth_++ != 0)
+    {
+        return;
+    }
+    if (state.record_ == nullptr)
+    {
+        state.record_ = acquireRecord();
+    }
+    state.record_->pinned.store(globalEpoch().load(std::memory_order_acquire), std::memory_order_relaxed);
+    // the announcement must be visible before the reads it protects
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+inline void unpin()
+{
+    ThreadState& state = threadState();
+    if (--state.depth_ == 0)
+    {
+        state.record_->pinned.store(0, std::memory_order_release);
+    }
+}
+
+/**
+* Called by a writer after unlinking memory. Returns the epoch to retire
+* it under and starts a new one.
+*/
+inline uint64_t retireEpoch()
+{
+    return globalEpoch().fetch_add(1, std::memory_order_seq_cst);
+}
+
+/**
+* The oldest epoch any reader still has pinned, or UINT64_MAX if none.
+* Memory retired under an epoch below this is no longer reachable.
+*/
+inline uint64_t minPinned()
+{
+    // pairs with the fence in pin(): either we see the reader's epoch or
+    // the reader sees what the writer unlinked as already gone
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (Record* record = records().load(std::memory_order_acquire); record != nullptr; record = record->next)
+    {
+        uint64_t pinned = record->pinned.load(std::memory_order_acquire);
+        if (pinned != 0 && pinned < oldest)
+        {
+            oldest = pinned;
+        }
+    }
+    return oldest;
+}
+
+/**
+* Keeps the calling thread pinned for its lifetime.
+*/
+class Guard
+{
+public:
+    Guard() { pin(); }
+    ~Guard() { unpin(); }
+
+private:
+    Guard(const Guard&);
+    Guard& operator=(const Guard&);
+};
+
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BST_PREFETCH_H
+#define BST_PREFETCH_H
+
+#include <cstddef>
+
+/**
+* Software prefetch support for the search structures.
+*
+* A lookup in a linked tree waits for one cache miss per level, because
+* the address of the next node is only known once the current one has
+* arrived. A search whose next addresses can be worked out ahead of time
+* (an implicit layout, or several independent descents in flight) can
+* ask for them early with prefetch() and overlap the misses instead.
+*
+* prefetch() is only a hint: it never faults, even on an address past
+* the end of an array, and it compiles to nothing where the compiler has
+* no prefetch builtin.
+*/
+
+namespace bst_prefetch
+{
+
+/**
+* Bytes in a cache line on the machines we tune for.
+*/
+static const std::size_t CACHE_LINE = 64;
+
+inline void prefetch(const void* address)
+{
+#if defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+/**
+* The number of low one bits in value.
+*/
+inline unsigned trailingOnes(std::size_t value)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(~static_cast<unsigned long long>(value));
+#else
+    unsigned ones = 0;
+    for (; value & 1; value >>= 1)
+    {
+        ++ones;
+    }
+    return ones;
+#endif
+}
+
+}
+
+#endif
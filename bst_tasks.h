@@ -0,0 +1,221 @@
+#ifndef BST_TASKS_H
+#define BST_TASKS_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+* A small fork-join thread pool for the trees' parallel algorithms.
+*
+* forkJoin(lower, upper) queues lower for the pool's worker threads, runs
+* upper on the calling thread and then waits for lower. If no worker has
+* picked lower up by then, the caller takes it back and runs it itself,
+* and a caller left waiting on a worker runs other queued tasks in the
+* meantime, so nested forks cannot deadlock however few workers there
+* are. A fork costs a queue push and pop instead of a thread start.
+*
+* The workers are started on first use, one fewer than the hardware
+* threads (but at least one), and are shared by every tree until the
+* program exits. An exception thrown by either side is rethrown by
+* forkJoin once both sides are done; if both throw, upper's wins.
+*/
+
+namespace bst_tasks
+{
+
+/**
+* A queued call. done is guarded by the pool's mutex.
+*/
+struct Task
+{
+    std::function<void()> body;
+    std::exception_ptr error;
+    bool done;
+};
+
+class Pool
+{
+public:
+    static Pool& instance();
+    ~Pool();
+
+    void submit(Task* task);
+    void join(Task* task);
+
+private:
+    Pool();
+    Pool(const Pool&);
+    Pool& operator=(const Pool&);
+
+    static void execute(Task* task);
+    void finish(Task* task);
+    void work();
+
+    std::mutex mutex_;
+    std::condition_variable changed_;   // a task was queued or finished
+    std::deque<Task*> queue_;           // workers take the oldest, joiners the newest
+    std::vector<std::thread> workers_;
+    bool stopping_;
+};
+
+/**
+* The pool every tree shares, started by the first call.
+*/
+inline Pool& Pool::instance()
+{
+    static Pool pool;
+    return pool;
+}
+
+inline Pool::Pool() :
+    stopping_(false)
+{
+    unsigned workers = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    for (unsigned i = 0; i < workers; ++i)
+    {
+        workers_.push_back(std::thread(&Pool::work, this));
+    }
+}
+
+inline Pool::~Pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    changed_.notify_all();
+    for (std::size_t i = 0; i < workers_.size(); ++i)
+    {
+        workers_[i].join();
+    }
+}
+
+inline void Pool::submit(Task* task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(task);
+    }
+    changed_.notify_all();
+}
+
+/**
+* Returns once task has run. A task still in the queue is taken back and
+* run here; otherwise this thread helps with queued work until the
+* worker running task is done.
+*/
+inline void Pool::join(Task* task)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::deque<Task*>::reverse_iterator queued = std::find(queue_.rbegin(), queue_.rend(), task);
+    if (queued != queue_.rend())
+    {
+        queue_.erase(std::next(queued).base());
+        lock.unlock();
+        execute(task);
+        return;
+    }
+    while (!task->done)
+    {
+        if (queue_.empty())
+        {
+            changed_.wait(lock);
+            continue;
+        }
+        Task* other = queue_.back();
+        queue_.pop_back();
+        lock.unlock();
+        execute(other);
+        finish(other);
+        lock.lock();
+    }
+}
+
+/**
+* Runs task's body, keeping what it throws for forkJoin to rethrow.
+*/
+inline void Pool::execute(Task* task)
+{
+    try
+    {
+        task->body();
+    }
+    catch (...)
+    {
+        task->error = std::current_exception();
+    }
+}
+
+/**
+* Marks a task taken from the queue as done and wakes its joiner.
+*/
+inline void Pool::finish(Task* task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task->done = true;
+    }
+    changed_.notify_all();
+}
+
+inline void Pool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        if (queue_.empty())
+        {
+            if (stopping_)
+            {
+                return;
+            }
+            changed_.wait(lock);
+            continue;
+        }
+        Task* task = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+        execute(task);
+        finish(task);
+        lock.lock();
+    }
+}
+
+/**
+* Runs lower on the pool and upper on this thread, and returns when both
+* are done. lower may also end up running on this thread.
+*/
+template<class Lower, class Upper>
+void forkJoin(Lower lower, Upper upper)
+{
+    Task task;
+    task.body = lower;
+    task.done = false;
+    Pool& pool = Pool::instance();
+    pool.submit(&task);
+    try
+    {
+        upper();
+    }
+    catch (...)
+    {
+        pool.join(&task);
+        throw;
+    }
+    pool.join(&task);
+    if (task.error)
+    {
+        std::rethrow_exception(task.error);
+    }
+}
+
+}
+
+#endif
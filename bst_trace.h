@@ -0,0 +1,118 @@
+#ifndef BST_TRACE_H
+#define BST_TRACE_H
+
+/**
+* Compile-time tracing hooks for the search trees.
+*
+* The trees report what they do through BST_TRACE_EVENT(kind, node, other).
+* Unless the build defines BST_TRACE (see DEFS in the Makefile) the macro
+* expands to nothing, so tracing costs nothing in a normal build.
+*
+* With BST_TRACE defined, each event is recorded into a fixed-size ring
+* buffer owned by the calling thread, so tracing never takes a lock or
+* touches a stream. Call bstTraceDump() to print the calling thread's most
+* recent events and bstTraceReset() to forget them.
+*/
+
+#ifdef BST_TRACE
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+/**
+* The kinds of structural step a tree can report.
+*/
+enum BstTraceKind
+{
+    BST_TRACE_FIND,     // located the node to operate on (node may be null)
+    BST_TRACE_SWAP,     // swapped node with other, its predecessor
+    BST_TRACE_SPLICE,   // replaced node by its only child, other (may be null)
+    BST_TRACE_DELETE    // destroyed node
+};
+
+/**
+* One recorded event. Nodes are kept as addresses only, so recording
+* never copies a key or a value.
+*/
+struct BstTraceEvent
+{
+    uint64_t seq;
+    BstTraceKind kind;
+    const void* node;
+    const void* other;
+};
+
+/**
+* A per-thread ring buffer holding the last BST_TRACE_CAPACITY events.
+*/
+#ifndef BST_TRACE_CAPACITY
+#define BST_TRACE_CAPACITY 1024
+#endif
+
+struct BstTraceRing
+{
+    BstTraceEvent events[BST_TRACE_CAPACITY];
+    uint64_t count;
+};
+
+inline BstTraceRing& bstTraceRing()
+{
+    static thread_local BstTraceRing ring = BstTraceRing();
+    return ring;
+}
+
+inline void bstTraceRecord(BstTraceKind kind, const void* node, const void* other)
+{
+    BstTraceRing& ring = bstTraceRing();
+    BstTraceEvent& event = ring.events[ring.count % BST_TRACE_CAPACITY];
+    event.seq = ring.count++;
+    event.kind = kind;
+    event.node = node;
+    event.other = other;
+}
+
+inline const char* bstTraceKindName(BstTraceKind kind)
+{
+    switch(kind)
+    {
+        case BST_TRACE_FIND:   return "find";
+        case BST_TRACE_SWAP:   return "swap";
+        case BST_TRACE_SPLICE: return "splice";
+        case BST_TRACE_DELETE: return "delete";
+    }
+    return "?";
+}
+
+/**
+* Prints the calling thread's buffered events, oldest first.
+*/
+inline void bstTraceDump(std::ostream& out = std::cout)
+{
+    BstTraceRing& ring = bstTraceRing();
+    uint64_t first = ring.count > BST_TRACE_CAPACITY ? ring.count - BST_TRACE_CAPACITY : 0;
+    for(uint64_t i = first; i < ring.count; ++i)
+    {
+        const BstTraceEvent& event = ring.events[i % BST_TRACE_CAPACITY];
+        out << '#' << event.seq << ' ' << bstTraceKindName(event.kind)
+            << " node=" << event.node << " other=" << event.other << '\n';
+    }
+}
+
+/**
+* Forgets the calling thread's buffered events.
+*/
+inline void bstTraceReset()
+{
+    bstTraceRing().count = 0;
+}
+
+#define BST_TRACE_EVENT(kind, node, other) bstTraceRecord((kind), (node), (other))
+
+#else
+
+#define BST_TRACE_EVENT(kind, node, other) ((void)0)
+
+#endif
+
+#endif
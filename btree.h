@@ -0,0 +1,1565 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "node_pool.h"
+
+/**
+* Bytes in a cache line. Default node sizes are whole numbers of lines.
+*/
+#ifndef BTREE_CACHE_LINE
+#define BTREE_CACHE_LINE 64
+#endif
+
+/**
+* Cache lines the searched part of a node (an inner node's keys, a
+* leaf's items) spans by default.
+*/
+#ifndef BTREE_NODE_LINES
+#define BTREE_NODE_LINES 4
+#endif
+
+/**
+* The default number of entries of entryBytes each in a node: as many as
+* fill BTREE_NODE_LINES cache lines, kept within [8, 128].
+*/
+constexpr std::size_t btreeFanout(std::size_t entryBytes)
+{
+    return BTREE_NODE_LINES * BTREE_CACHE_LINE / entryBytes < 8 ? 8 :
+           BTREE_NODE_LINES * BTREE_CACHE_LINE / entryBytes > 128 ? 128 :
+           BTREE_NODE_LINES * BTREE_CACHE_LINE / entryBytes;
+}
+
+/**
+* A B+-tree map with the same interface as BinarySearchTree and AVLTree
+* for insert(), emplace(), try_emplace(), insert_or_assign(), remove(),
+* find(), lower_bound(), upper_bound(), equal_range(), operator[] and
+* iteration both ways, so code using those can swap it in for them. The
+* binary trees' range views, front()/back(), popMin()/popMax() and
+* findBatch() have no counterpart here yet.
+*
+* A binary tree node holds one item, so every level of a lookup is a
+* dependent cache miss. Here an inner node holds up to INNER_FANOUT - 1
+* sorted keys in one contiguous array, followed by the child pointers,
+* and a leaf holds up to LEAF_CAPACITY sorted items; a lookup searches
+* within each node (binary search down to a short linear scan) and only
+* misses about once per level of a much shallower tree. Leaves are
+* linked both ways, so iteration walks them without touching the inner
+* nodes.
+*
+* Fanout sets both the inner fanout and the leaf capacity. Left at 0,
+* each is sized so the searched array spans BTREE_NODE_LINES cache lines
+* (see btreeFanout()).
+*
+* Items move between slots as nodes fill and split, so unlike the binary
+* trees any insert() or remove() invalidates every iterator, and since
+* keys are const the moves copy them.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> >,
+          std::size_t Fanout = 0>
+class BTree
+{
+public:
+    static_assert(Fanout == 0 || Fanout >= 4, "B-tree nodes need room for at least four entries");
+    typedef std::pair<const Key, Value> value_type;
+    static constexpr std::size_t LEAF_CAPACITY = Fanout != 0 ? Fanout : btreeFanout(sizeof(value_type));
+    static constexpr std::size_t INNER_FANOUT = Fanout != 0 ? Fanout : btreeFanout(sizeof(Key)) + 1;
+
+protected:
+    /**
+    * Uninitialized room for N objects of type T. Each node keeps one
+    * spare slot so an insert can overflow it before it is split.
+    */
+    template<class T, std::size_t N>
+    struct Slots
+    {
+        T& operator[](std::size_t i) { return *reinterpret_cast<T*>(&data_[i]); }
+        const T& operator[](std::size_t i) const { return *reinterpret_cast<const T*>(&data_[i]); }
+        template<class... Args>
+        void construct(std::size_t i, Args&&... args) { new (&data_[i]) T(std::forward<Args>(args)...); }
+        void destroy(std::size_t i) { (*this)[i].~T(); }
+        void relocate(std::size_t to, std::size_t from, Slots& source);
+
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type data_[N];
+    };
+
+    struct NodeBase
+    {
+        bool leaf_;
+        std::size_t count_;     // items in a leaf, keys in an inner node
+    };
+
+    struct Leaf : NodeBase
+    {
+        Leaf* prev_;
+        Leaf* next_;
+        Slots<value_type, LEAF_CAPACITY + 1> items_;
+    };
+
+    /**
+    * children_[i] holds the keys in [keys_[i - 1], keys_[i]).
+    */
+    struct Inner : NodeBase
+    {
+        Slots<Key, INNER_FANOUT> keys_;
+        NodeBase* children_[INNER_FANOUT + 1];
+    };
+
+public:
+    class const_iterator;
+
+    /**
+    * A bidirectional iterator over the items in key order. Decrementing
+    * end() lands on the largest item.
+    */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator();
+
+        std::pair<const Key,Value>& operator*() const;
+        std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Compare, Alloc, Fanout>;
+        friend class const_iterator;
+        iterator(Leaf* leaf, std::size_t index, const BTree* tree);
+        Leaf* leaf_;
+        std::size_t index_;
+        const BTree* tree_;
+    };
+
+    /**
+    * The read-only counterpart of iterator, handed out by const trees.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const iterator& it);
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Compare, Alloc, Fanout>;
+        const_iterator(Leaf* leaf, std::size_t index, const BTree* tree);
+        Leaf* leaf_;
+        std::size_t index_;
+        const BTree* tree_;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+public:
+    explicit BTree(const Compare& comp = Compare(), const Alloc& alloc = Alloc());
+    BTree(BTree&& other);
+    BTree& operator=(BTree&& other);
+    ~BTree();
+
+    std::pair<iterator, bool> insert(const std::pair<const Key, Value>& keyValuePair);
+    std::pair<iterator, bool> insert(std::pair<const Key, Value>&& keyValuePair);
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& value);
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& value);
+    void remove(const Key& key);
+    void clear();
+
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    reverse_iterator rbegin();
+    reverse_iterator rend();
+    const_reverse_iterator rbegin() const;
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    std::size_t size() const;
+    bool empty() const;
+    std::size_t height() const;
+    Compare key_comp() const;
+    bool validate() const;
+
+protected:
+    // Nodes live in the tree's pools, so a copy would have to rebuild
+    // every node; not needed yet.
+    BTree(const BTree&);
+    BTree& operator=(const BTree&);
+
+    static const std::size_t LEAF_MIN = LEAF_CAPACITY / 2;
+    static const std::size_t INNER_MIN = (INNER_FANOUT + 1) / 2;     // children
+    static const std::size_t LINEAR_SCAN = 8;
+
+    std::size_t childIndex(const Inner* inner, const Key& key) const;
+    std::size_t itemIndex(const Leaf* leaf, const Key& key) const;
+    Leaf* findLeaf(const Key& key) const;
+    Leaf* lastLeaf() const;
+    std::pair<Leaf*, std::size_t> lowerBound(const Key& key) const;
+    std::pair<Leaf*, std::size_t> upperBound(const Key& key) const;
+
+    template<class P>
+    std::pair<iterator, bool> insertItem(P&& keyValuePair);
+    template<class Found, class Build>
+    std::pair<iterator, bool> placeItem(const Key& key, Found found, Build build);
+    template<class Found, class Build>
+    bool placeAt(NodeBase* node, const Key& key, Found& found, Build& build, Leaf*& where, std::size_t& at);
+    bool overflowing(const NodeBase* node) const;
+    void splitChild(Inner* parent, std::size_t index, Leaf*& where, std::size_t& at);
+    void insertChild(Inner* parent, std::size_t index, Key&& separator, NodeBase* child);
+
+    bool removeAt(NodeBase* node, const Key& key);
+    bool underfull(const NodeBase* node) const;
+    void rebalanceChild(Inner* parent, std::size_t index);
+    void mergeChildren(Inner* parent, std::size_t index);
+    void eraseChild(Inner* parent, std::size_t index);
+
+    Leaf* newLeaf();
+    Inner* newInner();
+    void freeNode(NodeBase* node);
+    void destroyAll(NodeBase* node);
+    std::size_t validateNode(const NodeBase* node, const Key* lo, const Key* hi, bool root,
+                             const Leaf*& previous, std::size_t& items) const;
+
+    Compare comp_;
+    std::unique_ptr<NodePool<Alloc> > leaves_;
+    std::unique_ptr<NodePool<Alloc> > inners_;
+    NodeBase* root_;
+    Leaf* first_;
+    std::size_t size_;
+};
+
+template <class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+constexpr std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::LEAF_CAPACITY;
+template <class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+constexpr std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::INNER_FANOUT;
+template <class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+const std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::LEAF_MIN;
+template <class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+const std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::INNER_MIN;
+
+/*
+-------------------------------------------------
+Begin implementations for the BTree::Slots class.
+-------------------------------------------------
+*/
+
+/**
+* Moves the object in source's slot from into this slot to, which must
+* be empty, and leaves from empty.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class T, std::size_t N>
+void BTree<Key, Value, Compare, Alloc, Fanout>::Slots<T, N>::relocate(std::size_t to, std::size_t from, Slots& source)
+{
+    construct(to, std::move(source[from]));
+    source.destroy(from);
+}
+
+/*
+-----------------------------------------------
+End implementations for the BTree::Slots class.
+-----------------------------------------------
+*/
+
+/*
+----------------------------------------------------
+Begin implementations for the BTree::iterator class.
+----------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::iterator() :
+    leaf_(nullptr), index_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::iterator(Leaf* leaf, std::size_t index, const BTree* tree) :
+    leaf_(leaf), index_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<const Key,Value>& BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator*() const
+{
+    return leaf_->items_[index_];
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<const Key,Value>* BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator->() const
+{
+    return &leaf_->items_[index_];
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator==(const iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Steps to the next item in the leaf, or to the first item of the next
+* leaf.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator&
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator++()
+{
+    if (++index_ == leaf_->count_)
+    {
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator&
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator--()
+{
+    if (leaf_ == nullptr)
+    {
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_;
+    }
+    else if (index_ == 0)
+    {
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_;
+    }
+    --index_;
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+--------------------------------------------------
+End implementations for the BTree::iterator class.
+--------------------------------------------------
+*/
+
+/*
+----------------------------------------------------------
+Begin implementations for the BTree::const_iterator class.
+----------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::const_iterator() :
+    leaf_(nullptr), index_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::const_iterator(const iterator& it) :
+    leaf_(it.leaf_), index_(it.index_), tree_(it.tree_)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::const_iterator(Leaf* leaf, std::size_t index,
+                                                                          const BTree* tree) :
+    leaf_(leaf), index_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+const std::pair<const Key,Value>& BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator*() const
+{
+    return leaf_->items_[index_];
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+const std::pair<const Key,Value>* BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator->() const
+{
+    return &leaf_->items_[index_];
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator&
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator++()
+{
+    if (++index_ == leaf_->count_)
+    {
+        leaf_ = leaf_->next_;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator&
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator--()
+{
+    if (leaf_ == nullptr)
+    {
+        leaf_ = tree_->lastLeaf();
+        index_ = leaf_->count_;
+    }
+    else if (index_ == 0)
+    {
+        leaf_ = leaf_->prev_;
+        index_ = leaf_->count_;
+    }
+    --index_;
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+--------------------------------------------------------
+End implementations for the BTree::const_iterator class.
+--------------------------------------------------------
+*/
+
+/*
+------------------------------------------
+Begin implementations for the BTree class.
+------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::BTree(const Compare& comp, const Alloc& alloc) :
+    comp_(comp),
+    leaves_(new NodePool<Alloc>(sizeof(Leaf), alloc)),
+    inners_(new NodePool<Alloc>(sizeof(Inner), alloc)),
+    root_(nullptr),
+    first_(nullptr),
+    size_(0)
+{
+
+}
+
+/**
+* Takes other's nodes in O(1), leaving other empty and usable.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::BTree(BTree&& other) :
+    comp_(other.comp_),
+    leaves_(new NodePool<Alloc>(sizeof(Leaf), other.leaves_->allocator())),
+    inners_(new NodePool<Alloc>(sizeof(Inner), other.inners_->allocator())),
+    root_(other.root_),
+    first_(other.first_),
+    size_(other.size_)
+{
+    leaves_.swap(other.leaves_);
+    inners_.swap(other.inners_);
+    other.root_ = nullptr;
+    other.first_ = nullptr;
+    other.size_ = 0;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>&
+BTree<Key, Value, Compare, Alloc, Fanout>::operator=(BTree&& other)
+{
+    if (this != &other)
+    {
+        clear();
+        comp_ = other.comp_;
+        leaves_.swap(other.leaves_);
+        inners_.swap(other.inners_);
+        std::swap(root_, other.root_);
+        std::swap(first_, other.first_);
+        std::swap(size_, other.size_);
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+BTree<Key, Value, Compare, Alloc, Fanout>::~BTree()
+{
+    clear();
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already there.
+* Returns where the key is and whether it was new.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insertItem(keyValuePair);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    return insertItem(std::move(keyValuePair));
+}
+
+/**
+* Builds a pair from args, as std::map::emplace does. Like std::map, and
+* unlike insert(), an existing value is left alone and the new pair is
+* thrown away. Use try_emplace to avoid building anything when the key
+* is already present.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class... Args>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::emplace(Args&&... args)
+{
+    value_type item(std::forward<Args>(args)...);
+    return placeItem(item.first, [](value_type&) { },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, std::move(item));
+                     });
+}
+
+/**
+* If key is absent, inserts it with a value built in place from args.
+* If key is present, nothing is built and nothing changes.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class... Args>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::try_emplace(const Key& key, Args&&... args)
+{
+    return placeItem(key, [](value_type&) { },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, std::piecewise_construct, std::forward_as_tuple(key),
+                                         std::forward_as_tuple(std::forward<Args>(args)...));
+                     });
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class... Args>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::try_emplace(Key&& key, Args&&... args)
+{
+    return placeItem(key, [](value_type&) { },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                                         std::forward_as_tuple(std::forward<Args>(args)...));
+                     });
+}
+
+/**
+* Inserts key with the given value, or assigns the value to the key's
+* item if key is already present.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class M>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::insert_or_assign(const Key& key, M&& value)
+{
+    return placeItem(key, [&](value_type& item) { item.second = std::forward<M>(value); },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, key, std::forward<M>(value));
+                     });
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class M>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::insert_or_assign(Key&& key, M&& value)
+{
+    return placeItem(key, [&](value_type& item) { item.second = std::forward<M>(value); },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, std::move(key), std::forward<M>(value));
+                     });
+}
+
+/**
+* Removes the key if it is there. A node left less than half full
+* borrows from a sibling or is merged into one.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::remove(const Key& key)
+{
+    if (root_ == nullptr || !removeAt(root_, key))
+    {
+        return;
+    }
+    --size_;
+    if (root_->count_ == 0)
+    {
+        // an inner root down to one child, or an empty leaf
+        NodeBase* old = root_;
+        root_ = old->leaf_ ? nullptr : static_cast<Inner*>(old)->children_[0];
+        if (root_ == nullptr)
+        {
+            first_ = nullptr;
+        }
+        freeNode(old);
+    }
+}
+
+/**
+* Destroys every item and hands the nodes' memory back all at once.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::clear()
+{
+    if (root_ != nullptr &&
+        !(std::is_trivially_destructible<value_type>::value && std::is_trivially_destructible<Key>::value))
+    {
+        destroyAll(root_);
+    }
+    leaves_->release();
+    inners_->release();
+    root_ = nullptr;
+    first_ = nullptr;
+    size_ = 0;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::begin()
+{
+    return iterator(first_, 0, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::end()
+{
+    return iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::begin() const
+{
+    return const_iterator(first_, 0, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::end() const
+{
+    return const_iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::reverse_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::rbegin()
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::reverse_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::rend()
+{
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_reverse_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::rbegin() const
+{
+    return const_reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_reverse_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::rend() const
+{
+    return const_reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::find(const Key& key)
+{
+    const_iterator it = static_cast<const BTree*>(this)->find(key);
+    return iterator(it.leaf_, it.index_, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::find(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if (leaf != nullptr)
+    {
+        std::size_t index = itemIndex(leaf, key);
+        if (index < leaf->count_ && !comp_(key, leaf->items_[index].first))
+        {
+            return const_iterator(leaf, index, this);
+        }
+    }
+    return end();
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::lower_bound(const Key& key)
+{
+    std::pair<Leaf*, std::size_t> at = lowerBound(key);
+    return iterator(at.first, at.second, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::lower_bound(const Key& key) const
+{
+    std::pair<Leaf*, std::size_t> at = lowerBound(key);
+    return const_iterator(at.first, at.second, this);
+}
+
+/**
+* The run of items with key: one item if the key is present and an empty
+* run at lower_bound(key) otherwise. Keys are unique, so a single descent
+* is enough.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator,
+          typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator>
+BTree<Key, Value, Compare, Alloc, Fanout>::equal_range(const Key& key)
+{
+    std::pair<const_iterator, const_iterator> run = static_cast<const BTree*>(this)->equal_range(key);
+    return std::make_pair(iterator(run.first.leaf_, run.first.index_, this),
+                          iterator(run.second.leaf_, run.second.index_, this));
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator,
+          typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator>
+BTree<Key, Value, Compare, Alloc, Fanout>::equal_range(const Key& key) const
+{
+    const_iterator first = lower_bound(key);
+    const_iterator last = first;
+    if (last != end() && !comp_(key, last->first))
+    {
+        ++last;
+    }
+    return std::make_pair(first, last);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::upper_bound(const Key& key)
+{
+    std::pair<Leaf*, std::size_t> at = upperBound(key);
+    return iterator(at.first, at.second, this);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::const_iterator
+BTree<Key, Value, Compare, Alloc, Fanout>::upper_bound(const Key& key) const
+{
+    std::pair<Leaf*, std::size_t> at = upperBound(key);
+    return const_iterator(at.first, at.second, this);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+Value& BTree<Key, Value, Compare, Alloc, Fanout>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+Value const & BTree<Key, Value, Compare, Alloc, Fanout>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return it->second;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::empty() const
+{
+    return size_ == 0;
+}
+
+/**
+* Levels from the root down to the leaves, 0 for an empty tree.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::height() const
+{
+    std::size_t levels = 0;
+    for (const NodeBase* node = root_; node != nullptr; ++levels)
+    {
+        node = node->leaf_ ? nullptr : static_cast<const Inner*>(node)->children_[0];
+    }
+    return levels;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+Compare BTree<Key, Value, Compare, Alloc, Fanout>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* Checks that keys are in order and within their separators, every node
+* but the root is at least half full, all leaves are at the same depth,
+* the leaf links match the tree and the size is right. Meant for health
+* checks and tests; returns false at the first violation.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::validate() const
+{
+    if (root_ == nullptr)
+    {
+        return first_ == nullptr && size_ == 0;
+    }
+    const Leaf* previous = nullptr;
+    std::size_t items = 0;
+    if (validateNode(root_, nullptr, nullptr, true, previous, items) == 0)
+    {
+        return false;
+    }
+    return previous->next_ == nullptr && items == size_;
+}
+
+/**
+* The index of the child of inner whose range holds key: the number of
+* keys not greater than key. Binary search narrows the keys down to a
+* few, which a linear scan finishes.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::childIndex(const Inner* inner, const Key& key) const
+{
+    std::size_t lo = 0;
+    std::size_t hi = inner->count_;
+    while (hi - lo > LINEAR_SCAN)
+    {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (comp_(key, inner->keys_[mid]))
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    while (lo < hi && !comp_(key, inner->keys_[lo]))
+    {
+        ++lo;
+    }
+    return lo;
+}
+
+/**
+* The index of the first item in leaf whose key is not below key.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::itemIndex(const Leaf* leaf, const Key& key) const
+{
+    std::size_t lo = 0;
+    std::size_t hi = leaf->count_;
+    while (hi - lo > LINEAR_SCAN)
+    {
+        std::size_t mid = lo + (hi - lo) / 2;
+        if (comp_(leaf->items_[mid].first, key))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    while (lo < hi && comp_(leaf->items_[lo].first, key))
+    {
+        ++lo;
+    }
+    return lo;
+}
+
+/**
+* The leaf whose range holds key, or null if the tree is empty.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::Leaf*
+BTree<Key, Value, Compare, Alloc, Fanout>::findLeaf(const Key& key) const
+{
+    NodeBase* node = root_;
+    while (node != nullptr && !node->leaf_)
+    {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->children_[childIndex(inner, key)];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::Leaf*
+BTree<Key, Value, Compare, Alloc, Fanout>::lastLeaf() const
+{
+    NodeBase* node = root_;
+    while (!node->leaf_)
+    {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->children_[inner->count_];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+/**
+* The leaf and slot of the first item not below key, or (null, 0) if
+* there is none. That item is at the start of the next leaf when every
+* key in key's own leaf is smaller.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::Leaf*, std::size_t>
+BTree<Key, Value, Compare, Alloc, Fanout>::lowerBound(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if (leaf == nullptr)
+    {
+        return std::make_pair(leaf, std::size_t(0));
+    }
+    std::size_t index = itemIndex(leaf, key);
+    if (index == leaf->count_)
+    {
+        return std::make_pair(leaf->next_, std::size_t(0));
+    }
+    return std::make_pair(leaf, index);
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::Leaf*, std::size_t>
+BTree<Key, Value, Compare, Alloc, Fanout>::upperBound(const Key& key) const
+{
+    std::pair<Leaf*, std::size_t> at = lowerBound(key);
+    if (at.first != nullptr && !comp_(key, at.first->items_[at.second].first))
+    {
+        if (++at.second == at.first->count_)
+        {
+            at.first = at.first->next_;
+            at.second = 0;
+        }
+    }
+    return at;
+}
+
+/**
+* Shared by both insert() overloads: overwrites the value of an existing
+* key, otherwise copies or moves the pair in.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class P>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::insertItem(P&& keyValuePair)
+{
+    return placeItem(keyValuePair.first,
+                     [&](value_type& item) { item.second = std::forward<P>(keyValuePair).second; },
+                     [&](Slots<value_type, LEAF_CAPACITY + 1>& items, std::size_t index)
+                     {
+                         items.construct(index, std::forward<P>(keyValuePair));
+                     });
+}
+
+/**
+* The one descent behind every insert flavour. If key is present,
+* found(item) gets its item; otherwise build(items, index) constructs the
+* new item in an empty leaf slot. build may move from key, which is not
+* looked at again. Returns where the key is and whether it was new.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class Found, class Build>
+std::pair<typename BTree<Key, Value, Compare, Alloc, Fanout>::iterator, bool>
+BTree<Key, Value, Compare, Alloc, Fanout>::placeItem(const Key& key, Found found, Build build)
+{
+    if (root_ == nullptr)
+    {
+        first_ = newLeaf();
+        root_ = first_;
+    }
+    Leaf* where = nullptr;
+    std::size_t at = 0;
+    bool inserted = placeAt(root_, key, found, build, where, at);
+    if (overflowing(root_))
+    {
+        // the tree grows by one level at the top
+        Inner* root = newInner();
+        root->children_[0] = root_;
+        root_ = root;
+        splitChild(root, 0, where, at);
+    }
+    if (inserted)
+    {
+        ++size_;
+    }
+    return std::make_pair(iterator(where, at, this), inserted);
+}
+
+/**
+* Places key in the subtree at node and records the item's leaf and slot
+* in where and at. A child left overflowing is split here; node itself
+* may be left overflowing for its parent to split. Returns whether the
+* key was new.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+template<class Found, class Build>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::placeAt(NodeBase* node, const Key& key, Found& found, Build& build,
+                                                        Leaf*& where, std::size_t& at)
+{
+    if (node->leaf_)
+    {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        std::size_t index = itemIndex(leaf, key);
+        where = leaf;
+        at = index;
+        if (index < leaf->count_ && !comp_(key, leaf->items_[index].first))
+        {
+            found(leaf->items_[index]);
+            return false;
+        }
+        for (std::size_t i = leaf->count_; i > index; --i)
+        {
+            leaf->items_.relocate(i, i - 1, leaf->items_);
+        }
+        try
+        {
+            build(leaf->items_, index);
+        }
+        catch (...)
+        {
+            // close the gap again so the leaf stays whole
+            for (std::size_t i = index; i < leaf->count_; ++i)
+            {
+                leaf->items_.relocate(i, i + 1, leaf->items_);
+            }
+            throw;
+        }
+        ++leaf->count_;
+        return true;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    std::size_t index = childIndex(inner, key);
+    bool inserted = placeAt(inner->children_[index], key, found, build, where, at);
+    if (overflowing(inner->children_[index]))
+    {
+        splitChild(inner, index, where, at);
+    }
+    return inserted;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::overflowing(const NodeBase* node) const
+{
+    return node->count_ > (node->leaf_ ? LEAF_CAPACITY : INNER_FANOUT - 1);
+}
+
+/**
+* Splits the overflowing child at index into two nodes and adds the
+* second to parent. An inserted item that moves to the new leaf has
+* where and at updated to match.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::splitChild(Inner* parent, std::size_t index,
+                                                           Leaf*& where, std::size_t& at)
+{
+    NodeBase* child = parent->children_[index];
+    if (child->leaf_)
+    {
+        Leaf* left = static_cast<Leaf*>(child);
+        Leaf* right = newLeaf();
+        std::size_t keep = (left->count_ + 1) / 2;
+        for (std::size_t i = keep; i < left->count_; ++i)
+        {
+            right->items_.relocate(i - keep, i, left->items_);
+        }
+        right->count_ = left->count_ - keep;
+        left->count_ = keep;
+        right->prev_ = left;
+        right->next_ = left->next_;
+        if (right->next_ != nullptr)
+        {
+            right->next_->prev_ = right;
+        }
+        left->next_ = right;
+        if (where == left && at >= keep)
+        {
+            where = right;
+            at -= keep;
+        }
+        insertChild(parent, index, Key(right->items_[0].first), right);
+    }
+    else
+    {
+        // the middle key moves up rather than being copied
+        Inner* left = static_cast<Inner*>(child);
+        Inner* right = newInner();
+        std::size_t keep = (left->count_ + 2) / 2;      // children
+        for (std::size_t i = keep; i < left->count_; ++i)
+        {
+            right->keys_.relocate(i - keep, i, left->keys_);
+        }
+        for (std::size_t i = keep; i <= left->count_; ++i)
+        {
+            right->children_[i - keep] = left->children_[i];
+        }
+        right->count_ = left->count_ - keep;
+        Key separator(std::move(left->keys_[keep - 1]));
+        left->keys_.destroy(keep - 1);
+        left->count_ = keep - 1;
+        insertChild(parent, index, std::move(separator), right);
+    }
+}
+
+/**
+* Puts child to the right of the child at index, with separator as the
+* key between them.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::insertChild(Inner* parent, std::size_t index, Key&& separator,
+                                                            NodeBase* child)
+{
+    for (std::size_t i = parent->count_; i > index; --i)
+    {
+        parent->keys_.relocate(i, i - 1, parent->keys_);
+        parent->children_[i + 1] = parent->children_[i];
+    }
+    parent->keys_.construct(index, std::move(separator));
+    parent->children_[index + 1] = child;
+    ++parent->count_;
+}
+
+/**
+* Removes key from the subtree at node. A child left less than half full
+* is fixed here; node itself is left for its parent. Returns whether the
+* key was there.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::removeAt(NodeBase* node, const Key& key)
+{
+    if (node->leaf_)
+    {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        std::size_t index = itemIndex(leaf, key);
+        if (index == leaf->count_ || comp_(key, leaf->items_[index].first))
+        {
+            return false;
+        }
+        leaf->items_.destroy(index);
+        for (std::size_t i = index + 1; i < leaf->count_; ++i)
+        {
+            leaf->items_.relocate(i - 1, i, leaf->items_);
+        }
+        --leaf->count_;
+        return true;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    std::size_t index = childIndex(inner, key);
+    if (!removeAt(inner->children_[index], key))
+    {
+        return false;
+    }
+    if (underfull(inner->children_[index]))
+    {
+        rebalanceChild(inner, index);
+    }
+    return true;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+bool BTree<Key, Value, Compare, Alloc, Fanout>::underfull(const NodeBase* node) const
+{
+    return node->leaf_ ? node->count_ < LEAF_MIN : node->count_ + 1 < INNER_MIN;
+}
+
+/**
+* Refills the underfull child at index with an entry from a sibling that
+* can spare one, or else merges it with a sibling.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::rebalanceChild(Inner* parent, std::size_t index)
+{
+    NodeBase* child = parent->children_[index];
+    NodeBase* left = index > 0 ? parent->children_[index - 1] : nullptr;
+    NodeBase* right = index < parent->count_ ? parent->children_[index + 1] : nullptr;
+    std::size_t spare = child->leaf_ ? LEAF_MIN : INNER_MIN - 1;
+    if (left != nullptr && left->count_ > spare)
+    {
+        if (child->leaf_)
+        {
+            Leaf* to = static_cast<Leaf*>(child);
+            Leaf* from = static_cast<Leaf*>(left);
+            for (std::size_t i = to->count_; i > 0; --i)
+            {
+                to->items_.relocate(i, i - 1, to->items_);
+            }
+            to->items_.relocate(0, --from->count_, from->items_);
+            ++to->count_;
+            parent->keys_[index - 1] = to->items_[0].first;
+        }
+        else
+        {
+            // rotate right through the separator
+            Inner* to = static_cast<Inner*>(child);
+            Inner* from = static_cast<Inner*>(left);
+            for (std::size_t i = to->count_; i > 0; --i)
+            {
+                to->keys_.relocate(i, i - 1, to->keys_);
+            }
+            for (std::size_t i = to->count_ + 1; i > 0; --i)
+            {
+                to->children_[i] = to->children_[i - 1];
+            }
+            to->keys_.relocate(0, index - 1, parent->keys_);
+            to->children_[0] = from->children_[from->count_];
+            parent->keys_.relocate(index - 1, --from->count_, from->keys_);
+            ++to->count_;
+        }
+    }
+    else if (right != nullptr && right->count_ > spare)
+    {
+        if (child->leaf_)
+        {
+            Leaf* to = static_cast<Leaf*>(child);
+            Leaf* from = static_cast<Leaf*>(right);
+            to->items_.relocate(to->count_++, 0, from->items_);
+            for (std::size_t i = 1; i < from->count_; ++i)
+            {
+                from->items_.relocate(i - 1, i, from->items_);
+            }
+            --from->count_;
+            parent->keys_[index] = from->items_[0].first;
+        }
+        else
+        {
+            Inner* to = static_cast<Inner*>(child);
+            Inner* from = static_cast<Inner*>(right);
+            to->keys_.relocate(to->count_, index, parent->keys_);
+            to->children_[++to->count_] = from->children_[0];
+            parent->keys_.relocate(index, 0, from->keys_);
+            for (std::size_t i = 1; i < from->count_; ++i)
+            {
+                from->keys_.relocate(i - 1, i, from->keys_);
+            }
+            for (std::size_t i = 1; i <= from->count_; ++i)
+            {
+                from->children_[i - 1] = from->children_[i];
+            }
+            --from->count_;
+        }
+    }
+    else
+    {
+        mergeChildren(parent, left != nullptr ? index - 1 : index);
+    }
+}
+
+/**
+* Moves everything in the child after index into the child at index and
+* frees it. Two children merge only when one is underfull and the other
+* cannot spare an entry, so the result always fits.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::mergeChildren(Inner* parent, std::size_t index)
+{
+    NodeBase* into = parent->children_[index];
+    NodeBase* from = parent->children_[index + 1];
+    if (into->leaf_)
+    {
+        Leaf* to = static_cast<Leaf*>(into);
+        Leaf* source = static_cast<Leaf*>(from);
+        for (std::size_t i = 0; i < source->count_; ++i)
+        {
+            to->items_.relocate(to->count_++, i, source->items_);
+        }
+        source->count_ = 0;
+        to->next_ = source->next_;
+        if (to->next_ != nullptr)
+        {
+            to->next_->prev_ = to;
+        }
+    }
+    else
+    {
+        // the separator comes down between the two halves
+        Inner* to = static_cast<Inner*>(into);
+        Inner* source = static_cast<Inner*>(from);
+        to->keys_.construct(to->count_, parent->keys_[index]);
+        for (std::size_t i = 0; i < source->count_; ++i)
+        {
+            to->keys_.relocate(to->count_ + 1 + i, i, source->keys_);
+        }
+        for (std::size_t i = 0; i <= source->count_; ++i)
+        {
+            to->children_[to->count_ + 1 + i] = source->children_[i];
+        }
+        to->count_ += 1 + source->count_;
+        source->count_ = 0;
+    }
+    freeNode(from);
+    eraseChild(parent, index);
+}
+
+/**
+* Drops the key at index and the child after it from parent.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::eraseChild(Inner* parent, std::size_t index)
+{
+    parent->keys_.destroy(index);
+    for (std::size_t i = index + 1; i < parent->count_; ++i)
+    {
+        parent->keys_.relocate(i - 1, i, parent->keys_);
+    }
+    for (std::size_t i = index + 2; i <= parent->count_; ++i)
+    {
+        parent->children_[i - 1] = parent->children_[i];
+    }
+    --parent->count_;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::Leaf*
+BTree<Key, Value, Compare, Alloc, Fanout>::newLeaf()
+{
+    Leaf* leaf = new (leaves_->allocate()) Leaf;
+    leaf->leaf_ = true;
+    leaf->count_ = 0;
+    leaf->prev_ = nullptr;
+    leaf->next_ = nullptr;
+    return leaf;
+}
+
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+typename BTree<Key, Value, Compare, Alloc, Fanout>::Inner*
+BTree<Key, Value, Compare, Alloc, Fanout>::newInner()
+{
+    Inner* inner = new (inners_->allocate()) Inner;
+    inner->leaf_ = false;
+    inner->count_ = 0;
+    return inner;
+}
+
+/**
+* Frees an emptied node. Its items or keys must already be gone.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::freeNode(NodeBase* node)
+{
+    if (node->leaf_)
+    {
+        static_cast<Leaf*>(node)->~Leaf();
+        leaves_->deallocate(node);
+    }
+    else
+    {
+        static_cast<Inner*>(node)->~Inner();
+        inners_->deallocate(node);
+    }
+}
+
+/**
+* Runs the destructor of every item and key below node. The memory is
+* handed back by clear().
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+void BTree<Key, Value, Compare, Alloc, Fanout>::destroyAll(NodeBase* node)
+{
+    if (node->leaf_)
+    {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        for (std::size_t i = 0; i < leaf->count_; ++i)
+        {
+            leaf->items_.destroy(i);
+        }
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (std::size_t i = 0; i < inner->count_; ++i)
+    {
+        inner->keys_.destroy(i);
+    }
+    for (std::size_t i = 0; i <= inner->count_; ++i)
+    {
+        destroyAll(inner->children_[i]);
+    }
+}
+
+/**
+* Checks the subtree at node, whose keys must lie in [lo, hi) (an open
+* end where null). previous is the last leaf seen in order and items
+* counts the items. Returns the subtree's height, or 0 on a violation.
+*/
+template<class Key, class Value, class Compare, class Alloc, std::size_t Fanout>
+std::size_t BTree<Key, Value, Compare, Alloc, Fanout>::validateNode(const NodeBase* node, const Key* lo,
+                                                                    const Key* hi, bool root,
+                                                                    const Leaf*& previous,
+                                                                    std::size_t& items) const
+{
+    if (node->leaf_)
+    {
+        const Leaf* leaf = static_cast<const Leaf*>(node);
+        if (leaf->count_ == 0 || leaf->count_ > LEAF_CAPACITY || (!root && leaf->count_ < LEAF_MIN) ||
+            leaf->prev_ != previous || (previous == nullptr ? first_ != leaf : previous->next_ != leaf))
+        {
+            return 0;
+        }
+        for (std::size_t i = 0; i < leaf->count_; ++i)
+        {
+            const Key& key = leaf->items_[i].first;
+            if ((lo != nullptr && comp_(key, *lo)) || (hi != nullptr && !comp_(key, *hi)) ||
+                (i > 0 && !comp_(leaf->items_[i - 1].first, key)))
+            {
+                return 0;
+            }
+        }
+        previous = leaf;
+        items += leaf->count_;
+        return 1;
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    if (inner->count_ == 0 || inner->count_ >= INNER_FANOUT || (!root && inner->count_ + 1 < INNER_MIN))
+    {
+        return 0;
+    }
+    std::size_t height = 0;
+    for (std::size_t i = 0; i <= inner->count_; ++i)
+    {
+        const Key* childLo = i == 0 ? lo : &inner->keys_[i - 1];
+        const Key* childHi = i == inner->count_ ? hi : &inner->keys_[i];
+        if (childLo != nullptr && childHi != nullptr && !comp_(*childLo, *childHi))
+        {
+            return 0;
+        }
+        std::size_t childHeight = validateNode(inner->children_[i], childLo, childHi, false, previous, items);
+        if (childHeight == 0 || (height != 0 && childHeight != height))
+        {
+            return 0;
+        }
+        height = childHeight;
+    }
+    return height + 1;
+}
+
+/*
+----------------------------------------
+End implementations for the BTree class.
+----------------------------------------
+*/
+
+#endif
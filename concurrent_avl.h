@@ -0,0 +1,399 @@
+#ifndef CONCURRENT_AVL_H
+#define CONCURRENT_AVL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "persistent_avl.h"
+#include "bst_epoch.h"
+
+/**
+* An AVL tree that any number of threads can read without locking while
+* writers keep changing it.
+*
+* Writers take a mutex and apply their change to a PersistentAVLTree. A
+* Snapshot of the result is then published through one atomic pointer
+* (RCU style). Because the published version always shares the writer's
+* nodes, every write copies the nodes on its path instead of changing a
+* node a reader might be on. Readers load the pointer and search the
+* version they got. Nothing a reader can see is ever modified.
+*
+* Replaced versions are retired, not destroyed, and are freed once no
+* reader can still be inside them; see bst_epoch.h. Reads pin the epoch
+* for their duration, so find(), contains() and operator[] cost a normal
+* descent plus a couple of uncontended atomic operations, and scale with
+* the number of reading cores. For iteration or several reads of one
+* consistent version, take a ReadView.
+*
+* Values are returned by copy, since a reference could outlive the
+* version it points into. The tree must not be destroyed while other
+* threads still use it.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> > >
+class ConcurrentAVLTree
+{
+protected:
+    typedef PersistentAVLTree<Key, Value, Compare, Alloc> VersionTree;
+    typedef typename VersionTree::Snapshot Snapshot;
+
+public:
+    typedef typename VersionTree::iterator iterator;
+    typedef iterator const_iterator;
+
+    /**
+    * One published version, pinned for as long as the view lives. Its
+    * iterators and references stay valid until then. A view must be
+    * destroyed on the thread that took it, and should not be held for
+    * long, since no version retired while it is alive can be freed.
+    */
+    class ReadView
+    {
+    public:
+        ReadView(ReadView&& other);
+        ~ReadView();
+
+        iterator begin() const;
+        iterator end() const;
+        iterator find(const Key& key) const;
+        iterator lower_bound(const Key& key) const;
+        iterator upper_bound(const Key& key) const;
+        Value const & operator[](const Key& key) const;
+        std::size_t size() const;
+        bool empty() const;
+
+    protected:
+        friend class ConcurrentAVLTree<Key, Value, Compare, Alloc>;
+        explicit ReadView(const std::atomic<const Snapshot*>& published);
+
+        // A pin belongs to a thread, so a view is never copied.
+        ReadView(const ReadView&);
+        ReadView& operator=(const ReadView&);
+
+        const Snapshot* version_;   // nullptr once moved from
+    };
+
+public:
+    ConcurrentAVLTree();
+    explicit ConcurrentAVLTree(const Compare& comp, const Alloc& alloc = Alloc());
+    ~ConcurrentAVLTree();
+
+    // Writes, serialized among themselves; readers never wait for them
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+
+    // Lock-free reads of the latest published version
+    bool contains(const Key& key) const;
+    bool find(const Key& key, Value& value) const;
+    Value operator[](const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    ReadView read() const;
+
+protected:
+    static const std::size_t RECLAIM_BATCH = 64;
+
+    // Readers may hold pointers into the tree, so it cannot be copied.
+    ConcurrentAVLTree(const ConcurrentAVLTree&);
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&);
+
+    void publish();
+    void reclaim();
+
+    VersionTree writer_;
+    std::atomic<const Snapshot*> published_;
+    std::mutex writeMutex_;
+    std::vector<std::pair<uint64_t, const Snapshot*> > retired_;
+};
+
+/*
+----------------------------------------------------------------
+Begin implementations for the ConcurrentAVLTree::ReadView class.
+----------------------------------------------------------------
+*/
+
+/**
+* Pins the epoch first, so the version loaded next cannot be freed
+* under the view.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::ReadView(const std::atomic<const Snapshot*>& published)
+{
+    bst_epoch::pin();
+    version_ = published.load(std::memory_order_acquire);
+}
+
+/**
+* Takes over other's pin; other is left empty and unpins nothing.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::ReadView(ReadView&& other) :
+    version_(other.version_)
+{
+    other.version_ = nullptr;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::~ReadView()
+{
+    if (version_ != nullptr)
+    {
+        bst_epoch::unpin();
+    }
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::iterator
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::begin() const
+{
+    return version_->begin();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::iterator
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::end() const
+{
+    return version_->end();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::iterator
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::find(const Key& key) const
+{
+    return version_->find(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::iterator
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::lower_bound(const Key& key) const
+{
+    return version_->lower_bound(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::iterator
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::upper_bound(const Key& key) const
+{
+    return version_->upper_bound(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+Value const & ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::operator[](const Key& key) const
+{
+    return (*version_)[key];
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::size() const
+{
+    return version_->size();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView::empty() const
+{
+    return version_->empty();
+}
+
+/*
+--------------------------------------------------------------
+End implementations for the ConcurrentAVLTree::ReadView class.
+--------------------------------------------------------------
+*/
+
+/*
+------------------------------------------------------
+Begin implementations for the ConcurrentAVLTree class.
+------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ConcurrentAVLTree() :
+    writer_(Compare(), Alloc()), published_(new Snapshot(writer_.snapshot()))
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::ConcurrentAVLTree(const Compare& comp, const Alloc& alloc) :
+    writer_(comp, alloc), published_(new Snapshot(writer_.snapshot()))
+{
+
+}
+
+/**
+* Frees every version. No other thread may be using the tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::~ConcurrentAVLTree()
+{
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+    {
+        delete retired_[i].second;
+    }
+    delete published_.load(std::memory_order_relaxed);
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already there,
+* and publishes the result. Returns whether the key was new.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    bool inserted = writer_.insert(keyValuePair).second;
+    publish();
+    return inserted;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    bool inserted = writer_.insert(std::move(keyValuePair)).second;
+    publish();
+    return inserted;
+}
+
+/**
+* Removes the key if it is there. Nothing is published if it is not.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    std::size_t before = writer_.size();
+    writer_.remove(key);
+    if (writer_.size() != before)
+    {
+        publish();
+    }
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc>::clear()
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    writer_.clear();
+    publish();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::contains(const Key& key) const
+{
+    bst_epoch::Guard guard;
+    return published_.load(std::memory_order_acquire)->lookup(key) != nullptr;
+}
+
+/**
+* Copies the value stored under key into value and returns true, or
+* returns false if the key is not there.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::find(const Key& key, Value& value) const
+{
+    bst_epoch::Guard guard;
+    const Value* found = published_.load(std::memory_order_acquire)->lookup(key);
+    if (found == nullptr)
+    {
+        return false;
+    }
+    value = *found;
+    return true;
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns a copy of the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value ConcurrentAVLTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    bst_epoch::Guard guard;
+    const Value* found = published_.load(std::memory_order_acquire)->lookup(key);
+    if(found == nullptr) throw std::out_of_range("Invalid key");
+    return *found;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t ConcurrentAVLTree<Key, Value, Compare, Alloc>::size() const
+{
+    bst_epoch::Guard guard;
+    return published_.load(std::memory_order_acquire)->size();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ConcurrentAVLTree<Key, Value, Compare, Alloc>::empty() const
+{
+    bst_epoch::Guard guard;
+    return published_.load(std::memory_order_acquire)->empty();
+}
+
+/**
+* Pins the latest version for iteration or repeated reads.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename ConcurrentAVLTree<Key, Value, Compare, Alloc>::ReadView
+ConcurrentAVLTree<Key, Value, Compare, Alloc>::read() const
+{
+    return ReadView(published_);
+}
+
+/**
+* Makes the writer's version the one readers see and retires the one
+* they saw before. Holding on to the published version is also what
+* makes the writer copy, rather than change, every node a reader can
+* reach. Called with the write mutex held.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc>::publish()
+{
+    const Snapshot* fresh = new Snapshot(writer_.snapshot());
+    const Snapshot* old = published_.exchange(fresh, std::memory_order_acq_rel);
+    retired_.push_back(std::make_pair(bst_epoch::retireEpoch(), old));
+    if (retired_.size() >= RECLAIM_BATCH)
+    {
+        reclaim();
+    }
+}
+
+/**
+* Frees the retired versions no reader can still be in. Dropping a
+* version frees just the nodes no newer version shares.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ConcurrentAVLTree<Key, Value, Compare, Alloc>::reclaim()
+{
+    uint64_t oldest = bst_epoch::minPinned();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < retired_.size(); ++i)
+    {
+        if (retired_[i].first < oldest)
+        {
+            delete retired_[i].second;
+        }
+        else
+        {
+            retired_[kept++] = retired_[i];
+        }
+    }
+    retired_.resize(kept);
+}
+
+/*
+----------------------------------------------------
+End implementations for the ConcurrentAVLTree class.
+----------------------------------------------------
+*/
+
+#endif
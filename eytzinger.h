@@ -0,0 +1,516 @@
+#ifndef EYTZINGER_H
+#define EYTZINGER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "bst_prefetch.h"
+
+/**
+* An immutable sorted map in Eytzinger (breadth-first) order, built once
+* from sorted items, for example by AVLTree::freeze().
+*
+* The keys sit in one flat array laid out like a binary heap: the root
+* at 1 and the children of k at 2k and 2k + 1. A search never follows a
+* pointer; it computes the next index, k = 2k + (keys_[k] < key), which
+* compiles to a conditional move rather than a branch. Since the 16 or so
+* descendants four levels below k are contiguous (for 4-byte keys) and
+* the array is cache-line aligned, each step prefetches the line holding
+* them, so the misses of later levels overlap. Values live in a parallel
+* array in the same order and are only touched once the key is found.
+*
+* Iterators walk the implicit tree in order, so begin() to end() visits
+* the keys in ascending order like the trees' iterators. Keys and values
+* are not stored as pairs, so dereferencing yields a pair of references,
+* std::pair<const Key&, const Value&>; it->first and it->second work as
+* before.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class EytzingerIndex
+{
+public:
+    /**
+    * A bidirectional iterator over the items in key order.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        /**
+        * What operator-> returns: holds the pair of references so that
+        * it->first reaches through it.
+        */
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& item) : item_(item) { }
+            const reference* operator->() const { return &item_; }
+        private:
+            reference item_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class EytzingerIndex<Key, Value, Compare>;
+        const_iterator(std::size_t index, const EytzingerIndex* tree);
+        std::size_t current_;       // 0 at end()
+        const EytzingerIndex* tree_;
+    };
+    typedef const_iterator iterator;
+
+public:
+    explicit EytzingerIndex(const Compare& comp = Compare());
+    template<class ForwardIt>
+    EytzingerIndex(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
+    EytzingerIndex(const EytzingerIndex& other);
+    EytzingerIndex(EytzingerIndex&& other);
+    EytzingerIndex& operator=(EytzingerIndex other);
+    ~EytzingerIndex();
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const_iterator upper_bound(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+
+    std::size_t size() const;
+    bool empty() const;
+    Compare key_comp() const;
+
+protected:
+    /**
+    * Index steps between k and the first of its descendants that a
+    * prefetch at k fetches: the most levels down whose nodes still fit
+    * in one cache line together, but at least the next level.
+    */
+    static constexpr std::size_t prefetchStride(std::size_t stride = 2)
+    {
+        return stride * 2 * sizeof(Key) > bst_prefetch::CACHE_LINE ? stride : prefetchStride(stride * 2);
+    }
+
+    std::size_t lowerIndex(const Key& key) const;
+    std::size_t upperIndex(const Key& key) const;
+    std::size_t firstIndex() const;
+    std::size_t lastIndex() const;
+    std::size_t nextIndex(std::size_t k) const;
+    std::size_t prevIndex(std::size_t k) const;
+    void allocateKeys();
+    void swap(EytzingerIndex& other);
+
+    Compare comp_;
+    std::size_t size_;
+    void* block_;           // owns the key storage
+    Key* keys_;             // keys_[1..size_], keys_[0] is never built
+    std::vector<Value> values_;     // values_[k - 1] goes with keys_[k]
+};
+
+/*
+-------------------------------------------------------------------
+Begin implementations for the EytzingerIndex::const_iterator class.
+-------------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::const_iterator::const_iterator() :
+    current_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::const_iterator::const_iterator(std::size_t index, const EytzingerIndex* tree) :
+    current_(index), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator::reference
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(tree_->keys_[current_], tree_->values_[current_ - 1]);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator::pointer
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+bool EytzingerIndex<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+bool EytzingerIndex<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator&
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator++()
+{
+    current_ = tree_->nextIndex(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Decrementing end() lands on the largest key.
+*/
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator&
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator--()
+{
+    current_ = current_ == 0 ? tree_->lastIndex() : tree_->prevIndex(current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator
+EytzingerIndex<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+-----------------------------------------------------------------
+End implementations for the EytzingerIndex::const_iterator class.
+-----------------------------------------------------------------
+*/
+
+/*
+---------------------------------------------------
+Begin implementations for the EytzingerIndex class.
+---------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::EytzingerIndex(const Compare& comp) :
+    comp_(comp), size_(0), block_(nullptr), keys_(nullptr)
+{
+
+}
+
+/**
+* Builds the index from items sorted by key with no key repeated. Each
+* item is a pair (key, value), like the trees' items.
+*/
+template<class Key, class Value, class Compare>
+template<class ForwardIt>
+EytzingerIndex<Key, Value, Compare>::EytzingerIndex(ForwardIt first, ForwardIt last, const Compare& comp) :
+    comp_(comp), size_(std::distance(first, last)), block_(nullptr), keys_(nullptr)
+{
+    // visiting the slots in order hands them the items in order
+    std::vector<ForwardIt> slots(size_ + 1);
+    for (std::size_t k = firstIndex(); k != 0; k = nextIndex(k), ++first)
+    {
+        slots[k] = first;
+    }
+    allocateKeys();
+    values_.reserve(size_);
+    std::size_t built = 0;
+    try
+    {
+        for (std::size_t k = 1; k <= size_; ++k)
+        {
+            new (keys_ + k) Key(slots[k]->first);
+            // counted before the value is copied, which may throw too
+            ++built;
+            values_.push_back(slots[k]->second);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t k = 1; k <= built; ++k)
+        {
+            keys_[k].~Key();
+        }
+        ::operator delete(block_);
+        throw;
+    }
+}
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::EytzingerIndex(const EytzingerIndex& other) :
+    comp_(other.comp_), size_(other.size_), block_(nullptr), keys_(nullptr), values_(other.values_)
+{
+    allocateKeys();
+    std::size_t built = 0;
+    try
+    {
+        for (std::size_t k = 1; k <= size_; ++k, ++built)
+        {
+            new (keys_ + k) Key(other.keys_[k]);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t k = 1; k <= built; ++k)
+        {
+            keys_[k].~Key();
+        }
+        ::operator delete(block_);
+        throw;
+    }
+}
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::EytzingerIndex(EytzingerIndex&& other) :
+    comp_(other.comp_), size_(0), block_(nullptr), keys_(nullptr)
+{
+    swap(other);
+}
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>& EytzingerIndex<Key, Value, Compare>::operator=(EytzingerIndex other)
+{
+    swap(other);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+EytzingerIndex<Key, Value, Compare>::~EytzingerIndex()
+{
+    for (std::size_t k = 1; k <= size_; ++k)
+    {
+        keys_[k].~Key();
+    }
+    ::operator delete(block_);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator EytzingerIndex<Key, Value, Compare>::begin() const
+{
+    return const_iterator(firstIndex(), this);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator EytzingerIndex<Key, Value, Compare>::end() const
+{
+    return const_iterator(0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator
+EytzingerIndex<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t k = lowerIndex(key);
+    return const_iterator(k != 0 && !comp_(key, keys_[k]) ? k : 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator
+EytzingerIndex<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(lowerIndex(key), this);
+}
+
+template<class Key, class Value, class Compare>
+typename EytzingerIndex<Key, Value, Compare>::const_iterator
+EytzingerIndex<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(upperIndex(key), this);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value const & EytzingerIndex<Key, Value, Compare>::operator[](const Key& key) const
+{
+    std::size_t k = lowerIndex(key);
+    if(k == 0 || comp_(key, keys_[k])) throw std::out_of_range("Invalid key");
+    return values_[k - 1];
+}
+
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+bool EytzingerIndex<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+Compare EytzingerIndex<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* The slot of the first key not below key, or 0 if there is none. The
+* descent runs to the bottom without branching on the comparison; the
+* answer is where it last went left, which is found by dropping the right
+* turns (trailing one bits) and that left turn from the final index.
+*/
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::lowerIndex(const Key& key) const
+{
+    std::size_t k = 1;
+    while (k <= size_)
+    {
+        bst_prefetch::prefetch(keys_ + k * prefetchStride());
+        k = 2 * k + comp_(keys_[k], key);
+    }
+    return k >> (bst_prefetch::trailingOnes(k) + 1);
+}
+
+/**
+* The slot of the first key above key, or 0 if there is none.
+*/
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::upperIndex(const Key& key) const
+{
+    std::size_t k = 1;
+    while (k <= size_)
+    {
+        bst_prefetch::prefetch(keys_ + k * prefetchStride());
+        k = 2 * k + !comp_(key, keys_[k]);
+    }
+    return k >> (bst_prefetch::trailingOnes(k) + 1);
+}
+
+/**
+* The leftmost slot, or 0 if the index is empty.
+*/
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::firstIndex() const
+{
+    if (size_ == 0)
+    {
+        return 0;
+    }
+    std::size_t k = 1;
+    while (2 * k <= size_)
+    {
+        k = 2 * k;
+    }
+    return k;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::lastIndex() const
+{
+    std::size_t k = 1;
+    while (2 * k + 1 <= size_)
+    {
+        k = 2 * k + 1;
+    }
+    return k;
+}
+
+/**
+* The in-order successor of slot k: the leftmost slot of its right
+* subtree, or else the nearest ancestor it is left of. 0 after the last.
+*/
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::nextIndex(std::size_t k) const
+{
+    if (2 * k + 1 <= size_)
+    {
+        k = 2 * k + 1;
+        while (2 * k <= size_)
+        {
+            k = 2 * k;
+        }
+        return k;
+    }
+    return k >> (bst_prefetch::trailingOnes(k) + 1);
+}
+
+template<class Key, class Value, class Compare>
+std::size_t EytzingerIndex<Key, Value, Compare>::prevIndex(std::size_t k) const
+{
+    if (2 * k <= size_)
+    {
+        k = 2 * k;
+        while (2 * k + 1 <= size_)
+        {
+            k = 2 * k + 1;
+        }
+        return k;
+    }
+    // climb past the left turns (trailing zero bits), then once more
+    while ((k & 1) == 0)
+    {
+        k >>= 1;
+    }
+    return k >> 1;
+}
+
+/**
+* Gets storage for keys_[0..size_] with keys_ on a cache line boundary,
+* so that the descendants a prefetch asks for share one line.
+*/
+template<class Key, class Value, class Compare>
+void EytzingerIndex<Key, Value, Compare>::allocateKeys()
+{
+    if (size_ == 0)
+    {
+        return;
+    }
+    block_ = ::operator new((size_ + 1) * sizeof(Key) + bst_prefetch::CACHE_LINE);
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block_);
+    address = (address + bst_prefetch::CACHE_LINE - 1) & ~std::uintptr_t(bst_prefetch::CACHE_LINE - 1);
+    keys_ = reinterpret_cast<Key*>(address);
+}
+
+template<class Key, class Value, class Compare>
+void EytzingerIndex<Key, Value, Compare>::swap(EytzingerIndex& other)
+{
+    std::swap(comp_, other.comp_);
+    std::swap(size_, other.size_);
+    std::swap(block_, other.block_);
+    std::swap(keys_, other.keys_);
+    values_.swap(other.values_);
+}
+
+/*
+-------------------------------------------------
+End implementations for the EytzingerIndex class.
+-------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+#include "btree.h"
+#include "eytzinger.h"
+#include "van_emde_boas.h"
+
+using namespace std;
+
+/**
+* Compares lookup latency across the search layouts: the pointer-based
+* AVLTree (one find() at a time, and findBatch()), a flat sorted array
+* searched with std::lower_bound, the B-tree, and the Eytzinger and van
+* Emde Boas frozen indexes. The key count grows fourfold from 1K up to the
+* limit so the table shows each layout as the data moves out of L1, L2, L3
+* and into DRAM. main() returns nonzero if any layout's checksum disagrees
+* with the AVLTree's.
+*
+*     layout-bench [max keys, default 2^22] [lookups per size, default 2^21]
+*/
+
+typedef std::pair<int,int> Item;
+
+/**
+* Runs find(key) for every probe and returns nanoseconds per lookup. The
+* values found are summed into checksum so the lookups are not optimized
+* away, and so the layouts can be checked against each other.
+*/
+template<class Find>
+double timeLookups(const vector<int>& probes, Find find, long long& checksum)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long long sum = 0;
+    for(size_t i = 0; i < probes.size(); ++i) {
+        sum += find(probes[i]);
+    }
+    chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+    checksum = sum;
+    return chrono::duration<double, nano>(stop - start).count() / probes.size();
+}
+
+/**
+* The same through findBatch(), a few hundred keys per call like a
+* request handler would.
+*/
+double timeBatched(const vector<int>& probes, const AVLTree<int,int>& tree, long long& checksum)
+{
+    const size_t perCall = 256;
+    vector<AVLTree<int,int>::const_iterator> found(perCall);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long long sum = 0;
+    for(size_t i = 0; i < probes.size(); i += perCall) {
+        size_t count = min(perCall, probes.size() - i);
+        tree.findBatch(probes.begin() + i, probes.begin() + i + count, found.begin());
+        for(size_t j = 0; j < count; ++j) {
+            sum += found[j]->second;
+        }
+    }
+    chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+    checksum = sum;
+    return chrono::duration<double, nano>(stop - start).count() / probes.size();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t maxKeys = argc > 1 ? strtoul(argv[1], nullptr, 10) : (size_t(1) << 22);
+    size_t lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : (size_t(1) << 21);
+    mt19937 random(104);
+    bool ok = true;
+
+    cout << setw(10) << "keys" << setw(10) << "avl" << setw(10) << "batch" << setw(10) << "sorted" << setw(10) << "btree"
+         << setw(10) << "eytz" << setw(10) << "veb" << "   (ns per lookup)" << endl;
+    for(size_t keys = 1024; keys <= maxKeys; keys *= 4) {
+        // distinct random keys, values derived from them
+        vector<Item> items;
+        while(items.size() < keys) {
+            for(size_t i = items.size(); i < keys; ++i) {
+                int key = static_cast<int>(random() >> 1);
+                items.push_back(make_pair(key, key ^ 0x5bd1e995));
+            }
+            sort(items.begin(), items.end());
+            items.erase(unique(items.begin(), items.end(),
+                               [](const Item& a, const Item& b) { return a.first == b.first; }),
+                        items.end());
+        }
+
+        AVLTree<int,int> avl(items.begin(), items.end());
+        BTree<int,int> btree;
+        for(size_t i = 0; i < items.size(); ++i) {
+            btree.insert(items[i]);
+        }
+        EytzingerIndex<int,int> eytzinger = avl.freeze();
+        VanEmdeBoasIndex<int,int> veb = avl.freeze<VanEmdeBoasIndex<int,int> >();
+
+        vector<int> probes(lookups);
+        uniform_int_distribution<size_t> pick(0, items.size() - 1);
+        for(size_t i = 0; i < lookups; ++i) {
+            probes[i] = items[pick(random)].first;
+        }
+
+        long long sums[6];
+        double ns[6];
+        ns[0] = timeLookups(probes, [&](int key) { return avl.find(key)->second; }, sums[0]);
+        ns[1] = timeBatched(probes, avl, sums[1]);
+        ns[2] = timeLookups(probes, [&](int key) {
+            return lower_bound(items.begin(), items.end(), key,
+                               [](const Item& item, int k) { return item.first < k; })->second;
+        }, sums[2]);
+        ns[3] = timeLookups(probes, [&](int key) { return btree.find(key)->second; }, sums[3]);
+        ns[4] = timeLookups(probes, [&](int key) { return eytzinger.find(key)->second; }, sums[4]);
+        ns[5] = timeLookups(probes, [&](int key) { return veb.find(key)->second; }, sums[5]);
+
+        cout << setw(10) << keys << fixed << setprecision(1);
+        for(int i = 0; i < 6; ++i) {
+            cout << setw(10) << ns[i];
+        }
+        for(int i = 1; i < 6; ++i) {
+            if(sums[i] != sums[0]) {
+                cout << "   checksum mismatch in column " << i + 1;
+                ok = false;
+            }
+        }
+        cout << endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+/**
+* A slab allocator for search tree nodes.
+*
+* Fixed-size slots are carved out of contiguous chunks obtained from an
+* std::allocator-compatible allocator. A freed slot is threaded onto an
+* intrusive free list and handed back out by the next allocate(). Chunks
+* are only returned to the allocator all at once, by release() or by the
+* destructor, which is what lets BinarySearchTree::clear() drop a whole
+* tree without calling into the allocator once per node.
+*
+* The slot size is a run-time value so that BinarySearchTree and the trees
+* derived from it (whose nodes are larger) can share the same pool type.
+*
+* A pool is not thread-safe by default, like the tree that owns it. While
+* several trees share one pool (see AVLTree::split), setSynchronized()
+* makes allocate(), deallocate() and adopt() take a mutex, so those trees
+* can still be used from different threads. Once only one tree is left
+* holding the pool, it turns the mutex off again.
+*/
+template <typename Alloc>
+class NodePool
+{
+public:
+    explicit NodePool(std::size_t slotSize, const Alloc& alloc = Alloc());
+    ~NodePool();
+
+    void* allocate();
+    void deallocate(void* slot);
+    void release();
+    bool adopt(NodePool& other);
+    void setSynchronized(bool on = true);
+    bool synchronized() const;
+
+    std::size_t slotSize() const;
+    Alloc allocator() const;
+
+private:
+    // Slots and chunk headers are measured in units of the strictest
+    // fundamental alignment so that any node type can live in a slot.
+    typedef std::max_align_t Unit;
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<Unit> UnitAlloc;
+    typedef std::allocator_traits<UnitAlloc> UnitTraits;
+
+    struct FreeSlot
+    {
+        FreeSlot* next_;
+    };
+
+    struct ChunkHeader
+    {
+        ChunkHeader* next_;
+        std::size_t units_;
+    };
+
+    static const std::size_t FIRST_CHUNK_SLOTS = 64;
+    static const std::size_t MAX_CHUNK_SLOTS = 4096;
+
+    // A pool owns raw memory, so copying one would double free it.
+    NodePool(const NodePool&);
+    NodePool& operator=(const NodePool&);
+
+    static std::size_t unitsFor(std::size_t bytes);
+    void* take();
+    void give(void* slot);
+    void grow();
+
+    UnitAlloc alloc_;
+    std::size_t slotUnits_;
+    ChunkHeader* chunks_;
+    FreeSlot* freeList_;
+    Unit* bump_;        // next never-used slot in the newest chunk
+    Unit* bumpEnd_;     // one past the last slot of the newest chunk
+    std::size_t nextChunkSlots_;
+    std::atomic<bool> synchronized_;
+    std::mutex mutex_;
+};
+
+/*
+  -----------------------------------------
+  Begin implementations for the NodePool class.
+  -----------------------------------------
+*/
+
+/**
+* Creates an empty pool handing out slots of at least slotSize bytes.
+* No memory is requested until the first allocate().
+*/
+template<typename Alloc>
+NodePool<Alloc>::NodePool(std::size_t slotSize, const Alloc& alloc) :
+    alloc_(alloc),
+    slotUnits_(unitsFor(slotSize < sizeof(FreeSlot) ? sizeof(FreeSlot) : slotSize)),
+    chunks_(nullptr),
+    freeList_(nullptr),
+    bump_(nullptr),
+    bumpEnd_(nullptr),
+    nextChunkSlots_(FIRST_CHUNK_SLOTS),
+    synchronized_(false)
+{
+
+}
+
+/**
+* Returns every chunk to the allocator. Objects still living in the pool
+* are not destroyed; that is the owner's job.
+*/
+template<typename Alloc>
+NodePool<Alloc>::~NodePool()
+{
+    release();
+}
+
+/**
+* Returns uninitialized storage for one slot, reusing a freed slot if
+* there is one and otherwise bumping through the newest chunk.
+*/
+template<typename Alloc>
+void* NodePool<Alloc>::allocate()
+{
+    if(synchronized_.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return take();
+    }
+    return take();
+}
+
+/**
+* Puts a slot back on the free list. The object in it must already
+* have been destroyed.
+*/
+template<typename Alloc>
+void NodePool<Alloc>::deallocate(void* slot)
+{
+    if(synchronized_.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        give(slot);
+        return;
+    }
+    give(slot);
+}
+
+/**
+* Makes allocate() and deallocate() safe to call from several threads,
+* or stops them locking again. Turn it on before the pool is shared, and
+* off only from the pool's last owner: switching off goes through the
+* mutex once, so the owner's unlocked use afterwards comes after
+* everything the other owners did while they shared the pool.
+*/
+template<typename Alloc>
+void NodePool<Alloc>::setSynchronized(bool on)
+{
+    if(on)
+    {
+        synchronized_.store(true, std::memory_order_release);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    synchronized_.store(false, std::memory_order_release);
+}
+
+template<typename Alloc>
+bool NodePool<Alloc>::synchronized() const
+{
+    return synchronized_.load(std::memory_order_acquire);
+}
+
+/**
+* Takes over every chunk of other, so that slots carved from them can be
+* handed back to this pool and are freed along with it. Slots other has
+* not handed out yet join this pool's free list. Returns false, leaving
+* both pools untouched, if the slot sizes differ or the allocators cannot
+* free each other's memory. A synchronized pool is locked throughout, so
+* trees sharing this pool may keep allocating on other threads.
+*/
+template<typename Alloc>
+bool NodePool<Alloc>::adopt(NodePool& other)
+{
+    if(&other == this || other.slotUnits_ != slotUnits_ || !(other.alloc_ == alloc_))
+    {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+    std::unique_lock<std::mutex> otherLock(other.mutex_, std::defer_lock);
+    if(synchronized_.load(std::memory_order_acquire) && other.synchronized_.load(std::memory_order_acquire))
+    {
+        std::lock(lock, otherLock);
+    }
+    else if(synchronized_.load(std::memory_order_acquire))
+    {
+        lock.lock();
+    }
+    else if(other.synchronized_.load(std::memory_order_acquire))
+    {
+        otherLock.lock();
+    }
+    while(other.freeList_ != nullptr)
+    {
+        FreeSlot* slot = other.freeList_;
+        other.freeList_ = slot->next_;
+        give(slot);
+    }
+    for(; other.bump_ != other.bumpEnd_; other.bump_ += slotUnits_)
+    {
+        give(other.bump_);
+    }
+    while(other.chunks_ != nullptr)
+    {
+        ChunkHeader* chunk = other.chunks_;
+        other.chunks_ = chunk->next_;
+        chunk->next_ = chunks_;
+        chunks_ = chunk;
+    }
+    other.release();
+    return true;
+}
+
+template<typename Alloc>
+void* NodePool<Alloc>::take()
+{
+    if(freeList_ != nullptr)
+    {
+        FreeSlot* slot = freeList_;
+        freeList_ = slot->next_;
+        return slot;
+    }
+    if(bump_ == bumpEnd_)
+    {
+        grow();
+    }
+    void* slot = bump_;
+    bump_ += slotUnits_;
+    return slot;
+}
+
+template<typename Alloc>
+void NodePool<Alloc>::give(void* slot)
+{
+    FreeSlot* freed = static_cast<FreeSlot*>(slot);
+    freed->next_ = freeList_;
+    freeList_ = freed;
+}
+
+/**
+* Hands every chunk back to the allocator in one pass over the chunk list
+* and resets the pool to its freshly constructed state.
+*/
+template<typename Alloc>
+void NodePool<Alloc>::release()
+{
+    while(chunks_ != nullptr)
+    {
+        ChunkHeader* next = chunks_->next_;
+        UnitTraits::deallocate(alloc_, reinterpret_cast<Unit*>(chunks_), chunks_->units_);
+        chunks_ = next;
+    }
+    freeList_ = nullptr;
+    bump_ = nullptr;
+    bumpEnd_ = nullptr;
+    nextChunkSlots_ = FIRST_CHUNK_SLOTS;
+}
+
+/**
+* The usable size of a slot in bytes.
+*/
+template<typename Alloc>
+std::size_t NodePool<Alloc>::slotSize() const
+{
+    return slotUnits_ * sizeof(Unit);
+}
+
+/**
+* A copy of the allocator chunks come from, for building a sibling pool.
+*/
+template<typename Alloc>
+Alloc NodePool<Alloc>::allocator() const
+{
+    return Alloc(alloc_);
+}
+
+/**
+* Rounds a byte count up to a whole number of units.
+*/
+template<typename Alloc>
+std::size_t NodePool<Alloc>::unitsFor(std::size_t bytes)
+{
+    return (bytes + sizeof(Unit) - 1) / sizeof(Unit);
+}
+
+/**
+* Requests a new chunk from the allocator. Chunks double in size up to
+* MAX_CHUNK_SLOTS so that small trees stay small and large trees need
+* few chunks.
+*/
+template<typename Alloc>
+void NodePool<Alloc>::grow()
+{
+    std::size_t headerUnits = unitsFor(sizeof(ChunkHeader));
+    std::size_t units = headerUnits + nextChunkSlots_ * slotUnits_;
+    Unit* memory = UnitTraits::allocate(alloc_, units);
+
+    ChunkHeader* chunk = reinterpret_cast<ChunkHeader*>(memory);
+    chunk->next_ = chunks_;
+    chunk->units_ = units;
+    chunks_ = chunk;
+
+    bump_ = memory + headerUnits;
+    bumpEnd_ = memory + units;
+    if(nextChunkSlots_ < MAX_CHUNK_SLOTS)
+    {
+        nextChunkSlots_ *= 2;
+    }
+}
+
+/*
+  ---------------------------------------
+  End implementations for the NodePool class.
+  ---------------------------------------
+*/
+
+#endif
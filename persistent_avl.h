@@ -0,0 +1,1101 @@
+#ifndef PERSISTENT_AVL_H
+#define PERSISTENT_AVL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "node_pool.h"
+#include "bst_compare.h"
+
+/**
+* A node of a PersistentAVLTree. Unlike Node it has no parent pointer,
+* since one node can sit in many versions of the tree at once, under a
+* different parent in each. Instead it counts how many parents (and
+* version roots) point at it, and it may only be changed in place while
+* that count is one.
+*/
+template <typename Key, typename Value>
+class PersistentNode
+{
+public:
+    template<typename... ItemArgs>
+    explicit PersistentNode(ItemArgs&&... itemArgs);
+    PersistentNode(const PersistentNode& other);
+
+    const std::pair<const Key, Value>& getItem() const;
+    const Key& getKey() const;
+    const Value& getValue() const;
+    const PersistentNode* getLeft() const;
+    const PersistentNode* getRight() const;
+
+protected:
+    template<class K, class V, class C, class A>
+    friend class PersistentAVLTree;
+
+    // Copying a shared node is what path copying does; assigning one never is.
+    PersistentNode& operator=(const PersistentNode&);
+
+    std::pair<const Key, Value> item_;
+    PersistentNode* left_;
+    PersistentNode* right_;
+    int8_t height_;
+    std::atomic<std::size_t> refs_;
+};
+
+/*
+---------------------------------------------------
+Begin implementations for the PersistentNode class.
+---------------------------------------------------
+*/
+
+/**
+* Builds a leaf, constructing the item in place, with one reference held
+* by whoever links it in.
+*/
+template<typename Key, typename Value>
+template<typename... ItemArgs>
+PersistentNode<Key, Value>::PersistentNode(ItemArgs&&... itemArgs) :
+    item_(std::forward<ItemArgs>(itemArgs)...), left_(nullptr), right_(nullptr), height_(1), refs_(1)
+{
+
+}
+
+/**
+* Copies the item and shares the children. The caller takes the extra
+* references on the children.
+*/
+template<typename Key, typename Value>
+PersistentNode<Key, Value>::PersistentNode(const PersistentNode& other) :
+    item_(other.item_), left_(other.left_), right_(other.right_), height_(other.height_), refs_(1)
+{
+
+}
+
+template<typename Key, typename Value>
+const std::pair<const Key, Value>& PersistentNode<Key, Value>::getItem() const
+{
+    return item_;
+}
+
+template<typename Key, typename Value>
+const Key& PersistentNode<Key, Value>::getKey() const
+{
+    return item_.first;
+}
+
+template<typename Key, typename Value>
+const Value& PersistentNode<Key, Value>::getValue() const
+{
+    return item_.second;
+}
+
+template<typename Key, typename Value>
+const PersistentNode<Key, Value>* PersistentNode<Key, Value>::getLeft() const
+{
+    return left_;
+}
+
+template<typename Key, typename Value>
+const PersistentNode<Key, Value>* PersistentNode<Key, Value>::getRight() const
+{
+    return right_;
+}
+
+/*
+-------------------------------------------------
+End implementations for the PersistentNode class.
+-------------------------------------------------
+*/
+
+/**
+* An AVL tree whose old versions stay readable.
+*
+* snapshot() hands out an immutable Snapshot of the current version in
+* O(1). Versions share nodes, each node counting its references, so a
+* write copies a node only when another version still points at it:
+* an insert or remove copies at most the O(log n) nodes on its path (plus
+* the few a rotation touches) and changes everything else in place. With
+* no snapshot alive no node is ever copied, and the tree costs what an
+* AVLTree would.
+*
+* A Snapshot has the read side of the usual interface: begin()/end()
+* bidirectional iterators, find(), lower_bound(), upper_bound(),
+* operator[], size(). Snapshots may be read, copied and dropped on any
+* thread while the tree keeps changing; the tree itself, like AVLTree,
+* is for one thread at a time. Nodes are freed by whichever version lets
+* go of them last, so all versions share one synchronized NodePool.
+*
+* Iterators from a Snapshot stay valid as long as the Snapshot. Iterators
+* from the tree itself are invalidated by the next write.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> > >
+class PersistentAVLTree
+{
+protected:
+    typedef PersistentNode<Key, Value> NodeType;
+
+public:
+    /**
+    * A read-only bidirectional iterator, shared by the tree and its
+    * Snapshots. There are no parent pointers to climb, so unlike
+    * AVLTree::iterator it keeps the path from the root down to its item:
+    * copying one copies that vector, and values cannot be changed through
+    * it (versions share nodes). iterator and const_iterator are the same
+    * type.
+    */
+    class iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        iterator();
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+        iterator& operator--();
+        iterator operator--(int);
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare, Alloc>;
+        explicit iterator(const NodeType* root);
+        void descend(const NodeType* node, bool toLeft);
+        const NodeType* root_;
+        std::vector<const NodeType*> path_;     // root first; empty at end()
+    };
+    typedef iterator const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef reverse_iterator const_reverse_iterator;
+
+    /**
+    * One version of the tree. Copying a Snapshot is O(1) and never copies
+    * a node; the last Snapshot (or tree) referring to a node frees it.
+    */
+    class Snapshot
+    {
+    public:
+        typedef PersistentAVLTree::iterator iterator;
+        typedef PersistentAVLTree::const_iterator const_iterator;
+        typedef PersistentAVLTree::reverse_iterator reverse_iterator;
+        typedef PersistentAVLTree::const_reverse_iterator const_reverse_iterator;
+
+        Snapshot();
+        Snapshot(const Snapshot& other);
+        Snapshot& operator=(const Snapshot& other);
+        ~Snapshot();
+
+        iterator begin() const;
+        iterator end() const;
+        reverse_iterator rbegin() const;
+        reverse_iterator rend() const;
+        iterator find(const Key& key) const;
+        iterator lower_bound(const Key& key) const;
+        iterator upper_bound(const Key& key) const;
+        Value const & operator[](const Key& key) const;
+        const Value* lookup(const Key& key) const;
+        std::size_t size() const;
+        bool empty() const;
+
+    protected:
+        friend class PersistentAVLTree<Key, Value, Compare, Alloc>;
+        Snapshot(const Compare& comp, const Alloc& alloc);
+        iterator bound(const Key& key, bool inclusive) const;
+        const NodeType* findNode(const Key& key) const;
+
+        NodeType* root_;
+        std::size_t size_;
+        std::shared_ptr<NodePool<Alloc> > pool_;
+        Compare comp_;
+    };
+
+public:
+    PersistentAVLTree();
+    explicit PersistentAVLTree(const Compare& comp, const Alloc& alloc = Alloc());
+    explicit PersistentAVLTree(const Snapshot& version);
+    PersistentAVLTree(const PersistentAVLTree& other);
+    PersistentAVLTree& operator=(const PersistentAVLTree& other);
+
+    std::pair<iterator, bool> insert(const std::pair<const Key, Value>& keyValuePair);
+    std::pair<iterator, bool> insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    Snapshot snapshot() const;
+
+    // Reads of the current version, as on a Snapshot of it
+    iterator begin() const;
+    iterator end() const;
+    reverse_iterator rbegin() const;
+    reverse_iterator rend() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+
+protected:
+    template<typename Item>
+    std::pair<iterator, bool> insertItem(Item&& keyValuePair);
+    template<typename Item>
+    bool insertAt(NodeType*& slot, Item&& keyValuePair, std::vector<const NodeType*>& path);
+    void removeAt(NodeType*& slot, const Key& key);
+    NodeType* takeMin(NodeType*& slot);
+    void makeUnique(NodeType*& slot);
+    void rebalance(NodeType*& slot);
+    static void rotateLeft(NodeType*& slot);
+    static void rotateRight(NodeType*& slot);
+    static void update(NodeType* node);
+    static int heightOf(const NodeType* node);
+    static void retain(NodeType* node);
+    static void release(NodeType* node, NodePool<Alloc>& pool);
+
+    Snapshot current_;
+};
+
+/*
+----------------------------------------------------------------
+Begin implementations for the PersistentAVLTree::iterator class.
+----------------------------------------------------------------
+*/
+
+/**
+* A default constructor that initializes the iterator to the end of an
+* empty tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::iterator() :
+    root_(nullptr)
+{
+
+}
+
+/**
+* An end() iterator for the tree under root.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::iterator(const NodeType* root) :
+    root_(root)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value>&
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator*() const
+{
+    return path_.back()->getItem();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value>*
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator->() const
+{
+    return &(path_.back()->getItem());
+}
+
+/**
+* Two iterators are equal if they are at the same node, or both at end().
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator==(const iterator& rhs) const
+{
+    const NodeType* current = path_.empty() ? nullptr : path_.back();
+    const NodeType* other = rhs.path_.empty() ? nullptr : rhs.path_.back();
+    return current == other;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Advances to the in-order successor: the leftmost node of the right
+* subtree, or else the nearest ancestor we are in the left subtree of.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator&
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator++()
+{
+    const NodeType* node = path_.back();
+    if (node->getRight() != nullptr)
+    {
+        descend(node->getRight(), true);
+        return *this;
+    }
+    const NodeType* child;
+    do
+    {
+        child = path_.back();
+        path_.pop_back();
+    } while (!path_.empty() && path_.back()->getRight() == child);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Steps back to the in-order predecessor; from end() that is the largest
+* item.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator&
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator--()
+{
+    if (path_.empty())
+    {
+        descend(root_, false);
+        return *this;
+    }
+    const NodeType* node = path_.back();
+    if (node->getLeft() != nullptr)
+    {
+        descend(node->getLeft(), false);
+        return *this;
+    }
+    const NodeType* child;
+    do
+    {
+        child = path_.back();
+        path_.pop_back();
+    } while (!path_.empty() && path_.back()->getLeft() == child);
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::operator--(int)
+{
+    iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/**
+* Pushes node and then its left (or right) children all the way down.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::iterator::descend(const NodeType* node, bool toLeft)
+{
+    while (node != nullptr)
+    {
+        path_.push_back(node);
+        node = toLeft ? node->getLeft() : node->getRight();
+    }
+}
+
+/*
+--------------------------------------------------------------
+End implementations for the PersistentAVLTree::iterator class.
+--------------------------------------------------------------
+*/
+
+/*
+----------------------------------------------------------------
+Begin implementations for the PersistentAVLTree::Snapshot class.
+----------------------------------------------------------------
+*/
+
+/**
+* An empty version that belongs to no tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::Snapshot() :
+    root_(nullptr), size_(0)
+{
+
+}
+
+/**
+* An empty version with a fresh pool, for a new tree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::Snapshot(const Compare& comp, const Alloc& alloc) :
+    root_(nullptr),
+    size_(0),
+    pool_(std::make_shared<NodePool<Alloc> >(sizeof(NodeType), alloc)),
+    comp_(comp)
+{
+    pool_->setSynchronized();
+}
+
+/**
+* Shares other's nodes by taking a reference on its root, O(1).
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::Snapshot(const Snapshot& other) :
+    root_(other.root_), size_(other.size_), pool_(other.pool_), comp_(other.comp_)
+{
+    retain(root_);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot&
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::operator=(const Snapshot& other)
+{
+    // take the new reference first, in case both share a root
+    retain(other.root_);
+    if (root_ != nullptr)
+    {
+        release(root_, *pool_);
+    }
+    root_ = other.root_;
+    size_ = other.size_;
+    pool_ = other.pool_;
+    comp_ = other.comp_;
+    return *this;
+}
+
+/**
+* Drops the reference on the root. Nodes no other version uses are freed.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::~Snapshot()
+{
+    if (root_ != nullptr)
+    {
+        release(root_, *pool_);
+    }
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::begin() const
+{
+    iterator it(root_);
+    it.descend(root_, true);
+    return it;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::end() const
+{
+    return iterator(root_);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::reverse_iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::rbegin() const
+{
+    return reverse_iterator(end());
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::reverse_iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::rend() const
+{
+    return reverse_iterator(begin());
+}
+
+/**
+* Returns an iterator to the item with the given key, or end().
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::find(const Key& key) const
+{
+    iterator it = lower_bound(key);
+    if (it != end() && comp_(key, it->first))
+    {
+        return end();
+    }
+    return it;
+}
+
+/**
+* Returns an iterator to the first item whose key is not below key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::lower_bound(const Key& key) const
+{
+    return bound(key, true);
+}
+
+/**
+* Returns an iterator to the first item whose key is above key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::upper_bound(const Key& key) const
+{
+    return bound(key, false);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value const & PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::operator[](const Key& key) const
+{
+    const NodeType* node = findNode(key);
+    if(node == nullptr) throw std::out_of_range("Invalid key");
+    return node->getValue();
+}
+
+/**
+* Returns the value stored under key, or nullptr if there is none. Unlike
+* find() it builds no iterator, so it never allocates.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+const Value* PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::lookup(const Key& key) const
+{
+    const NodeType* node = findNode(key);
+    return node == nullptr ? nullptr : &node->getValue();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::empty() const
+{
+    return root_ == nullptr;
+}
+
+/**
+* One descent that records the path, cut back to the deepest node where
+* it turned left (or stopped, for an inclusive match); that node is the
+* bound.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::bound(const Key& key, bool inclusive) const
+{
+    iterator it(root_);
+    std::size_t depth = 0;
+    const NodeType* node = root_;
+    while (node != nullptr)
+    {
+        it.path_.push_back(node);
+        int order = bst_compare::threeWay(comp_, key, node->getKey());
+        if (order < 0 || (order == 0 && inclusive))
+        {
+            depth = it.path_.size();
+            if (order == 0)
+            {
+                break;
+            }
+            node = node->getLeft();
+        }
+        else
+        {
+            node = node->getRight();
+        }
+    }
+    it.path_.resize(depth);
+    return it;
+}
+
+/**
+* The node holding key, or nullptr.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+const typename PersistentAVLTree<Key, Value, Compare, Alloc>::NodeType*
+PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot::findNode(const Key& key) const
+{
+    const NodeType* node = root_;
+    while (node != nullptr)
+    {
+        int order = bst_compare::threeWay(comp_, key, node->getKey());
+        if (order == 0)
+        {
+            return node;
+        }
+        node = order < 0 ? node->getLeft() : node->getRight();
+    }
+    return nullptr;
+}
+
+/*
+--------------------------------------------------------------
+End implementations for the PersistentAVLTree::Snapshot class.
+--------------------------------------------------------------
+*/
+
+/*
+------------------------------------------------------
+Begin implementations for the PersistentAVLTree class.
+------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::PersistentAVLTree() :
+    current_(Compare(), Alloc())
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::PersistentAVLTree(const Compare& comp, const Alloc& alloc) :
+    current_(comp, alloc)
+{
+
+}
+
+/**
+* Starts a new line of versions from an old one, O(1). Writes to the tree
+* copy nodes as needed and never show through version.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::PersistentAVLTree(const Snapshot& version) :
+    current_(version)
+{
+    if (current_.pool_ == nullptr)
+    {
+        current_ = Snapshot(Compare(), Alloc());
+    }
+}
+
+/**
+* Copies are O(1): both trees share every node until one of them writes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>::PersistentAVLTree(const PersistentAVLTree& other) :
+    current_(other.current_)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+PersistentAVLTree<Key, Value, Compare, Alloc>&
+PersistentAVLTree<Key, Value, Compare, Alloc>::operator=(const PersistentAVLTree& other)
+{
+    current_ = other.current_;
+    return *this;
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already there.
+* Returns an iterator to the item and whether the key was new.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator, bool>
+PersistentAVLTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return insertItem(keyValuePair);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::pair<typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator, bool>
+PersistentAVLTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    return insertItem(std::move(keyValuePair));
+}
+
+/**
+* Removes the key if it is there. Nothing is copied if it is not.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    if (current_.findNode(key) == nullptr)
+    {
+        return;
+    }
+    removeAt(current_.root_, key);
+    --current_.size_;
+}
+
+/**
+* Empties the current version. Snapshots keep their nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::clear()
+{
+    if (current_.root_ != nullptr)
+    {
+        release(current_.root_, *current_.pool_);
+    }
+    current_.root_ = nullptr;
+    current_.size_ = 0;
+}
+
+/**
+* Returns the current version, O(1). Later writes to the tree do not
+* show through it.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::Snapshot
+PersistentAVLTree<Key, Value, Compare, Alloc>::snapshot() const
+{
+    return current_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::begin() const
+{
+    return current_.begin();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::end() const
+{
+    return current_.end();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::reverse_iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::rbegin() const
+{
+    return current_.rbegin();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::reverse_iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::rend() const
+{
+    return current_.rend();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::find(const Key& key) const
+{
+    return current_.find(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key) const
+{
+    return current_.lower_bound(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator
+PersistentAVLTree<Key, Value, Compare, Alloc>::upper_bound(const Key& key) const
+{
+    return current_.upper_bound(key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+Value const & PersistentAVLTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    return current_[key];
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t PersistentAVLTree<Key, Value, Compare, Alloc>::size() const
+{
+    return current_.size();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool PersistentAVLTree<Key, Value, Compare, Alloc>::empty() const
+{
+    return current_.empty();
+}
+
+/**
+* Shared by both insert() overloads.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+std::pair<typename PersistentAVLTree<Key, Value, Compare, Alloc>::iterator, bool>
+PersistentAVLTree<Key, Value, Compare, Alloc>::insertItem(Item&& keyValuePair)
+{
+    iterator it;
+    it.path_.reserve(heightOf(current_.root_) + 1);
+    bool inserted = insertAt(current_.root_, std::forward<Item>(keyValuePair), it.path_);
+    if (inserted)
+    {
+        ++current_.size_;
+    }
+    it.root_ = current_.root_;
+    return std::make_pair(it, inserted);
+}
+
+/**
+* Inserts into the subtree held by slot, making every node on the way
+* down unique first so it can be changed in place. Returns whether the
+* key was new, and leaves path running from slot's node down to the
+* key's node, ready for an iterator.
+*
+* The path is recorded on the way down. A rotation on the way back up
+* only reshapes the subtree it happens in, so only the part of the path
+* below the rotated slot is walked again.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<typename Item>
+bool PersistentAVLTree<Key, Value, Compare, Alloc>::insertAt(NodeType*& slot, Item&& keyValuePair,
+                                                             std::vector<const NodeType*>& path)
+{
+    if (slot == nullptr)
+    {
+        void* memory = current_.pool_->allocate();
+        try
+        {
+            slot = new (memory) NodeType(std::forward<Item>(keyValuePair));
+        }
+        catch (...)
+        {
+            current_.pool_->deallocate(memory);
+            throw;
+        }
+        path.push_back(slot);
+        return true;
+    }
+    int order = bst_compare::threeWay(current_.comp_, keyValuePair.first, slot->getKey());
+    makeUnique(slot);
+    NodeType* node = slot;
+    path.push_back(node);
+    if (order == 0)
+    {
+        node->item_.second = std::forward<Item>(keyValuePair).second;
+        return false;
+    }
+    std::size_t depth = path.size() - 1;
+    bool inserted = insertAt(order < 0 ? node->left_ : node->right_, std::forward<Item>(keyValuePair), path);
+    rebalance(slot);
+    if (slot != node)
+    {
+        const NodeType* target = path.back();
+        path.resize(depth);
+        for (const NodeType* step = slot; ; )
+        {
+            path.push_back(step);
+            if (step == target)
+            {
+                break;
+            }
+            step = current_.comp_(target->getKey(), step->getKey()) ? step->getLeft() : step->getRight();
+        }
+    }
+    return inserted;
+}
+
+/**
+* Removes key, which must be in the subtree held by slot. A node with two
+* children is replaced by the smallest node of its right subtree.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::removeAt(NodeType*& slot, const Key& key)
+{
+    makeUnique(slot);
+    NodeType* node = slot;
+    int order = bst_compare::threeWay(current_.comp_, key, node->getKey());
+    if (order != 0)
+    {
+        removeAt(order < 0 ? node->left_ : node->right_, key);
+        rebalance(slot);
+        return;
+    }
+    if (node->left_ == nullptr || node->right_ == nullptr)
+    {
+        slot = node->left_ != nullptr ? node->left_ : node->right_;
+    }
+    else
+    {
+        NodeType* next = takeMin(node->right_);
+        next->left_ = node->left_;
+        next->right_ = node->right_;
+        slot = next;
+        rebalance(slot);
+    }
+    // the children have moved on, so only the node itself goes
+    node->left_ = nullptr;
+    node->right_ = nullptr;
+    release(node, *current_.pool_);
+}
+
+/**
+* Unlinks the smallest node of the non-empty subtree held by slot and
+* hands it, unique, to the caller.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename PersistentAVLTree<Key, Value, Compare, Alloc>::NodeType*
+PersistentAVLTree<Key, Value, Compare, Alloc>::takeMin(NodeType*& slot)
+{
+    makeUnique(slot);
+    NodeType* node = slot;
+    if (node->left_ == nullptr)
+    {
+        slot = node->right_;
+        node->right_ = nullptr;
+        return node;
+    }
+    NodeType* min = takeMin(node->left_);
+    rebalance(slot);
+    return min;
+}
+
+/**
+* Path copying happens here: if another version also points at the node
+* in slot, slot gets a private copy that shares the children instead.
+* A count of one cannot go up behind our back, since only this tree can
+* hand out new references to its nodes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::makeUnique(NodeType*& slot)
+{
+    NodeType* node = slot;
+    if (node->refs_.load(std::memory_order_acquire) == 1)
+    {
+        return;
+    }
+    void* memory = current_.pool_->allocate();
+    NodeType* copy;
+    try
+    {
+        copy = new (memory) NodeType(static_cast<const NodeType&>(*node));
+    }
+    catch (...)
+    {
+        current_.pool_->deallocate(memory);
+        throw;
+    }
+    retain(copy->left_);
+    retain(copy->right_);
+    slot = copy;
+    release(node, *current_.pool_);
+}
+
+/**
+* Restores the AVL property at the unique node in slot, whose subtrees
+* are balanced and differ in height by at most two. Rotations change
+* nodes in place, so the children they move are made unique first.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::rebalance(NodeType*& slot)
+{
+    NodeType* node = slot;
+    int balance = heightOf(node->right_) - heightOf(node->left_);
+    if (balance < -1)
+    {
+        makeUnique(node->left_);
+        if (heightOf(node->left_->right_) > heightOf(node->left_->left_))
+        {
+            makeUnique(node->left_->right_);
+            rotateLeft(node->left_);
+        }
+        rotateRight(slot);
+    }
+    else if (balance > 1)
+    {
+        makeUnique(node->right_);
+        if (heightOf(node->right_->left_) > heightOf(node->right_->right_))
+        {
+            makeUnique(node->right_->left_);
+            rotateRight(node->right_);
+        }
+        rotateLeft(slot);
+    }
+    else
+    {
+        update(node);
+    }
+}
+
+/**
+* Rotates the unique node in slot down to the left under its unique
+* right child. Links only move, so no reference count changes.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::rotateLeft(NodeType*& slot)
+{
+    NodeType* node = slot;
+    NodeType* right = node->right_;
+    node->right_ = right->left_;
+    right->left_ = node;
+    update(node);
+    update(right);
+    slot = right;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::rotateRight(NodeType*& slot)
+{
+    NodeType* node = slot;
+    NodeType* left = node->left_;
+    node->left_ = left->right_;
+    left->right_ = node;
+    update(node);
+    update(left);
+    slot = left;
+}
+
+/**
+* Recomputes a node's height from its children's.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::update(NodeType* node)
+{
+    int left = heightOf(node->left_);
+    int right = heightOf(node->right_);
+    node->height_ = static_cast<int8_t>((left > right ? left : right) + 1);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+int PersistentAVLTree<Key, Value, Compare, Alloc>::heightOf(const NodeType* node)
+{
+    return node == nullptr ? 0 : node->height_;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::retain(NodeType* node)
+{
+    if (node != nullptr)
+    {
+        node->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+* Drops one reference to node. The last one destroys it and drops its
+* references to its children in turn. The recursion only goes as deep
+* as the tree is tall.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void PersistentAVLTree<Key, Value, Compare, Alloc>::release(NodeType* node, NodePool<Alloc>& pool)
+{
+    if (node == nullptr || node->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+    release(node->left_, pool);
+    release(node->right_, pool);
+    node->~NodeType();
+    pool.deallocate(node);
+}
+
+/*
+----------------------------------------------------
+End implementations for the PersistentAVLTree class.
+----------------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,80 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "sharded_avl.h"
+
+using namespace std;
+
+/**
+* Measures how ShardedAVLTree's write throughput scales with the number
+* of shards. The map is filled with keys 0 to keys - 1 and cut into 1, 2,
+* 4, ... 64 shards; then every writer thread replaces random keys across
+* the whole range, a remove() and an insert() each, so every operation
+* also frees and takes a node from its shard's pool. With one shard all
+* writers queue on one lock; with more, writers only meet when they hit
+* the same shard at once, so throughput should climb towards the thread
+* count (on a machine with that many cores).
+*
+*     shard-bench [threads, default hardware threads but at least 4] [keys, default 2^20]
+*                 [operations per thread, default 2^19]
+*/
+
+/**
+* Runs every writer at once and returns millions of operations a second.
+*/
+double timeWriters(ShardedAVLTree<int,int>& map, unsigned threads, int keys, size_t operations)
+{
+    vector<thread> writers;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(unsigned t = 0; t < threads; ++t) {
+        writers.push_back(thread([&map, keys, operations, t]() {
+            mt19937 random(t + 1);
+            uniform_int_distribution<int> pick(0, keys - 1);
+            for(size_t i = 0; i < operations; ++i) {
+                int key = pick(random);
+                map.remove(key);
+                map.insert(make_pair(key, key));
+            }
+        }));
+    }
+    for(unsigned t = 0; t < threads; ++t) {
+        writers[t].join();
+    }
+    chrono::steady_clock::time_point stop = chrono::steady_clock::now();
+    return threads * operations / chrono::duration<double, micro>(stop - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : max(thread::hardware_concurrency(), 4u);
+    int keys = argc > 2 ? strtol(argv[2], nullptr, 10) : (1 << 20);
+    size_t operations = argc > 3 ? strtoul(argv[3], nullptr, 10) : (size_t(1) << 19);
+
+    cout << threads << " writers on " << thread::hardware_concurrency() << " hardware threads, " << keys << " keys" << endl;
+    cout << setw(10) << "shards" << setw(12) << "Mops/s" << setw(10) << "speedup" << endl;
+    double single = 0;
+    bool ok = true;
+    for(int shards = 1; shards <= 64; shards *= 2) {
+        // filled in order, shards split at maxShardSize into halves
+        ShardedAVLTree<int,int> map(2 * static_cast<size_t>(keys) / shards - 1);
+        for(int key = 0; key < keys; ++key) {
+            map.insert(make_pair(key, key));
+        }
+        double rate = timeWriters(map, threads, keys, operations);
+        if(shards == 1) {
+            single = rate;
+        }
+        cout << setw(10) << map.shardCount() << setw(12) << fixed << setprecision(2) << rate
+             << setw(9) << setprecision(2) << rate / single << "x" << endl;
+        if(map.size() != static_cast<size_t>(keys)) {
+            cerr << "size mismatch with " << shards << " shards: " << map.size() << endl;
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,742 @@
+#ifndef SHARDED_AVL_H
+#define SHARDED_AVL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+#include "bst_epoch.h"
+
+/**
+* An ordered map split by key range into AVLTree shards, each behind its
+* own mutex, so writers to different ranges do not contend.
+*
+* A point operation finds its shard in a directory of range boundaries
+* and locks only that shard. The directory is immutable once published
+* and is swapped through an atomic pointer when shards are resharded, so
+* finding a shard takes no lock; bst_epoch.h keeps replaced directories
+* and shards alive until no thread can still be looking at them.
+*
+* A shard that grows past maxShardSize is split in two at its median.
+* Every shard allocates from a node pool of its own, so writers to
+* different shards share no lock at all: the split cuts the tree with
+* AVLTree::split and then copies the upper half into a fresh pool, O(n)
+* but only once per maxShardSize / 2 inserts, O(1) per insert. A shard
+* that shrinks below a quarter of maxShardSize is joined with a neighbour
+* (AVLTree::join, which takes over the neighbour's pool in O(log n)) if
+* the neighbour is not busy and the two fit in one shard.
+*
+* Iteration runs in global key order across shards. An iterator copies
+* up to ITERATOR_BATCH items at a time out of one shard under its lock
+* and then seeks past the last of them by key, so it never holds a lock
+* between batches and never copies much more than it is asked for.
+* scan() visits a key range in place under each shard's lock instead.
+*/
+template <class Key, class Value,
+          class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, Value> > >
+class ShardedAVLTree
+{
+protected:
+    typedef CountedAVLTree<Key, Value, Compare, Alloc> Tree;
+
+    struct Shard
+    {
+        Shard(const Compare& comp, const Alloc& alloc);
+        explicit Shard(Tree&& tree);
+
+        Tree tree_;
+        std::mutex mutex_;
+        bool retired_;      // replaced by a reshard; guarded by mutex_
+    };
+
+    /**
+    * Shard i holds the keys in [bounds_[i - 1], bounds_[i]), with the
+    * outer ends open.
+    */
+    struct Directory
+    {
+        std::vector<Key> bounds_;
+        std::vector<Shard*> shards_;
+    };
+
+public:
+    /**
+    * A forward iterator over the whole map in key order, reading a batch
+    * of items ahead. Copies share the buffered items.
+    */
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        iterator();
+
+        const std::pair<const Key,Value>& operator*() const;
+        const std::pair<const Key,Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+        iterator operator++(int);
+
+    protected:
+        friend class ShardedAVLTree<Key, Value, Compare, Alloc>;
+        iterator(const ShardedAVLTree* map, const Key* from, bool inclusive);
+        const ShardedAVLTree* map_;
+        std::shared_ptr<std::vector<value_type> > items_;    // null at end()
+        std::size_t position_;
+    };
+    typedef iterator const_iterator;
+
+public:
+    explicit ShardedAVLTree(std::size_t maxShardSize = 65536, const Compare& comp = Compare(),
+                            const Alloc& alloc = Alloc());
+    ~ShardedAVLTree();
+
+    bool insert(const std::pair<const Key, Value>& keyValuePair);
+    bool insert(std::pair<const Key, Value>&& keyValuePair);
+    void remove(const Key& key);
+
+    bool contains(const Key& key) const;
+    bool find(const Key& key, Value& value) const;
+    Value operator[](const Key& key) const;
+    std::size_t size() const;
+    bool empty() const;
+    std::size_t shardCount() const;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator lower_bound(const Key& key) const;
+    template<class Visit>
+    void scan(const Key& lo, const Key& hi, Visit visit) const;
+
+protected:
+    // Shards are reached without locks, so the map cannot be copied.
+    ShardedAVLTree(const ShardedAVLTree&);
+    ShardedAVLTree& operator=(const ShardedAVLTree&);
+
+    template<class Op>
+    bool withShard(const Key& key, Op op) const;
+    std::size_t shardIndex(const Directory& directory, const Key& key) const;
+    bool fillFrom(const Key* from, bool inclusive, std::vector<std::pair<const Key, Value> >& items) const;
+    bool afterInsert(Shard& shard, bool inserted) const;
+    void splitShard(Shard* shard) const;
+    void mergeShard(Shard* shard) const;
+    void publish(Directory* next, Shard* replaced, Shard* alsoReplaced) const;
+    void reclaim() const;
+
+    static const std::size_t RECLAIM_BATCH = 16;
+    static const std::size_t ITERATOR_BATCH = 64;
+
+    std::size_t maxShardSize_;
+    Compare comp_;
+    Alloc alloc_;
+    mutable std::atomic<const Directory*> directory_;
+    mutable std::mutex reshardMutex_;   // serializes directory changes
+    mutable std::vector<std::pair<uint64_t, const Directory*> > retiredDirectories_;
+    mutable std::vector<std::pair<uint64_t, Shard*> > retiredShards_;
+};
+
+/*
+-------------------------------------------------------------
+Begin implementations for the ShardedAVLTree::iterator class.
+-------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::iterator() :
+    map_(nullptr), position_(0)
+{
+
+}
+
+/**
+* Positioned at the first key from (or after, if not inclusive) from, or
+* at the smallest key if from is null.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::iterator(const ShardedAVLTree* map, const Key* from,
+                                                               bool inclusive) :
+    map_(map), items_(std::make_shared<std::vector<value_type> >()), position_(0)
+{
+    if (!map_->fillFrom(from, inclusive, *items_))
+    {
+        items_.reset();
+    }
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value>&
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator*() const
+{
+    return (*items_)[position_];
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+const std::pair<const Key,Value>*
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator->() const
+{
+    return &(*items_)[position_];
+}
+
+/**
+* Iterators are equal if both are at end() or both are at the same key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator==(const iterator& rhs) const
+{
+    if (items_ == nullptr || rhs.items_ == nullptr)
+    {
+        return items_ == rhs.items_;
+    }
+    const Key& key = (*this)->first;
+    const Key& other = rhs->first;
+    return map_ == rhs.map_ && !map_->comp_(key, other) && !map_->comp_(other, key);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves along the buffered items, and past the last one fetches the
+* items after its key, from whichever shard holds them now.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename ShardedAVLTree<Key, Value, Compare, Alloc>::iterator&
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator++()
+{
+    if (++position_ < items_->size())
+    {
+        return *this;
+    }
+    std::shared_ptr<std::vector<value_type> > next = std::make_shared<std::vector<value_type> >();
+    if (map_->fillFrom(&items_->back().first, false, *next))
+    {
+        items_ = next;
+    }
+    else
+    {
+        items_.reset();
+    }
+    position_ = 0;
+    return *this;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ShardedAVLTree<Key, Value, Compare, Alloc>::iterator
+ShardedAVLTree<Key, Value, Compare, Alloc>::iterator::operator++(int)
+{
+    iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+-----------------------------------------------------------
+End implementations for the ShardedAVLTree::iterator class.
+-----------------------------------------------------------
+*/
+
+/*
+---------------------------------------------------
+Begin implementations for the ShardedAVLTree class.
+---------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::Shard::Shard(const Compare& comp, const Alloc& alloc) :
+    tree_(comp, alloc), retired_(false)
+{
+
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::Shard::Shard(Tree&& tree) :
+    tree_(std::move(tree)), retired_(false)
+{
+
+}
+
+/**
+* Starts with one empty shard. Shards split once they hold more than
+* maxShardSize items.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::ShardedAVLTree(std::size_t maxShardSize, const Compare& comp,
+                                                           const Alloc& alloc) :
+    maxShardSize_(maxShardSize < 4 ? 4 : maxShardSize), comp_(comp), alloc_(alloc)
+{
+    Directory* directory = new Directory;
+    directory->shards_.push_back(new Shard(comp_, alloc_));
+    directory_.store(directory, std::memory_order_release);
+}
+
+/**
+* Frees every shard. No other thread may be using the map.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+ShardedAVLTree<Key, Value, Compare, Alloc>::~ShardedAVLTree()
+{
+    const Directory* directory = directory_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < directory->shards_.size(); ++i)
+    {
+        delete directory->shards_[i];
+    }
+    delete directory;
+    for (std::size_t i = 0; i < retiredShards_.size(); ++i)
+    {
+        delete retiredShards_[i].second;
+    }
+    for (std::size_t i = 0; i < retiredDirectories_.size(); ++i)
+    {
+        delete retiredDirectories_[i].second;
+    }
+}
+
+/**
+* Inserts the pair, overwriting the value if the key is already there.
+* Returns whether the key was new.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    return withShard(keyValuePair.first,
+                     [&](Shard& shard) { return afterInsert(shard, shard.tree_.insert(keyValuePair).second); });
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::insert(std::pair<const Key, Value>&& keyValuePair)
+{
+    // the pair is only moved from once the right shard is locked
+    return withShard(keyValuePair.first, [&](Shard& shard)
+    {
+        return afterInsert(shard, shard.tree_.insert(std::move(keyValuePair)).second);
+    });
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::remove(const Key& key)
+{
+    withShard(key, [&](Shard& shard)
+    {
+        std::size_t before = shard.tree_.size();
+        shard.tree_.remove(key);
+        if (shard.tree_.size() < before && shard.tree_.size() < maxShardSize_ / 4)
+        {
+            mergeShard(&shard);
+        }
+        return true;
+    });
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::contains(const Key& key) const
+{
+    return withShard(key, [&](Shard& shard) { return shard.tree_.find(key) != shard.tree_.end(); });
+}
+
+/**
+* Copies the value stored under key into value and returns true, or
+* returns false if the key is not there.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::find(const Key& key, Value& value) const
+{
+    return withShard(key, [&](Shard& shard)
+    {
+        typename Tree::iterator it = shard.tree_.find(key);
+        if (it == shard.tree_.end())
+        {
+            return false;
+        }
+        value = it->second;
+        return true;
+    });
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns a copy of the value associated with the key
+ */
+template<class Key, class Value, class Compare, class Alloc>
+Value ShardedAVLTree<Key, Value, Compare, Alloc>::operator[](const Key& key) const
+{
+    Value value;
+    if(!find(key, value)) throw std::out_of_range("Invalid key");
+    return value;
+}
+
+/**
+* The number of items, summed shard by shard; with concurrent writers it
+* is only a close estimate.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t ShardedAVLTree<Key, Value, Compare, Alloc>::size() const
+{
+    bst_epoch::Guard guard;
+    const Directory* directory = directory_.load(std::memory_order_acquire);
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < directory->shards_.size(); ++i)
+    {
+        std::lock_guard<std::mutex> lock(directory->shards_[i]->mutex_);
+        total += directory->shards_[i]->tree_.size();
+    }
+    return total;
+}
+
+/**
+* Whether every shard is empty, checked shard by shard without copying
+* anything.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::empty() const
+{
+    bst_epoch::Guard guard;
+    const Directory* directory = directory_.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < directory->shards_.size(); ++i)
+    {
+        std::lock_guard<std::mutex> lock(directory->shards_[i]->mutex_);
+        if (!directory->shards_[i]->tree_.empty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t ShardedAVLTree<Key, Value, Compare, Alloc>::shardCount() const
+{
+    bst_epoch::Guard guard;
+    return directory_.load(std::memory_order_acquire)->shards_.size();
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ShardedAVLTree<Key, Value, Compare, Alloc>::iterator
+ShardedAVLTree<Key, Value, Compare, Alloc>::begin() const
+{
+    return iterator(this, nullptr, true);
+}
+
+template<class Key, class Value, class Compare, class Alloc>
+typename ShardedAVLTree<Key, Value, Compare, Alloc>::iterator
+ShardedAVLTree<Key, Value, Compare, Alloc>::end() const
+{
+    return iterator();
+}
+
+/**
+* Returns an iterator to the first item whose key is not below key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+typename ShardedAVLTree<Key, Value, Compare, Alloc>::iterator
+ShardedAVLTree<Key, Value, Compare, Alloc>::lower_bound(const Key& key) const
+{
+    return iterator(this, &key, true);
+}
+
+/**
+* Calls visit(item) for every item with a key in [lo, hi), in order,
+* while holding the lock of the shard the item is in. visit must not
+* call back into the map.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<class Visit>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::scan(const Key& lo, const Key& hi, Visit visit) const
+{
+    Key from(lo);
+    for (;;)
+    {
+        bst_epoch::Guard guard;
+        const Directory* directory = directory_.load(std::memory_order_acquire);
+        std::size_t index = shardIndex(*directory, from);
+        Shard* shard = directory->shards_[index];
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex_);
+            if (shard->retired_)
+            {
+                continue;
+            }
+            typename Tree::RangeView items = shard->tree_.range(from, hi);
+            for (typename Tree::iterator it = items.begin(); it != items.end(); ++it)
+            {
+                visit(*it);
+            }
+        }
+        if (index + 1 == directory->shards_.size() || !comp_(directory->bounds_[index], hi))
+        {
+            return;
+        }
+        from = directory->bounds_[index];
+    }
+}
+
+/**
+* Runs op on the locked shard that holds key and returns its result. If
+* a reshard replaced the shard before the lock was taken, looks again.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+template<class Op>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::withShard(const Key& key, Op op) const
+{
+    for (;;)
+    {
+        bst_epoch::Guard guard;
+        const Directory* directory = directory_.load(std::memory_order_acquire);
+        Shard* shard = directory->shards_[shardIndex(*directory, key)];
+        std::lock_guard<std::mutex> lock(shard->mutex_);
+        if (shard->retired_)
+        {
+            continue;
+        }
+        return op(*shard);
+    }
+}
+
+/**
+* The index of the shard whose range holds key.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+std::size_t ShardedAVLTree<Key, Value, Compare, Alloc>::shardIndex(const Directory& directory, const Key& key) const
+{
+    return std::upper_bound(directory.bounds_.begin(), directory.bounds_.end(), key, comp_) - directory.bounds_.begin();
+}
+
+/**
+* Copies into items up to ITERATOR_BATCH items of one shard from key
+* from (or after it, if not inclusive; from the start if from is null),
+* moving on to later shards while that comes up empty. Returns false if
+* there is nothing left.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::fillFrom(const Key* from, bool inclusive,
+                                                          std::vector<std::pair<const Key, Value> >& items) const
+{
+    std::unique_ptr<Key> next;
+    for (;;)
+    {
+        bst_epoch::Guard guard;
+        const Directory* directory = directory_.load(std::memory_order_acquire);
+        std::size_t index = from == nullptr ? 0 : shardIndex(*directory, *from);
+        Shard* shard = directory->shards_[index];
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex_);
+            if (shard->retired_)
+            {
+                continue;
+            }
+            typename Tree::iterator it = shard->tree_.begin();
+            if (from != nullptr)
+            {
+                it = inclusive ? shard->tree_.lower_bound(*from) : shard->tree_.upper_bound(*from);
+            }
+            for (; it != shard->tree_.end() && items.size() < ITERATOR_BATCH; ++it)
+            {
+                items.push_back(*it);
+            }
+        }
+        if (!items.empty())
+        {
+            return true;
+        }
+        if (index + 1 == directory->shards_.size())
+        {
+            return false;
+        }
+        next.reset(new Key(directory->bounds_[index]));
+        from = next.get();
+        inclusive = true;
+    }
+}
+
+/**
+* Splits the locked shard an insert has just grown too big, and passes
+* on the insert's result.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+bool ShardedAVLTree<Key, Value, Compare, Alloc>::afterInsert(Shard& shard, bool inserted) const
+{
+    if (shard.tree_.size() > maxShardSize_)
+    {
+        splitShard(&shard);
+    }
+    return inserted;
+}
+
+/**
+* Replaces the locked shard with two new shards holding its lower and
+* upper halves. The lower half keeps the old tree's nodes and pool; the
+* upper half is copied into a pool of its own, and its nodes go back to
+* the lower half's pool for later inserts there. The old shard is left
+* empty, and stays locked until it is marked retired, so nobody can see
+* it in between.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::splitShard(Shard* shard) const
+{
+    std::lock_guard<std::mutex> lock(reshardMutex_);
+    const Directory* directory = directory_.load(std::memory_order_relaxed);
+    Tree& tree = shard->tree_;
+    std::size_t index = shardIndex(*directory, tree.front().first);
+
+    // copy first, so that a throwing copy leaves the shard as it was
+    typename Tree::const_iterator median = tree.select(tree.size() / 2);
+    Key middle(median->first);
+    std::unique_ptr<Shard> upper(new Shard(comp_, alloc_));
+    upper->tree_.assign(median, tree.cend());
+    std::unique_ptr<Directory> next(new Directory(*directory));
+
+    std::pair<Tree, Tree> halves = tree.split(middle);
+    std::unique_ptr<Shard> lower(new Shard(std::move(halves.first)));
+    // let go of the shared pool before anyone can reach the lower shard
+    halves.second = Tree(comp_, alloc_);
+
+    next->bounds_.insert(next->bounds_.begin() + index, middle);
+    next->shards_[index] = lower.release();
+    next->shards_.insert(next->shards_.begin() + index + 1, upper.release());
+    publish(next.release(), shard, nullptr);
+}
+
+/**
+* Joins the locked shard with a neighbour, if the two fit in one shard
+* and neither the neighbour nor the directory is busy right now. A merge
+* can wait for a later remove, so it never waits for a lock: that keeps
+* removes from queueing on the reshard mutex and keeps two merging
+* neighbours from deadlocking.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::mergeShard(Shard* shard) const
+{
+    std::unique_lock<std::mutex> lock(reshardMutex_, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return;
+    }
+    const Directory* directory = directory_.load(std::memory_order_relaxed);
+    if (directory->shards_.size() == 1)
+    {
+        return;
+    }
+    std::size_t index = std::find(directory->shards_.begin(), directory->shards_.end(), shard) - directory->shards_.begin();
+    // try the shard on the left, then the one on the right
+    std::size_t left = index;
+    std::unique_lock<std::mutex> neighbourLock;
+    for (int side = 0; side < 2 && !neighbourLock.owns_lock(); ++side)
+    {
+        std::size_t other = side == 0 ? index - 1 : index + 1;
+        if (other >= directory->shards_.size())     // also catches index - 1 wrapping
+        {
+            continue;
+        }
+        Shard* neighbour = directory->shards_[other];
+        neighbourLock = std::unique_lock<std::mutex>(neighbour->mutex_, std::try_to_lock);
+        if (neighbourLock.owns_lock() && shard->tree_.size() + neighbour->tree_.size() > maxShardSize_ / 2)
+        {
+            neighbourLock.unlock();
+        }
+        left = std::min(index, other);
+    }
+    if (!neighbourLock.owns_lock())
+    {
+        return;
+    }
+    Shard* lower = directory->shards_[left];
+    Shard* upper = directory->shards_[left + 1];
+    Shard* merged = new Shard(comp_, alloc_);
+    merged->tree_ = Tree::join(std::move(lower->tree_), std::move(upper->tree_));
+
+    Directory* next = new Directory(*directory);
+    next->bounds_.erase(next->bounds_.begin() + left);
+    next->shards_[left] = merged;
+    next->shards_.erase(next->shards_.begin() + left + 1);
+    publish(next, lower, upper);
+}
+
+/**
+* Swaps in the new directory, then marks the replaced shards retired so
+* threads waiting on their locks look again. Called with the reshard
+* mutex and the replaced shards' locks held.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::publish(Directory* next, Shard* replaced, Shard* alsoReplaced) const
+{
+    const Directory* old = directory_.exchange(next, std::memory_order_acq_rel);
+    replaced->retired_ = true;
+    if (alsoReplaced != nullptr)
+    {
+        alsoReplaced->retired_ = true;
+    }
+    uint64_t epoch = bst_epoch::retireEpoch();
+    retiredDirectories_.push_back(std::make_pair(epoch, old));
+    retiredShards_.push_back(std::make_pair(epoch, replaced));
+    if (alsoReplaced != nullptr)
+    {
+        retiredShards_.push_back(std::make_pair(epoch, alsoReplaced));
+    }
+    if (retiredDirectories_.size() >= RECLAIM_BATCH)
+    {
+        reclaim();
+    }
+}
+
+/**
+* Frees the retired directories and shards no thread can still reach.
+* The resharding thread is itself pinned, so the shards it has just
+* retired, and still holds locked, are not freed yet.
+*/
+template<class Key, class Value, class Compare, class Alloc>
+void ShardedAVLTree<Key, Value, Compare, Alloc>::reclaim() const
+{
+    uint64_t oldest = bst_epoch::minPinned();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < retiredDirectories_.size(); ++i)
+    {
+        if (retiredDirectories_[i].first < oldest)
+        {
+            delete retiredDirectories_[i].second;
+        }
+        else
+        {
+            retiredDirectories_[kept++] = retiredDirectories_[i];
+        }
+    }
+    retiredDirectories_.resize(kept);
+    kept = 0;
+    for (std::size_t i = 0; i < retiredShards_.size(); ++i)
+    {
+        if (retiredShards_[i].first < oldest)
+        {
+            delete retiredShards_[i].second;
+        }
+        else
+        {
+            retiredShards_[kept++] = retiredShards_[i];
+        }
+    }
+    retiredShards_.resize(kept);
+}
+
+/*
+-------------------------------------------------
+End implementations for the ShardedAVLTree class.
+-------------------------------------------------
+*/
+
+#endif
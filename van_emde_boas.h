@@ -0,0 +1,451 @@
+#ifndef VAN_EMDE_BOAS_H
+#define VAN_EMDE_BOAS_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "bst_prefetch.h"
+
+/**
+* An immutable sorted map whose keys are a complete binary search tree
+* stored in van Emde Boas order, built once from sorted items, for
+* example by AVLTree::freeze<VanEmdeBoasIndex<Key, Value> >().
+*
+* The layout splits the tree of height h into a top tree of height h / 2
+* and the bottom trees hanging off it, stores the top tree first and then
+* each bottom tree, each one laid out the same way recursively. Whatever
+* the block size B of a level of the memory hierarchy (cache line, page),
+* a search then crosses O(log_B n) blocks, without the layout having to
+* know B. That is what makes it worth having for data that spills from
+* the caches into DRAM or the page cache; within the caches the
+* Eytzinger layout with prefetching is usually faster.
+*
+* A node's position is computed, not stored: for every depth d the tables
+* give the size of the top tree (T) and of the bottom trees (B) of the
+* split just above d, and the depth of that top tree's root, so the
+* position of the node i (numbered breadth-first) is that root's position
+* + T + (i & T) * B. A search keeps the positions along its path.
+*
+* The tree is complete, so it has 2^h - 1 slots for n keys; the slots
+* past the n-th in order repeat the largest key. Values are kept in key
+* order in their own array, which is also what iteration walks.
+*/
+template <class Key, class Value, class Compare = std::less<Key> >
+class VanEmdeBoasIndex
+{
+public:
+    /**
+    * A bidirectional iterator over the items in key order. Like
+    * EytzingerIndex's, it yields pairs of references.
+    */
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::pair<const Key&, const Value&> reference;
+
+        /**
+        * What operator-> returns: holds the pair of references so that
+        * it->first reaches through it.
+        */
+        class pointer
+        {
+        public:
+            explicit pointer(const reference& item) : item_(item) { }
+            const reference* operator->() const { return &item_; }
+        private:
+            reference item_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        const_iterator& operator--();
+        const_iterator operator--(int);
+
+    protected:
+        friend class VanEmdeBoasIndex<Key, Value, Compare>;
+        const_iterator(std::size_t rank, std::size_t position, const VanEmdeBoasIndex* tree);
+        void step(std::size_t rank);
+        std::size_t rank_;          // size() at end()
+        std::size_t position_;      // of the key in keys_
+        const VanEmdeBoasIndex* tree_;
+    };
+    typedef const_iterator iterator;
+
+public:
+    explicit VanEmdeBoasIndex(const Compare& comp = Compare());
+    template<class ForwardIt>
+    VanEmdeBoasIndex(ForwardIt first, ForwardIt last, const Compare& comp = Compare());
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const_iterator upper_bound(const Key& key) const;
+    Value const & operator[](const Key& key) const;
+
+    std::size_t size() const;
+    bool empty() const;
+    Compare key_comp() const;
+
+protected:
+    static const std::size_t MAX_HEIGHT = 64;
+
+    /**
+    * For one depth, the split just above it (see the class comment).
+    */
+    struct Level
+    {
+        std::size_t top_;           // T, also the mask picking the bottom tree
+        std::size_t bottom_;        // B
+        std::size_t topDepth_;      // depth of the top tree's root
+    };
+
+    template<bool Upper>
+    std::size_t search(const Key& key, std::size_t& position) const;
+    std::size_t rankOf(std::size_t node, std::size_t depth) const;
+    std::size_t positionOf(std::size_t rank) const;
+    void buildTables(std::size_t depth, std::size_t height);
+
+    Compare comp_;
+    std::size_t size_;
+    std::size_t height_;
+    std::vector<Level> levels_;             // by depth
+    std::vector<Key> keys_;                 // in van Emde Boas order
+    std::vector<Value> values_;             // in key order
+};
+
+/*
+-----------------------------------------------------------------
+Begin implementations for the VanEmdeBoasIndex::const_iterator class.
+-----------------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::const_iterator() :
+    rank_(0), position_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::const_iterator(std::size_t rank, std::size_t position,
+                                                                      const VanEmdeBoasIndex* tree) :
+    rank_(rank), position_(position), tree_(tree)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::reference
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return reference(tree_->keys_[position_], tree_->values_[rank_]);
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::pointer
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+bool VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return rank_ == rhs.rank_;
+}
+
+template<class Key, class Value, class Compare>
+bool VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return rank_ != rhs.rank_;
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator&
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator++()
+{
+    step(rank_ + 1);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    step(rank_ + 1);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator&
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator--()
+{
+    step(rank_ - 1);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator
+VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::operator--(int)
+{
+    const_iterator old(*this);
+    step(rank_ - 1);
+    return old;
+}
+
+/**
+* Moves to rank. Finding its key walks the path through the tables,
+* O(log n) arithmetic but no memory touched besides the tables.
+*/
+template<class Key, class Value, class Compare>
+void VanEmdeBoasIndex<Key, Value, Compare>::const_iterator::step(std::size_t rank)
+{
+    rank_ = rank;
+    position_ = rank_ < tree_->size_ ? tree_->positionOf(rank_) : 0;
+}
+
+/*
+---------------------------------------------------------------
+End implementations for the VanEmdeBoasIndex::const_iterator class.
+---------------------------------------------------------------
+*/
+
+/*
+------------------------------------------------------
+Begin implementations for the VanEmdeBoasIndex class.
+------------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+VanEmdeBoasIndex<Key, Value, Compare>::VanEmdeBoasIndex(const Compare& comp) :
+    comp_(comp), size_(0), height_(0)
+{
+
+}
+
+/**
+* Builds the index from items sorted by key with no key repeated. Each
+* item is a pair (key, value), like the trees' items.
+*/
+template<class Key, class Value, class Compare>
+template<class ForwardIt>
+VanEmdeBoasIndex<Key, Value, Compare>::VanEmdeBoasIndex(ForwardIt first, ForwardIt last, const Compare& comp) :
+    comp_(comp), size_(std::distance(first, last)), height_(0)
+{
+    while ((std::size_t(1) << height_) - 1 < size_)
+    {
+        ++height_;
+    }
+    levels_.resize(height_ + 1);
+    buildTables(1, height_);
+
+    std::size_t slots = (std::size_t(1) << height_) - 1;
+    std::vector<const Key*> order(slots);
+    values_.reserve(size_);
+    for (std::size_t rank = 0; rank < size_; ++rank, ++first)
+    {
+        order[positionOf(rank)] = &first->first;
+        values_.push_back(first->second);
+    }
+    for (std::size_t rank = size_; rank < slots; ++rank)
+    {
+        order[positionOf(rank)] = order[positionOf(size_ - 1)];
+    }
+    keys_.reserve(slots);
+    for (std::size_t position = 0; position < slots; ++position)
+    {
+        keys_.push_back(*order[position]);
+    }
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator VanEmdeBoasIndex<Key, Value, Compare>::begin() const
+{
+    return const_iterator(0, size_ == 0 ? 0 : positionOf(0), this);
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator VanEmdeBoasIndex<Key, Value, Compare>::end() const
+{
+    return const_iterator(size_, 0, this);
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator
+VanEmdeBoasIndex<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t position = 0;
+    std::size_t rank = search<false>(key, position);
+    if (rank == size_ || comp_(key, keys_[position]))
+    {
+        return end();
+    }
+    return const_iterator(rank, position, this);
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator
+VanEmdeBoasIndex<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    std::size_t position = 0;
+    std::size_t rank = search<false>(key, position);
+    return const_iterator(rank, position, this);
+}
+
+template<class Key, class Value, class Compare>
+typename VanEmdeBoasIndex<Key, Value, Compare>::const_iterator
+VanEmdeBoasIndex<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    std::size_t position = 0;
+    std::size_t rank = search<true>(key, position);
+    return const_iterator(rank, position, this);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value const & VanEmdeBoasIndex<Key, Value, Compare>::operator[](const Key& key) const
+{
+    const_iterator it = find(key);
+    if(it == end()) throw std::out_of_range("Invalid key");
+    return values_[it.rank_];
+}
+
+template<class Key, class Value, class Compare>
+std::size_t VanEmdeBoasIndex<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+bool VanEmdeBoasIndex<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+Compare VanEmdeBoasIndex<Key, Value, Compare>::key_comp() const
+{
+    return comp_;
+}
+
+/**
+* The rank of the first key not below key (above key, if Upper), or
+* size() if there is none, with the key's place in keys_ stored in
+* position. The descent numbers the nodes breadth-first
+* like EytzingerIndex does and works out each node's position from the
+* positions of its ancestors.
+*/
+template<class Key, class Value, class Compare>
+template<bool Upper>
+std::size_t VanEmdeBoasIndex<Key, Value, Compare>::search(const Key& key, std::size_t& position) const
+{
+    std::size_t path[MAX_HEIGHT + 1];
+    path[1] = 0;
+    std::size_t node = 1;
+    if (height_ != 0)
+    {
+        node = 2 + (Upper ? !comp_(key, keys_[0]) : comp_(keys_[0], key));
+    }
+    for (std::size_t depth = 2; depth <= height_; ++depth)
+    {
+        const Level& level = levels_[depth];
+        path[depth] = path[level.topDepth_] + level.top_ + (node & level.top_) * level.bottom_;
+        const Key& here = keys_[path[depth]];
+        node = 2 * node + (Upper ? !comp_(key, here) : comp_(here, key));
+    }
+    unsigned up = bst_prefetch::trailingOnes(node) + 1;
+    node >>= up;
+    if (node == 0)
+    {
+        return size_;
+    }
+    // the answer is the ancestor where the descent last went left
+    std::size_t depth = height_ + 1 - up;
+    std::size_t rank = rankOf(node, depth);
+    position = path[depth];
+    return rank < size_ ? rank : size_;
+}
+
+/**
+* The in-order rank of the node numbered node (breadth-first, from 1) at
+* depth depth.
+*/
+template<class Key, class Value, class Compare>
+std::size_t VanEmdeBoasIndex<Key, Value, Compare>::rankOf(std::size_t node, std::size_t depth) const
+{
+    std::size_t across = node - (std::size_t(1) << (depth - 1));
+    return ((2 * across + 1) << (height_ - depth)) - 1;
+}
+
+/**
+* The position in keys_ of the node with in-order rank rank.
+*/
+template<class Key, class Value, class Compare>
+std::size_t VanEmdeBoasIndex<Key, Value, Compare>::positionOf(std::size_t rank) const
+{
+    // rank + 1 = (2 * across + 1) << (height_ - depth)
+    std::size_t below = 0;
+    while (((rank + 1) >> below & 1) == 0)
+    {
+        ++below;
+    }
+    std::size_t depth = height_ - below;
+    std::size_t node = (std::size_t(1) << (depth - 1)) + ((rank + 1) >> (below + 1));
+    std::size_t path[MAX_HEIGHT + 1];
+    path[1] = 0;
+    for (std::size_t d = 2; d <= depth; ++d)
+    {
+        const Level& level = levels_[d];
+        path[d] = path[level.topDepth_] + level.top_ + ((node >> (depth - d)) & level.top_) * level.bottom_;
+    }
+    return path[depth];
+}
+
+/**
+* Fills in the tables for the tree of the given height whose root is at
+* depth, by splitting it into a top tree and bottom trees and recursing
+* into both.
+*/
+template<class Key, class Value, class Compare>
+void VanEmdeBoasIndex<Key, Value, Compare>::buildTables(std::size_t depth, std::size_t height)
+{
+    if (height <= 1)
+    {
+        return;
+    }
+    std::size_t topHeight = height / 2;
+    std::size_t bottomHeight = height - topHeight;
+    std::size_t split = depth + topHeight;
+    levels_[split].top_ = (std::size_t(1) << topHeight) - 1;
+    levels_[split].bottom_ = (std::size_t(1) << bottomHeight) - 1;
+    levels_[split].topDepth_ = depth;
+    buildTables(depth, topHeight);
+    buildTables(split, bottomHeight);
+}
+
+/*
+----------------------------------------------------
+End implementations for the VanEmdeBoasIndex class.
+----------------------------------------------------
+*/
+
+#endif